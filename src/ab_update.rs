@@ -0,0 +1,719 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Writes a locally built image to the inactive slot of a DUT over ssh.
+//!
+//! Unlike `cros flash`, this does not start a devserver nor generate an
+//! update payload for the whole image. Each partition is streamed from the
+//! image file to the DUT (in parallel), hashed while it is sent, and verified
+//! on the DUT before the slot is marked as bootable.
+//!
+//! In delta mode, the partitions on the DUT are hashed in chunks while the
+//! host hashes the image, and only the chunks which differ are written:
+//! from the active slot if it already has the same data, or over ssh
+//! otherwise.
+//!
+//! Writing (staging) and switching to the written slot can be done
+//! separately, so that an image can be written slowly while the DUT keeps
+//! running on the active slot.
+
+use std::collections::HashMap;
+use std::fs;
+use std::fs::File;
+use std::io::Read;
+use std::io::Seek;
+use std::io::SeekFrom;
+use std::io::Write;
+use std::path::Path;
+use std::path::PathBuf;
+use std::process::Stdio;
+use std::thread;
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use sha2::Digest;
+use sha2::Sha256;
+use tracing::info;
+
+use crate::chroot::Chroot;
+use crate::dut::SshInfo;
+use crate::image::DiskImage;
+use crate::image::Partition;
+use crate::util::cro3_paths::cro3_dir;
+use crate::util::hash::hex_digest;
+use crate::util::hash::sha256_hex;
+
+const CHUNK_SIZE: usize = 4 << 20;
+/// Number of chunks hashed in parallel on the DUT
+const DUT_HASH_JOBS: usize = 4;
+const STATEFUL_DIR: &str = "/mnt/stateful_partition";
+/// Stateful payload staged on the DUT, unpacked when the slot is activated
+const STAGED_PAYLOAD: &str = "cro3_staged_stateful.tgz";
+/// Kernel partition number of the staged slot
+const STAGED_MARKER: &str = "cro3_staged_kern";
+/// Kernel partition attributes for a slot which has not been booted yet:
+/// tries=6, successful=0
+const KERNEL_TRIES: u32 = 6;
+
+/// A partition or payload sent to the DUT by AbUpdateTarget::stage()
+#[derive(Debug, Clone)]
+pub struct Transfer {
+    /// Label of the partition in the image (e.g. ROOT-A), or "stateful"
+    pub name: String,
+    pub start: Instant,
+    pub duration: Duration,
+    /// Bytes sent over ssh
+    pub bytes: u64,
+}
+
+/// Partition numbers of a slot on the DUT
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Slot {
+    pub kern: u32,
+    pub root: u32,
+}
+
+/// Returns the running slot and the other one, from the root device (e.g.
+/// /dev/nvme0n1p3) and the partition numbers of the DUT.
+pub fn slots(rootdev: &str, partnum_info: &HashMap<String, String>) -> Result<(Slot, Slot)> {
+    let get = |key: &str| -> Result<u32> {
+        partnum_info
+            .get(key)
+            .context(format!("{key} is not found in the partition info"))?
+            .parse()
+            .context(format!("Failed to parse {key}"))
+    };
+    let a = Slot {
+        kern: get("kern_a")?,
+        root: get("root_a")?,
+    };
+    let b = Slot {
+        kern: get("kern_b")?,
+        root: get("root_b")?,
+    };
+    let current: u32 = rootdev
+        .trim()
+        .rsplit(|c: char| !c.is_ascii_digit())
+        .next()
+        .unwrap_or_default()
+        .parse()
+        .context(format!("Failed to get the partition number of {rootdev}"))?;
+    if current == a.root {
+        Ok((a, b))
+    } else if current == b.root {
+        Ok((b, a))
+    } else {
+        bail!(
+            "{rootdev} is neither ROOT-A ({}) nor ROOT-B ({})",
+            a.root,
+            b.root
+        )
+    }
+}
+
+/// Limits the rate of a transfer by sleeping between chunks
+struct Throttle {
+    bytes_per_sec: Option<u64>,
+    start: Instant,
+    sent: u64,
+}
+impl Throttle {
+    fn new(bytes_per_sec: Option<u64>) -> Self {
+        Self {
+            bytes_per_sec,
+            start: Instant::now(),
+            sent: 0,
+        }
+    }
+    fn consume(&mut self, n: usize) {
+        let Some(limit) = self.bytes_per_sec else {
+            return;
+        };
+        self.sent += n as u64;
+        let expected = Duration::from_secs_f64(self.sent as f64 / limit.max(1) as f64);
+        if let Some(wait) = expected.checked_sub(self.start.elapsed()) {
+            thread::sleep(wait);
+        }
+    }
+}
+
+/// How a chunk of the inactive slot is brought up to date in delta mode
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum ChunkAction {
+    Keep,
+    CopyFromActive,
+    Send,
+}
+
+/// Parse the output of the chunk hashing script ("index sha256 -" lines).
+fn parse_chunk_hashes(output: &str) -> HashMap<u64, String> {
+    output
+        .lines()
+        .filter_map(|line| {
+            let mut fields = line.split_whitespace();
+            let index = fields.next()?.parse().ok()?;
+            Some((index, fields.next()?.to_string()))
+        })
+        .collect()
+}
+
+/// Decide how to update each chunk, from the hashes of the new image and the
+/// ones of the inactive and active partitions on the DUT.
+fn plan_delta(
+    new: &[String],
+    inactive: &HashMap<u64, String>,
+    active: &HashMap<u64, String>,
+) -> Vec<ChunkAction> {
+    new.iter()
+        .enumerate()
+        .map(|(i, hash)| {
+            let i = i as u64;
+            if inactive.get(&i) == Some(hash) {
+                ChunkAction::Keep
+            } else if active.get(&i) == Some(hash) {
+                ChunkAction::CopyFromActive
+            } else {
+                ChunkAction::Send
+            }
+        })
+        .collect()
+}
+
+fn chunk_indices(actions: &[ChunkAction], action: ChunkAction) -> Vec<String> {
+    actions
+        .iter()
+        .enumerate()
+        .filter(|(_, a)| **a == action)
+        .map(|(i, _)| i.to_string())
+        .collect()
+}
+
+/// Returns the hashes of each chunk of a partition in the image, and the
+/// hash of the whole partition.
+fn hash_chunks(image: &Path, src: &Partition) -> Result<(Vec<String>, String)> {
+    let mut file = File::open(image)?;
+    file.seek(SeekFrom::Start(src.offset()))?;
+    let mut file = file.take(src.size());
+    let mut total = Sha256::new();
+    let mut chunks = Vec::new();
+    let mut buf = vec![0u8; CHUNK_SIZE];
+    loop {
+        let mut n = 0;
+        while n < CHUNK_SIZE {
+            let r = file.read(&mut buf[n..])?;
+            if r == 0 {
+                break;
+            }
+            n += r;
+        }
+        if n == 0 {
+            break;
+        }
+        total.update(&buf[..n]);
+        chunks.push(sha256_hex(&buf[..n]));
+    }
+    Ok((chunks, hex_digest(total)))
+}
+
+/// Returns the slot which is not running.
+pub fn inactive_slot(rootdev: &str, partnum_info: &HashMap<String, String>) -> Result<Slot> {
+    Ok(slots(rootdev, partnum_info)?.1)
+}
+
+/// Returns the device of a partition on the disk (e.g. /dev/nvme0n1 and 3
+/// -> /dev/nvme0n1p3, /dev/sda and 3 -> /dev/sda3).
+pub fn partition_device(disk: &str, number: u32) -> String {
+    if disk.ends_with(|c: char| c.is_ascii_digit()) {
+        format!("{disk}p{number}")
+    } else {
+        format!("{disk}{number}")
+    }
+}
+
+/// AbUpdateTarget is a DUT to be updated, with its inactive slot
+#[derive(Debug, Clone)]
+pub struct AbUpdateTarget {
+    ssh: SshInfo,
+    disk: String,
+    slot: Slot,
+    active: Slot,
+    delta: bool,
+    bandwidth_limit: Option<u64>,
+    clobber_stateful: bool,
+    clear_tpm_owner: bool,
+}
+impl AbUpdateTarget {
+    /// Inspect the DUT. This can be done while the image is being built.
+    pub fn prepare(ssh: &SshInfo, board: &str) -> Result<Self> {
+        let dut_board = ssh.get_board()?;
+        if dut_board != board {
+            bail!("DUT board is {dut_board} but the image is for {board}");
+        }
+        let (active, slot) = slots(&ssh.get_rootdev()?, &ssh.get_partnum_info()?)?;
+        let disk = ssh.get_rootdisk()?;
+        info!(
+            "{}: will write to KERN {} and ROOT {} of {disk}",
+            ssh.host_and_port(),
+            slot.kern,
+            slot.root
+        );
+        Ok(Self::new(ssh, &disk, active, slot))
+    }
+    /// Write to `slot` of `disk`, while the DUT is running on `active`.
+    pub fn new(ssh: &SshInfo, disk: &str, active: Slot, slot: Slot) -> Self {
+        Self {
+            ssh: ssh.clone(),
+            disk: disk.to_string(),
+            slot,
+            active,
+            delta: false,
+            bandwidth_limit: None,
+            clobber_stateful: false,
+            clear_tpm_owner: false,
+        }
+    }
+    /// Write only the chunks which differ from the ones on the DUT.
+    pub fn with_delta(mut self, delta: bool) -> Self {
+        self.delta = delta;
+        self
+    }
+    /// Limit the bandwidth of each transfer (bytes per second), and lower
+    /// the I/O priority on the DUT so that it does not disturb the running
+    /// workload.
+    pub fn with_bandwidth_limit(mut self, bytes_per_sec: Option<u64>) -> Self {
+        self.bandwidth_limit = bytes_per_sec;
+        self
+    }
+    /// Wipe the stateful partition (except the new payload) on the next
+    /// boot, like `cros flash --clobber-stateful`.
+    pub fn with_clobber_stateful(mut self, clobber: bool) -> Self {
+        self.clobber_stateful = clobber;
+        self
+    }
+    /// Clear the TPM owner on the next boot, like `cros flash
+    /// --clear-tpm-owner`.
+    pub fn with_clear_tpm_owner(mut self, clear: bool) -> Self {
+        self.clear_tpm_owner = clear;
+        self
+    }
+    pub fn slot(&self) -> Slot {
+        self.slot
+    }
+    pub fn delta(&self) -> bool {
+        self.delta
+    }
+    pub fn clobber_stateful(&self) -> bool {
+        self.clobber_stateful
+    }
+    pub fn clear_tpm_owner(&self) -> bool {
+        self.clear_tpm_owner
+    }
+    /// Prefix of the commands which do heavy I/O on the DUT
+    fn io_priority(&self) -> &'static str {
+        if self.bandwidth_limit.is_some() {
+            "ionice -c3 nice -n19 "
+        } else {
+            ""
+        }
+    }
+    /// Returns the chunk hashes of the partition `number` of the DUT.
+    fn hash_dut_chunks(&self, number: u32, chunks: usize) -> Result<HashMap<u64, String>> {
+        let dev = partition_device(&self.disk, number);
+        let output = self.ssh.run_cmd_stdio(&format!(
+            "seq 0 {} | {}xargs -P {DUT_HASH_JOBS} -I @ sh -c 'echo @ $(dd if={dev} \
+             bs={CHUNK_SIZE} skip=@ count=1 status=none | sha256sum)'",
+            chunks.saturating_sub(1),
+            self.io_priority()
+        ))?;
+        Ok(parse_chunk_hashes(&output))
+    }
+    /// Bring the partition `number` of the DUT up to date with a partition
+    /// of the image, by writing only the chunks which differ. `active` is
+    /// the same partition in the running slot.
+    fn write_partition_delta(
+        &self,
+        image: &Path,
+        src: &Partition,
+        number: u32,
+        active: u32,
+    ) -> Result<Transfer> {
+        let dev = partition_device(&self.disk, number);
+        let active_dev = partition_device(&self.disk, active);
+        let start = Instant::now();
+        let chunks = src.size().div_ceil(CHUNK_SIZE as u64) as usize;
+        let (new, inactive, active) = thread::scope(|s| {
+            let new = s.spawn(|| hash_chunks(image, src));
+            let inactive = s.spawn(|| self.hash_dut_chunks(number, chunks));
+            let active = self.hash_dut_chunks(active, chunks);
+            (new.join(), inactive.join(), active)
+        });
+        let (new, sent) = new.map_err(|_| anyhow!("Hashing thread panicked"))??;
+        let inactive = inactive.map_err(|_| anyhow!("Hashing thread panicked"))??;
+        let plan = plan_delta(&new, &inactive, &active?);
+
+        let copies = chunk_indices(&plan, ChunkAction::CopyFromActive);
+        if !copies.is_empty() {
+            self.ssh.run_cmd_stdio(&format!(
+                "for i in {}; do {}dd if={active_dev} of={dev} bs={CHUNK_SIZE} skip=$i seek=$i \
+                 count=1 conv=notrunc status=none || exit 1; done",
+                copies.join(" "),
+                self.io_priority()
+            ))?;
+        }
+        let sends = chunk_indices(&plan, ChunkAction::Send);
+        let mut bytes = 0;
+        if !sends.is_empty() {
+            // Chunks are sent back to back in the order of the indices, and
+            // each dd takes exactly one chunk from stdin.
+            let mut ssh = self.ssh.ssh_cmd(Some(&["-C"]))?;
+            ssh.arg(format!(
+                "for i in {}; do {}dd of={dev} bs={CHUNK_SIZE} seek=$i count=1 iflag=fullblock \
+                 conv=notrunc status=none || exit 1; done",
+                sends.join(" "),
+                self.io_priority()
+            ))
+            .stdin(Stdio::piped());
+            let mut child = ssh.spawn()?;
+            let mut stdin = child.stdin.take().context("Failed to open stdin of ssh")?;
+            let mut file = File::open(image)?;
+            let mut buf = vec![0u8; CHUNK_SIZE];
+            let mut throttle = Throttle::new(self.bandwidth_limit);
+            for (i, _) in plan
+                .iter()
+                .enumerate()
+                .filter(|(_, a)| **a == ChunkAction::Send)
+            {
+                let offset = i as u64 * CHUNK_SIZE as u64;
+                let len = (src.size() - offset).min(CHUNK_SIZE as u64) as usize;
+                file.seek(SeekFrom::Start(src.offset() + offset))?;
+                file.read_exact(&mut buf[..len])?;
+                throttle.consume(len);
+                bytes += len as u64;
+                stdin
+                    .write_all(&buf[..len])
+                    .context(format!("Failed to send {} to {dev}", src.label()))?;
+            }
+            drop(stdin);
+            child
+                .wait()?
+                .exit_ok()
+                .context(format!("Failed to write {} to {dev}", src.label()))?;
+        }
+        self.ssh.run_cmd_stdio("sync")?;
+        let written = self.ssh.run_cmd_stdio(&format!(
+            "head -c {} {dev} | sha256sum | cut -d ' ' -f 1",
+            src.size()
+        ))?;
+        if written != sent {
+            bail!("Hash mismatch on {dev}: expected {sent}, but {written} was written");
+        }
+        info!(
+            "{}: updated {} on {dev} in {:.1?} ({} chunks kept, {} copied from the active slot, \
+             {} sent)",
+            self.ssh.host_and_port(),
+            src.label(),
+            start.elapsed(),
+            chunks - copies.len() - sends.len(),
+            copies.len(),
+            sends.len()
+        );
+        Ok(Transfer {
+            name: src.label().to_string(),
+            start,
+            duration: start.elapsed(),
+            bytes,
+        })
+    }
+    /// Stream a partition of the image to the partition `number` of the DUT,
+    /// and verify it by comparing the hash of the written data.
+    fn write_partition(&self, image: &Path, src: &Partition, number: u32) -> Result<Transfer> {
+        let dev = partition_device(&self.disk, number);
+        let dev_size: u64 = self
+            .ssh
+            .run_cmd_stdio(&format!("blockdev --getsize64 {dev}"))?
+            .parse()
+            .context(format!("Failed to get the size of {dev}"))?;
+        if dev_size < src.size() {
+            bail!(
+                "{} ({} bytes) does not fit in {dev} ({dev_size} bytes)",
+                src.label(),
+                src.size()
+            );
+        }
+        let start = Instant::now();
+        let mut file = File::open(image)?;
+        file.seek(SeekFrom::Start(src.offset()))?;
+        let mut file = file.take(src.size());
+        let mut ssh = self.ssh.ssh_cmd(Some(&["-C"]))?;
+        ssh.arg(format!(
+            "{}dd of={dev} bs=4M iflag=fullblock oflag=direct conv=fsync status=none",
+            self.io_priority()
+        ))
+        .stdin(Stdio::piped());
+        let mut child = ssh.spawn()?;
+        let mut stdin = child.stdin.take().context("Failed to open stdin of ssh")?;
+        let mut hasher = Sha256::new();
+        let mut buf = vec![0u8; CHUNK_SIZE];
+        let mut throttle = Throttle::new(self.bandwidth_limit);
+        loop {
+            let n = file.read(&mut buf)?;
+            if n == 0 {
+                break;
+            }
+            throttle.consume(n);
+            hasher.update(&buf[..n]);
+            stdin
+                .write_all(&buf[..n])
+                .context(format!("Failed to send {} to {dev}", src.label()))?;
+        }
+        drop(stdin);
+        child
+            .wait()?
+            .exit_ok()
+            .context(format!("Failed to write {} to {dev}", src.label()))?;
+        let sent = hex_digest(hasher);
+        let written = self.ssh.run_cmd_stdio(&format!(
+            "head -c {} {dev} | sha256sum | cut -d ' ' -f 1",
+            src.size()
+        ))?;
+        if written != sent {
+            bail!("Hash mismatch on {dev}: sent {sent}, but {written} was written");
+        }
+        let elapsed = start.elapsed();
+        info!(
+            "{}: wrote {} to {dev} ({} MiB in {:.1?}, {:.1} MiB/s)",
+            self.ssh.host_and_port(),
+            src.label(),
+            src.size() >> 20,
+            elapsed,
+            (src.size() >> 20) as f64 / elapsed.as_secs_f64()
+        );
+        Ok(Transfer {
+            name: src.label().to_string(),
+            start,
+            duration: elapsed,
+            bytes: src.size(),
+        })
+    }
+    /// Send a stateful payload, which is unpacked when the slot is activated.
+    fn upload_stateful(&self, payload: &Path) -> Result<Transfer> {
+        let start = Instant::now();
+        let bytes = fs::metadata(payload)
+            .context(format!("Failed to open {payload:?}"))?
+            .len();
+        let mut ssh = self.ssh.ssh_cmd(None)?;
+        ssh.arg(format!("cat > {STATEFUL_DIR}/{STAGED_PAYLOAD}"))
+            .stdin(File::open(payload).context(format!("Failed to open {payload:?}"))?);
+        ssh.status()?
+            .exit_ok()
+            .context("Failed to send the stateful payload")?;
+        info!("{}: sent the stateful payload", self.ssh.host_and_port());
+        Ok(Transfer {
+            name: "stateful".to_string(),
+            start,
+            duration: start.elapsed(),
+            bytes,
+        })
+    }
+    /// Write the kernel, rootfs and the stateful payload to the inactive slot
+    /// in parallel, without switching to it. `stateful_payload` is called
+    /// while the partitions are being sent, to produce the payload. Returns
+    /// the transfers done.
+    pub fn stage(
+        &self,
+        image: &DiskImage,
+        stateful_payload: impl FnOnce() -> Result<PathBuf> + Send,
+    ) -> Result<Vec<Transfer>> {
+        let kern = image.partition("KERN-A")?;
+        let root = image.partition("ROOT-A")?;
+        let path = image.path();
+        // Never boot from a partially written slot, even if the active one
+        // fails to boot.
+        self.ssh.run_cmd_stdio(&format!(
+            "rm -f {STATEFUL_DIR}/{STAGED_MARKER} && cgpt add -i {} -P 0 {}",
+            self.slot.kern, self.disk
+        ))?;
+        let (kern_result, root_result, stateful_result) = thread::scope(|s| {
+            let kern = s.spawn(|| {
+                if self.delta {
+                    self.write_partition_delta(path, kern, self.slot.kern, self.active.kern)
+                } else {
+                    self.write_partition(path, kern, self.slot.kern)
+                }
+            });
+            let root = s.spawn(|| {
+                if self.delta {
+                    self.write_partition_delta(path, root, self.slot.root, self.active.root)
+                } else {
+                    self.write_partition(path, root, self.slot.root)
+                }
+            });
+            let stateful = s.spawn(move || self.upload_stateful(&stateful_payload()?));
+            (kern.join(), root.join(), stateful.join())
+        });
+        let transfers = [kern_result, root_result, stateful_result]
+            .into_iter()
+            .map(|result| result.map_err(|_| anyhow!("A transfer thread panicked"))?)
+            .collect::<Result<Vec<_>>>()?;
+        self.ssh.run_cmd_stdio(&format!(
+            "echo {} > {STATEFUL_DIR}/{STAGED_MARKER}",
+            self.slot.kern
+        ))?;
+        Ok(transfers)
+    }
+    /// Make the DUT boot from the slot written by stage() on the next boot.
+    pub fn activate(&self) -> Result<()> {
+        let staged = self.ssh.run_cmd_stdio(&format!(
+            "cat {STATEFUL_DIR}/{STAGED_MARKER} 2>/dev/null || true"
+        ))?;
+        if staged != self.slot.kern.to_string() {
+            bail!(
+                "{}: no image is staged in KERN {} (run `cro3 dut stage` first)",
+                self.ssh.host_and_port(),
+                self.slot.kern
+            );
+        }
+        // chromeos_startup unpacks the payload, and wipes the rest of the
+        // stateful partition if .update_available says "clobber"
+        let update_type = if self.clobber_stateful { "clobber" } else { "" };
+        self.ssh.run_cmd_stdio(&format!(
+            "cd {STATEFUL_DIR} && rm -rf dev_image_new var_new && tar -xzf {STAGED_PAYLOAD} && rm \
+             -f {STAGED_PAYLOAD} {STAGED_MARKER} && echo -n '{update_type}' > .update_available"
+        ))?;
+        if self.clear_tpm_owner {
+            self.ssh
+                .run_cmd_stdio("crossystem clear_tpm_owner_request=1")?;
+        }
+        self.switch_slot()
+    }
+    /// Write the kernel, rootfs and the stateful payload, and then make the
+    /// DUT boot from the written slot. Returns the transfers done.
+    pub fn apply(
+        &self,
+        image: &DiskImage,
+        stateful_payload: impl FnOnce() -> Result<PathBuf> + Send,
+    ) -> Result<Vec<Transfer>> {
+        let transfers = self.stage(image, stateful_payload)?;
+        self.activate()?;
+        Ok(transfers)
+    }
+    /// Make the written slot the one to be booted next.
+    fn switch_slot(&self) -> Result<()> {
+        let kern = self.slot.kern;
+        let disk = &self.disk;
+        self.ssh.run_cmd_stdio(&format!(
+            "cgpt add -i {kern} -T {KERNEL_TRIES} -S 0 {disk} && cgpt prioritize -i {kern} {disk}"
+        ))?;
+        Ok(())
+    }
+    pub fn reboot(&self) -> Result<()> {
+        // The connection may be closed before ssh returns
+        let _ = self.ssh.run_cmd_stdio("reboot");
+        Ok(())
+    }
+}
+
+/// Generate the stateful update payload (stateful.tgz) next to the image,
+/// and returns its path on the host. The image should be in the checkout or
+/// in ~/.cro3, which are visible from the chroot.
+pub fn generate_stateful_payload(chroot: &Chroot, cros: &str, image: &Path) -> Result<PathBuf> {
+    let dir = image
+        .parent()
+        .context(format!("Failed to get the dir of {image:?}"))?;
+    let cro3 = cro3_dir()?;
+    let to_chroot_path = |path: &Path| -> Result<String> {
+        if let Ok(path) = path.strip_prefix(&cro3) {
+            return Ok(format!("/cro3/{}", path.display()));
+        }
+        let path = path
+            .strip_prefix(cros)
+            .context(format!("{path:?} is not in {cros} nor {cro3}"))?;
+        Ok(format!("/mnt/host/source/{}", path.display()))
+    };
+    chroot.run_bash_script_in_chroot(
+        "generate_stateful_payload",
+        &format!(
+            "cros_generate_stateful_update_payload --image {} --output {}",
+            to_chroot_path(image)?,
+            to_chroot_path(dir)?
+        ),
+        None,
+    )?;
+    Ok(dir.join("stateful.tgz"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn slot_partitions() {
+        let info: HashMap<String, String> = [
+            ("kern_a", "2"),
+            ("root_a", "3"),
+            ("kern_b", "4"),
+            ("root_b", "5"),
+        ]
+        .iter()
+        .map(|(k, v)| (k.to_string(), v.to_string()))
+        .collect();
+        assert_eq!(
+            inactive_slot("/dev/nvme0n1p3", &info).unwrap(),
+            Slot { kern: 4, root: 5 }
+        );
+        assert_eq!(
+            inactive_slot("/dev/sda5\n", &info).unwrap(),
+            Slot { kern: 2, root: 3 }
+        );
+        assert!(inactive_slot("/dev/sda1", &info).is_err());
+        assert_eq!(
+            slots("/dev/sda3", &info).unwrap().0,
+            Slot { kern: 2, root: 3 }
+        );
+        assert_eq!(partition_device("/dev/nvme0n1", 4), "/dev/nvme0n1p4");
+        assert_eq!(partition_device("/dev/mmcblk0", 2), "/dev/mmcblk0p2");
+        assert_eq!(partition_device("/dev/sda", 5), "/dev/sda5");
+    }
+
+    #[test]
+    fn delta() {
+        let inactive = parse_chunk_hashes("0 aaa  -\n2 ccc  -\n1 xxx  -\n");
+        let active = parse_chunk_hashes("0 aaa  -\n1 bbb  -\n2 yyy  -\n");
+        let new: Vec<String> = ["aaa", "bbb", "ccc", "ddd"]
+            .iter()
+            .map(|s| s.to_string())
+            .collect();
+        let plan = plan_delta(&new, &inactive, &active);
+        assert_eq!(
+            plan,
+            vec![
+                ChunkAction::Keep,
+                ChunkAction::CopyFromActive,
+                ChunkAction::Keep,
+                ChunkAction::Send
+            ]
+        );
+        assert_eq!(chunk_indices(&plan, ChunkAction::Send), vec!["3"]);
+    }
+
+    #[test]
+    fn throttle() {
+        let start = Instant::now();
+        let mut throttle = Throttle::new(Some(100 << 20));
+        for _ in 0..5 {
+            throttle.consume(2 << 20);
+        }
+        assert!(start.elapsed() >= Duration::from_millis(100));
+        let start = Instant::now();
+        let mut unlimited = Throttle::new(None);
+        unlimited.consume(1 << 30);
+        assert!(start.elapsed() < Duration::from_millis(100));
+    }
+}
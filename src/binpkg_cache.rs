@@ -0,0 +1,112 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Binary package store shared by all the checkouts (and their chroots) on
+//! this host.
+//!
+//! The store is mounted at BINPKG_CACHE_MOUNT_POINT in every chroot entered
+//! by cro3, and has a PKGDIR for each board. Packages are stored with
+//! FEATURES=binpkg-multi-instance so multiple builds of the same version can
+//! coexist, and are only used by emerge if their USE flags and dependencies
+//! match (--binpkg-respect-use, --binpkg-changed-deps).
+//!
+//! While building, the PKGDIR of the board is bind-mounted over by the
+//! store, so packages are used and added in place instead of being copied
+//! between the store and the checkout. emerge locks the Packages index
+//! itself. The steps of cro3 which rewrite the store (adding the packages
+//! built before the store is mounted, fixing the index, fixing the owner)
+//! hold a flock on STORE_LOCK_FILE, since other checkouts can use the store
+//! at the same time.
+
+use std::fs::create_dir_all;
+
+use anyhow::Context;
+use anyhow::Result;
+
+use crate::config::Config;
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
+
+pub const BINPKG_CACHE_MOUNT_POINT: &str = "/var/cache/cro3-binpkgs";
+/// Lock file in the store of each board
+const STORE_LOCK_FILE: &str = ".cro3.lock";
+
+/// Returns the path of the store on the host. It can be changed with
+/// `cro3 config set binpkg_cache_dir <dir>`.
+pub fn binpkg_cache_dir() -> Result<String> {
+    let dir = match Config::read()?.binpkg_cache_dir() {
+        Some(dir) => dir,
+        None => gen_path_in_cro3_dir("binpkgs")?
+            .to_str()
+            .context("Failed to get the binpkg cache dir")?
+            .to_string(),
+    };
+    create_dir_all(&dir).context("Failed to create the binpkg cache dir")?;
+    Ok(dir)
+}
+
+/// Returns a part of a build script to make packages in the store available
+/// to the following emerge / build_packages in the script. `exclude` are
+/// packages which should be always built from source (e.g. workon packages).
+pub fn import_script(board: &str, exclude: &[String]) -> String {
+    let exclude = if exclude.is_empty() {
+        String::new()
+    } else {
+        format!(" --usepkg-exclude '{}'", exclude.join(" "))
+    };
+    format!(
+        r###"
+BINPKG_STORE={BINPKG_CACHE_MOUNT_POINT}/{board}
+BOARD_PKGDIR=$(portageq-{board} envvar PKGDIR)
+mkdir -p "$BINPKG_STORE"
+sudo mkdir -p "$BOARD_PKGDIR"
+if ! mountpoint -q "$BOARD_PKGDIR"; then
+  (
+    flock 9
+    # Only the packages missing in the store (e.g. built without cro3) are copied
+    sudo rsync -rlt --ignore-existing --exclude=Packages --exclude={STORE_LOCK_FILE} "$BOARD_PKGDIR"/ "$BINPKG_STORE"/
+    sudo env PKGDIR="$BINPKG_STORE" ROOT=/build/{board} PORTAGE_CONFIGROOT=/build/{board} emaint binhost --fix
+  ) 9>"$BINPKG_STORE/{STORE_LOCK_FILE}"
+  sudo mount --bind "$BINPKG_STORE" "$BOARD_PKGDIR"
+  # Keep it mounted until the script exits, since build_image installs the
+  # packages from PKGDIR
+  trap 'sudo umount "$BOARD_PKGDIR"' EXIT
+fi
+export FEATURES="buildpkg binpkg-multi-instance"
+export EMERGE_DEFAULT_OPTS="$(portageq-{board} envvar EMERGE_DEFAULT_OPTS) --usepkg --binpkg-respect-use=y --binpkg-changed-deps=y{exclude}"
+"###
+    )
+}
+
+/// Returns a part of a build script to make the packages built by the script
+/// into the store accessible from the host. This should be placed after
+/// import_script().
+pub fn export_script() -> String {
+    format!(
+        r###"
+(
+  flock 9
+  # The packages are written by root in the chroot
+  sudo chown -R "$(id -u):$(id -g)" "$BINPKG_STORE"
+) 9>"$BINPKG_STORE/{STORE_LOCK_FILE}"
+"###
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    #[test]
+    fn scripts() {
+        let script = import_script("brya", &["shill".to_string(), "crosvm".to_string()]);
+        assert!(script.contains("BINPKG_STORE=/var/cache/cro3-binpkgs/brya\n"));
+        assert!(script.contains("--binpkg-changed-deps=y --usepkg-exclude 'shill crosvm'\""));
+        assert!(!import_script("brya", &[]).contains("--usepkg-exclude"));
+        assert!(script.contains("PKGDIR=\"$BINPKG_STORE\""));
+        assert!(script.contains("sudo mount --bind \"$BINPKG_STORE\" \"$BOARD_PKGDIR\"\n"));
+        assert!(!script.contains("\"$BINPKG_STORE\"/ \"$BOARD_PKGDIR\"/"));
+        assert!(export_script().contains(") 9>\"$BINPKG_STORE/.cro3.lock\"\n"));
+    }
+}
@@ -0,0 +1,323 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Compiler caches (ccache, sccache) and distfiles shared by all the
+//! checkouts on this host.
+//!
+//! The caches live in ~/.cro3/cache/ and are mounted at
+//! BUILD_CACHE_MOUNT_POINT in every chroot entered by cro3. They are enabled
+//! for portage via /etc/make.conf.user in the chroot.
+
+use std::collections::HashMap;
+use std::fs;
+use std::os::unix::fs::PermissionsExt;
+use std::path::Path;
+use std::path::PathBuf;
+use std::time::SystemTime;
+
+use anyhow::Context;
+use anyhow::Result;
+use tracing::warn;
+
+use crate::chroot::Chroot;
+use crate::config::Config;
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
+use crate::util::size::parse_size;
+
+pub const BUILD_CACHE_MOUNT_POINT: &str = "/var/cache/cro3-build-cache";
+const CACHE_NAMES: [&str; 3] = ["ccache", "sccache", "distfiles"];
+const MAKE_CONF_USER: &str = "/etc/make.conf.user";
+const MAKE_CONF_BEGIN: &str = "# BEGIN cro3 build cache";
+const MAKE_CONF_END: &str = "# END cro3 build cache";
+
+/// Returns the path of the cache dir on the host, after creating the
+/// subdirectories for each cache.
+pub fn build_cache_dir() -> Result<String> {
+    let dir = gen_path_in_cro3_dir("cache/.keep")?;
+    let dir = dir.parent().context("Failed to get the build cache dir")?;
+    for name in CACHE_NAMES {
+        let path = dir.join(name);
+        fs::create_dir_all(&path).context("Failed to create a build cache dir")?;
+        // Caches are written by both the user and portage in the chroot. The
+        // group is set to portage by setup_in_chroot().
+        fs::set_permissions(&path, fs::Permissions::from_mode(0o2775))?;
+    }
+    Ok(dir
+        .to_str()
+        .context("Failed to get the build cache dir")?
+        .to_string())
+}
+
+/// Size limits of the caches
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct CacheLimits {
+    ccache: String,
+    sccache: String,
+    distfiles: String,
+}
+impl CacheLimits {
+    pub fn from_config(config: &Config) -> Self {
+        Self {
+            ccache: config.ccache_max_size(),
+            sccache: config.sccache_max_size(),
+            distfiles: config.distfiles_max_size(),
+        }
+    }
+    fn make_conf(&self) -> String {
+        let dir = BUILD_CACHE_MOUNT_POINT;
+        format!(
+            r#"{MAKE_CONF_BEGIN}
+DISTDIR="{dir}/distfiles"
+CCACHE_DIR="{dir}/ccache"
+CCACHE_MAXSIZE="{}"
+CCACHE_UMASK="002"
+SCCACHE_DIR="{dir}/sccache"
+SCCACHE_CACHE_SIZE="{}"
+{MAKE_CONF_END}"#,
+            self.ccache, self.sccache
+        )
+    }
+}
+
+/// Point portage in the chroot to the shared caches, and let the portage
+/// group write to them.
+pub fn setup_in_chroot(chroot: &Chroot, limits: &CacheLimits) -> Result<()> {
+    let dirs = CACHE_NAMES
+        .iter()
+        .map(|name| format!("{BUILD_CACHE_MOUNT_POINT}/{name}"))
+        .collect::<Vec<_>>()
+        .join(" ");
+    chroot.run_bash_script_in_chroot(
+        "setup_build_cache",
+        &format!(
+            r###"
+sudo chgrp portage {dirs}
+sudo chmod 2775 {dirs}
+sudo touch {MAKE_CONF_USER}
+sudo sed -i '/^{MAKE_CONF_BEGIN}$/,/^{MAKE_CONF_END}$/d' {MAKE_CONF_USER}
+sudo tee -a {MAKE_CONF_USER} >/dev/null <<'EOF'
+{}
+EOF
+"###,
+            limits.make_conf()
+        ),
+        None,
+    )?;
+    Ok(())
+}
+
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct TrimResult {
+    pub removed_entries: usize,
+    pub removed_bytes: u64,
+    pub remaining_bytes: u64,
+}
+
+/// Remove the least recently used entries in distfiles to fit the limit.
+pub fn trim_distfiles(limits: &CacheLimits) -> Result<TrimResult> {
+    let dir = PathBuf::from(build_cache_dir()?).join("distfiles");
+    trim_lru(&dir, parse_size(&limits.distfiles)?)
+}
+
+/// Returns the total size of files and the last time they were used.
+fn entry_usage(path: &Path) -> Result<(u64, SystemTime)> {
+    let meta = fs::symlink_metadata(path)?;
+    let last_used = meta.modified()?.max(meta.accessed()?);
+    if !meta.is_dir() {
+        return Ok((meta.len(), last_used));
+    }
+    // Use the times of the contents since a directory is updated when its
+    // contents are added or removed.
+    let mut usage = (0, None);
+    for e in fs::read_dir(path)? {
+        let (size, t) = entry_usage(&e?.path())?;
+        usage.0 += size;
+        usage.1 = usage.1.max(Some(t));
+    }
+    Ok((usage.0, usage.1.unwrap_or(last_used)))
+}
+
+/// Remove the least recently used entries under `dir` until the total size
+/// fits in `max_bytes`. Files directly under `dir` and entries in its
+/// subdirectories are the units of removal, so that a git checkout in
+/// distfiles (e.g. git3-src/<repo>) is removed as a whole.
+pub fn trim_lru(dir: &Path, max_bytes: u64) -> Result<TrimResult> {
+    let mut entries = Vec::new();
+    for e in fs::read_dir(dir)? {
+        let path = e?.path();
+        if fs::symlink_metadata(&path)?.is_dir() {
+            for e in fs::read_dir(&path)? {
+                entries.push(e?.path());
+            }
+        } else {
+            entries.push(path);
+        }
+    }
+    let mut entries = entries
+        .into_iter()
+        .map(|path| {
+            let (size, last_used) = entry_usage(&path)?;
+            Ok((last_used, size, path))
+        })
+        .collect::<Result<Vec<_>>>()?;
+    entries.sort();
+    let mut result = TrimResult {
+        remaining_bytes: entries.iter().map(|e| e.1).sum(),
+        ..Default::default()
+    };
+    for (_, size, path) in entries {
+        if result.remaining_bytes <= max_bytes {
+            break;
+        }
+        let removed = if path.is_dir() {
+            fs::remove_dir_all(&path)
+        } else {
+            fs::remove_file(&path)
+        };
+        if let Err(e) = removed {
+            warn!("Failed to remove {path:?}: {e}");
+            continue;
+        }
+        result.removed_entries += 1;
+        result.removed_bytes += size;
+        result.remaining_bytes -= size;
+    }
+    Ok(result)
+}
+
+/// Hit / miss statistics of a compiler cache
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct CacheStats {
+    hits: u64,
+    misses: u64,
+}
+impl CacheStats {
+    /// Query the stats of the shared ccache
+    pub fn query_ccache(chroot: &Chroot) -> Result<Self> {
+        let output = chroot.exec_in_chroot(&[
+            "env",
+            &format!("CCACHE_DIR={BUILD_CACHE_MOUNT_POINT}/ccache"),
+            "ccache",
+            "--print-stats",
+        ])?;
+        Ok(Self::parse_ccache(&output))
+    }
+    /// Query the stats of the sccache server. They are reset when the server
+    /// restarts.
+    pub fn query_sccache(chroot: &Chroot) -> Result<Self> {
+        let output = chroot.exec_in_chroot(&[
+            "env",
+            &format!("SCCACHE_DIR={BUILD_CACHE_MOUNT_POINT}/sccache"),
+            "sccache",
+            "--show-stats",
+        ])?;
+        Ok(Self::parse_sccache(&output))
+    }
+    fn parse_ccache(output: &str) -> Self {
+        let stats: HashMap<&str, u64> = output
+            .lines()
+            .filter_map(|line| {
+                let (key, value) = line.split_once('\t')?;
+                Some((key, value.trim().parse().ok()?))
+            })
+            .collect();
+        let get = |key| stats.get(key).copied().unwrap_or(0);
+        Self {
+            hits: get("direct_cache_hit") + get("preprocessed_cache_hit"),
+            misses: get("cache_miss"),
+        }
+    }
+    /// Parse lines like "Cache hits                          968"
+    fn parse_sccache(output: &str) -> Self {
+        let stats: HashMap<&str, u64> = output
+            .lines()
+            .filter_map(|line| {
+                let (key, value) = line.trim().rsplit_once(char::is_whitespace)?;
+                Some((key.trim(), value.parse().ok()?))
+            })
+            .collect();
+        let get = |key| stats.get(key).copied().unwrap_or(0);
+        Self {
+            hits: get("Cache hits"),
+            misses: get("Cache misses"),
+        }
+    }
+    /// Returns the stats accumulated after `before` was taken.
+    pub fn since(&self, before: &Self) -> Self {
+        Self {
+            hits: self.hits.saturating_sub(before.hits),
+            misses: self.misses.saturating_sub(before.misses),
+        }
+    }
+    pub fn hits(&self) -> u64 {
+        self.hits
+    }
+    pub fn misses(&self) -> u64 {
+        self.misses
+    }
+    pub fn hit_rate(&self) -> Option<f64> {
+        let total = self.hits + self.misses;
+        (total > 0).then(|| self.hits as f64 / total as f64)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn cache_stats() {
+        let before =
+            CacheStats::parse_ccache("stats_updated_timestamp\t1700000000\ncache_miss\t10\n");
+        let after = CacheStats::parse_ccache(
+            "direct_cache_hit\t25\npreprocessed_cache_hit\t5\ncache_miss\t20\nautoconf_test\t3\n",
+        );
+        let delta = after.since(&before);
+        assert_eq!((delta.hits(), delta.misses()), (30, 10));
+        assert_eq!(delta.hit_rate(), Some(0.75));
+        assert_eq!(CacheStats::default().hit_rate(), None);
+
+        let sccache = CacheStats::parse_sccache(
+            "Compile requests                   1406\nCache hits                          \
+             968\nCache hits (C/C++)                  968\nCache misses                        \
+             160\nCache hits rate                   85.82 %\nCache location                  \
+             Local disk: \"/var/cache/sccache\"\n",
+        );
+        assert_eq!((sccache.hits(), sccache.misses()), (968, 160));
+    }
+
+    #[test]
+    fn lru() {
+        let dir = TempDir::new("cro3_build_cache_test").unwrap();
+        let dir = dir.path();
+        let now = SystemTime::now();
+        let write = |name: &str, size: usize, age_secs: u64| {
+            let path = dir.join(name);
+            fs::create_dir_all(path.parent().unwrap()).unwrap();
+            fs::write(&path, vec![0u8; size]).unwrap();
+            let t = now - Duration::from_secs(age_secs);
+            let f = fs::File::options().write(true).open(&path).unwrap();
+            f.set_times(fs::FileTimes::new().set_accessed(t).set_modified(t))
+                .unwrap();
+        };
+        write("old.tar.gz", 1000, 300);
+        write("new.tar.gz", 1000, 10);
+        write("git3-src/repo/objects", 1000, 200);
+        write("git3-src/recent/objects", 1000, 100);
+
+        let result = trim_lru(dir, 2500).unwrap();
+        assert_eq!(result.removed_entries, 2);
+        assert_eq!(result.removed_bytes, 2000);
+        assert!(!dir.join("old.tar.gz").exists());
+        assert!(!dir.join("git3-src/repo").exists());
+        assert!(dir.join("git3-src/recent/objects").exists());
+        assert!(dir.join("new.tar.gz").exists());
+    }
+}
@@ -0,0 +1,408 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Plans the steps of `cro3 build` from the current state of the boards, so
+//! that board setup and workon changes are only done when their inputs have
+//! changed since the last successful build.
+
+use std::fmt;
+use std::fmt::Display;
+use std::fmt::Formatter;
+
+use anyhow::Context;
+use anyhow::Result;
+use serde::Deserialize;
+use serde::Serialize;
+use sha2::Digest;
+use sha2::Sha256;
+
+use crate::cache::KvCache;
+use crate::chroot::Chroot;
+use crate::repo::get_current_synced_cros_version;
+use crate::util::hash::hex_digest;
+use crate::util::shell_helpers::get_stdout;
+use crate::util::shell_helpers::run_bash_command;
+
+/// Inputs of the last successful build, keyed by "${CROS_DIR}:${BOARD}"
+static BUILD_STATE_CACHE: KvCache<RecordedBuildState> = KvCache::new("build_state_cache");
+
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct RecordedBuildState {
+    setup: String,
+    use_flags: String,
+}
+
+pub fn fingerprint(parts: &[&str]) -> String {
+    let mut hasher = Sha256::new();
+    for part in parts {
+        hasher.update(part.as_bytes());
+        hasher.update([0]);
+    }
+    hex_digest(hasher)
+}
+
+/// Fingerprint of the inputs of setup_board: the checkout is re-synced (and
+/// the board needs to be set up again) if these are changed.
+pub fn setup_fingerprint(cros: &str, board: &str) -> Result<String> {
+    let version = get_current_synced_cros_version(cros)
+        .context("Failed to get the version of the checkout")?;
+    let output = run_bash_command("git -C .repo/manifests rev-parse HEAD", Some(cros))?;
+    output
+        .status
+        .exit_ok()
+        .context("Failed to get the revision of the manifest")?;
+    let manifest = get_stdout(&output);
+    Ok(fingerprint(&[board, &version, &manifest]))
+}
+
+fn use_flags_fingerprint(use_flags: &str) -> String {
+    let mut flags: Vec<&str> = use_flags.split_whitespace().collect();
+    flags.sort();
+    flags.dedup();
+    fingerprint(&flags)
+}
+
+/// BoardState is the state of a board in the chroot
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct BoardState {
+    board: String,
+    has_sysroot: bool,
+    workon: Vec<String>,
+}
+impl BoardState {
+    /// Query the states of the boards with a single chroot invocation.
+    pub fn query(chroot: &Chroot, boards: &[String]) -> Result<Vec<Self>> {
+        let script = boards
+            .iter()
+            .map(|board| {
+                format!(
+                    "if [ -d /build/{board} ]; then echo '{board} sysroot'; cros-workon-{board} \
+                     list 2>/dev/null | sed 's/^/{board} workon /'; fi"
+                )
+            })
+            .collect::<Vec<_>>()
+            .join("; ");
+        let output = chroot.exec_in_chroot(&["bash", "-c", &script])?;
+        Ok(Self::parse(boards, &output))
+    }
+    fn parse(boards: &[String], output: &str) -> Vec<Self> {
+        boards
+            .iter()
+            .map(|board| {
+                let mut state = Self {
+                    board: board.to_string(),
+                    ..Default::default()
+                };
+                for line in output.lines() {
+                    let mut it = line.split_whitespace();
+                    if it.next() != Some(board.as_str()) {
+                        continue;
+                    }
+                    match (it.next(), it.next()) {
+                        (Some("sysroot"), None) => state.has_sysroot = true,
+                        (Some("workon"), Some(package)) => state.workon.push(package.to_string()),
+                        _ => {}
+                    }
+                }
+                state
+            })
+            .collect()
+    }
+}
+
+/// Returns true if a package name given by users (with or without the
+/// category) refers to the atom.
+fn is_same_package(name: &str, atom: &str) -> bool {
+    if name.contains('/') {
+        name == atom
+    } else {
+        atom.rsplit('/').next() == Some(name)
+    }
+}
+
+pub struct PlanInputs<'a> {
+    pub cros: &'a str,
+    pub packages: &'a [String],
+    pub use_flags: &'a str,
+    pub skip_setup: bool,
+    pub force_setup: bool,
+    pub keep_workon: bool,
+}
+
+/// BuildPlan holds the steps to be done for a board
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct BuildPlan {
+    board: String,
+    setup_board: Option<&'static str>,
+    workon_stop: Vec<String>,
+    workon_start: Vec<String>,
+    use_flags_changed: bool,
+    cache_key: String,
+    recorded: RecordedBuildState,
+}
+impl BuildPlan {
+    pub fn new(state: &BoardState, inputs: &PlanInputs) -> Result<Self> {
+        let cache_key = format!("{}:{}", inputs.cros, state.board);
+        let previous = BUILD_STATE_CACHE.get(&cache_key)?;
+        let recorded = RecordedBuildState {
+            setup: setup_fingerprint(inputs.cros, &state.board)?,
+            use_flags: use_flags_fingerprint(inputs.use_flags),
+        };
+        Ok(Self::from_state(
+            state,
+            inputs,
+            previous.as_ref(),
+            recorded,
+            cache_key,
+        ))
+    }
+    fn from_state(
+        state: &BoardState,
+        inputs: &PlanInputs,
+        previous: Option<&RecordedBuildState>,
+        mut recorded: RecordedBuildState,
+        cache_key: String,
+    ) -> Self {
+        let setup_board = if inputs.skip_setup {
+            None
+        } else if inputs.force_setup {
+            Some("forced")
+        } else if !state.has_sysroot {
+            Some("sysroot not found")
+        } else if previous.map(|p| &p.setup) != Some(&recorded.setup) {
+            Some("checkout was updated")
+        } else {
+            None
+        };
+        let workon_stop = if inputs.keep_workon {
+            Vec::new()
+        } else {
+            state
+                .workon
+                .iter()
+                .filter(|atom| !inputs.packages.iter().any(|p| is_same_package(p, atom)))
+                .cloned()
+                .collect()
+        };
+        // Since setup_board --force clears the workon list, start all of them
+        // again in that case.
+        let workon_start = inputs
+            .packages
+            .iter()
+            .filter(|p| {
+                setup_board.is_some() || !state.workon.iter().any(|atom| is_same_package(p, atom))
+            })
+            .cloned()
+            .collect();
+        let use_flags_changed =
+            previous.is_some_and(|previous| previous.use_flags != recorded.use_flags);
+        // If setup_board is skipped (e.g. --skip-setup) while its inputs have
+        // changed, keep the previous fingerprint (or none) so that the next
+        // build still sets up the board.
+        if setup_board.is_none() && previous.map(|p| &p.setup) != Some(&recorded.setup) {
+            recorded.setup = previous.map(|p| p.setup.clone()).unwrap_or_default();
+        }
+        Self {
+            board: state.board.clone(),
+            setup_board,
+            workon_stop,
+            workon_start,
+            use_flags_changed,
+            cache_key,
+            recorded,
+        }
+    }
+    pub fn board(&self) -> &str {
+        &self.board
+    }
+    pub fn needs_setup_board(&self) -> bool {
+        self.setup_board.is_some()
+    }
+    pub fn workon_stop(&self) -> &[String] {
+        &self.workon_stop
+    }
+    pub fn workon_start(&self) -> &[String] {
+        &self.workon_start
+    }
+    /// Returns extra options for emerge-${BOARD}, to rebuild the packages
+    /// affected by the USE flags updated since the last build.
+    pub fn emerge_opts(&self) -> &'static str {
+        if self.use_flags_changed {
+            "--newuse"
+        } else {
+            ""
+        }
+    }
+    /// Record the inputs of this plan. This should be called after the build
+    /// succeeded.
+    pub fn record(&self) -> Result<()> {
+        BUILD_STATE_CACHE.set(&self.cache_key, self.recorded.clone())
+    }
+}
+impl Display for BuildPlan {
+    fn fmt(&self, f: &mut Formatter) -> fmt::Result {
+        let board = &self.board;
+        writeln!(f, "Build plan for {board}:")?;
+        match self.setup_board {
+            Some(reason) => writeln!(f, "  [run ] setup_board ({reason})")?,
+            None => writeln!(f, "  [skip] setup_board")?,
+        }
+        if self.workon_stop.is_empty() {
+            writeln!(f, "  [skip] cros-workon-{board} stop")?;
+        } else {
+            let list = self.workon_stop.join(" ");
+            writeln!(f, "  [run ] cros-workon-{board} stop {list}")?;
+        }
+        if self.workon_start.is_empty() {
+            writeln!(f, "  [skip] cros-workon-{board} start")?;
+        } else {
+            let list = self.workon_start.join(" ");
+            writeln!(f, "  [run ] cros-workon-{board} start {list}")?;
+        }
+        if self.use_flags_changed {
+            write!(f, "  [run ] build (USE flags changed, with --newuse)")
+        } else {
+            write!(f, "  [run ] build")
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn inputs<'a>(packages: &'a [String], keep_workon: bool) -> PlanInputs<'a> {
+        PlanInputs {
+            cros: "/cros",
+            packages,
+            use_flags: "chrome_internal -cros-debug",
+            skip_setup: false,
+            force_setup: false,
+            keep_workon,
+        }
+    }
+    fn recorded(use_flags: &str) -> RecordedBuildState {
+        RecordedBuildState {
+            setup: fingerprint(&["brya", "R120-15662.0.0"]),
+            use_flags: use_flags_fingerprint(use_flags),
+        }
+    }
+
+    #[test]
+    fn parse_state() {
+        let boards = vec!["brya".to_string(), "volteer".to_string()];
+        let states = BoardState::parse(
+            &boards,
+            "brya sysroot\nbrya workon chromeos-base/shill\nbrya workon dev-util/foo\n",
+        );
+        assert!(states[0].has_sysroot);
+        assert_eq!(
+            states[0].workon,
+            vec!["chromeos-base/shill", "dev-util/foo"]
+        );
+        assert!(!states[1].has_sysroot);
+        assert!(states[1].workon.is_empty());
+    }
+
+    #[test]
+    fn package_name() {
+        assert!(is_same_package("shill", "chromeos-base/shill"));
+        assert!(is_same_package(
+            "chromeos-base/shill",
+            "chromeos-base/shill"
+        ));
+        assert!(!is_same_package("chromeos-base/shill", "dev-util/shill"));
+        assert!(!is_same_package("shil", "chromeos-base/shill"));
+    }
+
+    #[test]
+    fn up_to_date() {
+        let state = BoardState {
+            board: "brya".to_string(),
+            has_sysroot: true,
+            workon: vec!["chromeos-base/shill".to_string()],
+        };
+        let packages = vec!["shill".to_string()];
+        let previous = recorded("-cros-debug chrome_internal");
+        let plan = BuildPlan::from_state(
+            &state,
+            &inputs(&packages, false),
+            Some(&previous),
+            recorded("chrome_internal -cros-debug"),
+            String::new(),
+        );
+        assert!(!plan.needs_setup_board());
+        assert!(plan.workon_stop().is_empty());
+        assert!(plan.workon_start().is_empty());
+        assert_eq!(plan.emerge_opts(), "");
+    }
+
+    #[test]
+    fn changed() {
+        let state = BoardState {
+            board: "brya".to_string(),
+            has_sysroot: true,
+            workon: vec!["chromeos-base/shill".to_string()],
+        };
+        let packages = vec!["crosvm".to_string()];
+        let previous = recorded("chrome_internal");
+        let plan = BuildPlan::from_state(
+            &state,
+            &inputs(&packages, false),
+            Some(&previous),
+            recorded("chrome_internal -cros-debug"),
+            String::new(),
+        );
+        assert!(!plan.needs_setup_board());
+        assert_eq!(plan.workon_stop(), &["chromeos-base/shill".to_string()]);
+        assert_eq!(plan.workon_start(), &["crosvm".to_string()]);
+        assert_eq!(plan.emerge_opts(), "--newuse");
+
+        let plan = BuildPlan::from_state(
+            &state,
+            &inputs(&packages, true),
+            None,
+            recorded("chrome_internal"),
+            String::new(),
+        );
+        assert!(plan.needs_setup_board());
+        assert!(plan.workon_stop().is_empty());
+    }
+
+    #[test]
+    fn skipped_setup_is_not_recorded() {
+        let state = BoardState {
+            board: "brya".to_string(),
+            has_sysroot: true,
+            workon: Vec::new(),
+        };
+        let packages = Vec::new();
+        let previous = recorded("chrome_internal");
+        let mut synced = recorded("chrome_internal");
+        synced.setup = fingerprint(&["brya", "R121-15700.0.0"]);
+        let mut skip = inputs(&packages, false);
+        skip.skip_setup = true;
+        let plan = BuildPlan::from_state(
+            &state,
+            &skip,
+            Some(&previous),
+            synced.clone(),
+            String::new(),
+        );
+        assert!(!plan.needs_setup_board());
+        assert_eq!(plan.recorded.setup, previous.setup);
+        // The next build without --skip-setup still sets up the board
+        let plan = BuildPlan::from_state(
+            &state,
+            &inputs(&packages, false),
+            Some(&plan.recorded),
+            synced.clone(),
+            String::new(),
+        );
+        assert!(plan.needs_setup_board());
+        assert_eq!(plan.recorded.setup, synced.setup);
+    }
+}
@@ -0,0 +1,111 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Splits the CPU and memory of the host across build pipelines that run
+//! concurrently in the same chroot (e.g. `cro3 build --board a,b,c`).
+
+use anyhow::Result;
+
+use crate::util::host_resources::cpu_count;
+use crate::util::host_resources::MemInfo;
+
+/// Rough peak memory usage of one compiler job. Some packages need much more
+/// (chromeos-chrome, LTO links), but this keeps the whole build out of swap
+/// in most cases.
+const MEM_PER_JOB_KIB: u64 = 2 * 1024 * 1024;
+
+/// JobBudget holds the parallelism settings given to one build pipeline.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct JobBudget {
+    /// Number of CPUs given to the pipeline. This is split into the number
+    /// of packages built in parallel (emerge --jobs) and the number of
+    /// compiler jobs per package (MAKEOPTS -j) so that their product stays
+    /// within this value. Both emerge and make are also limited by the load
+    /// average with this value.
+    jobs: usize,
+}
+impl JobBudget {
+    /// Split the resources currently available on this host into
+    /// `num_pipelines` budgets.
+    pub fn split_host(num_pipelines: usize) -> Result<Vec<Self>> {
+        let mem = MemInfo::read()?;
+        Ok(Self::split(cpu_count(), mem.available_kib(), num_pipelines))
+    }
+    pub fn split(cpus: usize, mem_available_kib: u64, num_pipelines: usize) -> Vec<Self> {
+        let num_pipelines = num_pipelines.max(1);
+        let jobs_by_mem = (mem_available_kib / MEM_PER_JOB_KIB) as usize;
+        let total = cpus.min(jobs_by_mem).max(num_pipelines);
+        (0..num_pipelines)
+            .map(|i| Self {
+                jobs: total / num_pipelines + usize::from(i < total % num_pipelines),
+            })
+            .collect()
+    }
+    pub fn jobs(&self) -> usize {
+        self.jobs
+    }
+    /// Number of packages built in parallel: ceil(sqrt(jobs)), since most of
+    /// the packages can not use many compiler jobs anyway.
+    pub fn emerge_jobs(&self) -> usize {
+        let mut n = 1;
+        while n * n < self.jobs {
+            n += 1;
+        }
+        n
+    }
+    /// Number of compiler jobs per package
+    pub fn make_jobs(&self) -> usize {
+        (self.jobs / self.emerge_jobs()).max(1)
+    }
+    /// Options for emerge-${BOARD}
+    pub fn emerge_opts(&self) -> String {
+        format!("--jobs={} --load-average={}", self.emerge_jobs(), self.jobs)
+    }
+    /// Value for MAKEOPTS
+    pub fn make_opts(&self) -> String {
+        format!("-j{} -l{}", self.make_jobs(), self.jobs)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    const GIB: u64 = 1024 * 1024;
+    #[test]
+    fn split_by_cpu() {
+        let budgets = JobBudget::split(64, 512 * GIB, 3);
+        assert_eq!(
+            budgets.iter().map(|b| b.jobs()).collect::<Vec<_>>(),
+            vec![22, 21, 21]
+        );
+    }
+    #[test]
+    fn split_by_memory() {
+        // 32 GiB allows only 16 jobs in total even with 64 cores
+        let budgets = JobBudget::split(64, 32 * GIB, 2);
+        assert_eq!(
+            budgets.iter().map(|b| b.jobs()).collect::<Vec<_>>(),
+            vec![8, 8]
+        );
+        assert_eq!(budgets[0].emerge_opts(), "--jobs=3 --load-average=8");
+        assert_eq!(budgets[0].make_opts(), "-j2 -l8");
+    }
+    #[test]
+    fn split_between_emerge_and_make() {
+        for jobs in 1..=128 {
+            let budget = JobBudget { jobs };
+            assert!(budget.emerge_jobs() * budget.make_jobs() <= jobs.max(1));
+        }
+        let budget = JobBudget { jobs: 64 };
+        assert_eq!((budget.emerge_jobs(), budget.make_jobs()), (8, 8));
+    }
+    #[test]
+    fn split_at_least_one_job() {
+        let budgets = JobBudget::split(2, 0, 3);
+        assert_eq!(budgets.len(), 3);
+        assert!(budgets.iter().all(|b| b.jobs() == 1));
+    }
+}
@@ -5,6 +5,13 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 use std::fs;
+use std::io::BufRead;
+use std::io::BufReader;
+use std::io::Write;
+use std::path::Path;
+use std::process::Child;
+use std::process::ChildStdin;
+use std::process::ChildStdout;
 use std::process::Command;
 use std::process::Stdio;
 use std::sync::atomic::{AtomicBool, Ordering};
@@ -17,11 +24,24 @@ use signal_hook::consts::SIGINT;
 use tracing::error;
 use tracing::info;
 
+use crate::binpkg_cache::binpkg_cache_dir;
+use crate::binpkg_cache::BINPKG_CACHE_MOUNT_POINT;
+use crate::build_cache::build_cache_dir;
+use crate::build_cache::BUILD_CACHE_MOUNT_POINT;
 use crate::util::cro3_paths::cro3_dir;
 use crate::util::cro3_paths::gen_path_in_cro3_dir;
 use crate::util::shell_helpers::get_stderr;
 use crate::util::shell_helpers::get_stdout;
-use crate::util::shell_helpers::run_bash_command;
+
+/// Returns pairs of (path on the host, path in the chroot) to be mounted in
+/// the chroot.
+fn local_mounts() -> Result<Vec<(String, &'static str)>> {
+    Ok(vec![
+        (cro3_dir()?, "/cro3"),
+        (binpkg_cache_dir()?, BINPKG_CACHE_MOUNT_POINT),
+        (build_cache_dir()?, BUILD_CACHE_MOUNT_POINT),
+    ])
+}
 
 pub struct Chroot {
     repo_path: String,
@@ -31,17 +51,16 @@ impl Chroot {
         let chroot = Chroot {
             repo_path: repo_path.to_string(),
         };
-        let cro3_dir_path = cro3_dir()?;
         info!("Using Chromium OS checkout at {}", repo_path);
-        run_bash_command(
-            &format!(
-                "echo {0} /cro3 > {1} && cat {1}",
-                cro3_dir_path, "src/scripts/.local_mounts"
-            ),
-            Some(repo_path),
-        )?
-        .status
-        .exit_ok()?;
+        let local_mounts = local_mounts()?
+            .iter()
+            .map(|(src, dst)| format!("{src} {dst}\n"))
+            .collect::<String>();
+        fs::write(
+            Path::new(repo_path).join("src/scripts/.local_mounts"),
+            local_mounts,
+        )
+        .context("Failed to write .local_mounts")?;
         // Remove ~/.bash_logout in chroot to avoid clearing the screen after exiting
         // Ignore error
         drop(chroot.run_bash_script_in_chroot("remove_bash_logout", "rm -f ~/.bash_logout", None));
@@ -97,6 +116,30 @@ impl Chroot {
         name: &str,
         script: &str,
         args: Option<&[&str]>,
+    ) -> Result<String> {
+        self.run_script_in_chroot(name, script, args, None)
+    }
+    /// Run a script in chroot as run_bash_script_in_chroot() does, but pass
+    /// each line of the output to `line_handler` as well as printing it.
+    /// stderr of the script is redirected to stdout, and Python tools (e.g.
+    /// emerge) are made unbuffered so that lines are seen as they are printed.
+    pub fn run_bash_script_in_chroot_with_line_handler(
+        &self,
+        name: &str,
+        script: &str,
+        args: Option<&[&str]>,
+        line_handler: &mut dyn FnMut(&str),
+    ) -> Result<()> {
+        let script = format!("exec 2>&1\nexport PYTHONUNBUFFERED=1\n{script}");
+        self.run_script_in_chroot(name, &script, args, Some(line_handler))?;
+        Ok(())
+    }
+    fn run_script_in_chroot(
+        &self,
+        name: &str,
+        script: &str,
+        args: Option<&[&str]>,
+        line_handler: Option<&mut dyn FnMut(&str)>,
     ) -> Result<String> {
         self.write_bash_script_for_chroot(name, script)?;
         let mut cmd = Command::new("cros_sdk");
@@ -112,8 +155,11 @@ impl Chroot {
         if let Some(args) = args {
             cmd.args(args);
         }
+        if line_handler.is_some() {
+            cmd.stdout(Stdio::piped());
+        }
         info!("Running {name} in chroot...");
-        let run = cmd
+        let mut run = cmd
             .spawn()
             .context(anyhow!("spawn failed. cmd = {cmd:?}"))?;
 
@@ -133,9 +179,32 @@ impl Chroot {
         // If user wants to quit immediately, send the 2nd SIGINT and it
         // will shutdown cro3 because 'intr' is true now.
 
+        let mut read_result = Ok(());
+        if let (Some(line_handler), Some(stdout)) = (line_handler, run.stdout.take()) {
+            let mut reader = BufReader::new(stdout);
+            let mut buf = Vec::new();
+            loop {
+                match reader.read_until(b'\n', &mut buf) {
+                    Ok(0) => break,
+                    Ok(_) => {}
+                    Err(e) => {
+                        read_result = Err(e);
+                        break;
+                    }
+                }
+                let line = String::from_utf8_lossy(&buf);
+                let line = line.trim_end_matches('\n');
+                println!("{line}");
+                line_handler(line);
+                buf.clear();
+            }
+        }
+        // Reap the child before propagating a read error, so that it is not
+        // left behind as a zombie
         let result = run
             .wait_with_output()
             .context(anyhow!("wait_with_output_failed. cmd = {cmd:?}"))?;
+        read_result.context(anyhow!("Failed to read the output. cmd = {cmd:?}"))?;
 
         // Even if user does not send SIGINT twice, this will return an error.
         if intr.load(Ordering::Relaxed) {
@@ -159,6 +228,25 @@ impl Chroot {
             .spawn()
             .context("Failed to launch servod")
     }
+    /// Start a persistent shell in the chroot, to run multiple scripts
+    /// without paying the cost of entering the chroot for each of them.
+    pub fn start_session(&self) -> Result<ChrootSession<'_>> {
+        let mut child = Command::new("cros_sdk")
+            .args(["--no-ns-pid", "--", "bash"])
+            .current_dir(&self.repo_path)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .spawn()
+            .context("Failed to start a chroot session")?;
+        let stdin = child.stdin.take().context("Failed to get stdin")?;
+        let stdout = BufReader::new(child.stdout.take().context("Failed to get stdout")?);
+        Ok(ChrootSession {
+            chroot: self,
+            child,
+            stdin,
+            stdout,
+        })
+    }
     pub fn open_chroot(&self, additional_args: &[String]) -> Result<()> {
         let cmd = Command::new("cros_sdk")
             .arg("--no-color")
@@ -172,3 +260,61 @@ impl Chroot {
         Ok(())
     }
 }
+
+/// Marks the end of the output of a script run in a ChrootSession
+const SESSION_SENTINEL: &str = "__cro3_session_script_exited__";
+
+/// ChrootSession is a shell kept running in the chroot.
+pub struct ChrootSession<'a> {
+    chroot: &'a Chroot,
+    child: Child,
+    stdin: ChildStdin,
+    stdout: BufReader<ChildStdout>,
+}
+impl ChrootSession<'_> {
+    /// Returns false if the shell has exited.
+    pub fn is_alive(&mut self) -> bool {
+        matches!(self.child.try_wait(), Ok(None))
+    }
+    /// Run a script in the session. Each line of the output (including
+    /// stderr) is printed and passed to `line_handler`.
+    pub fn run(
+        &mut self,
+        name: &str,
+        script: &str,
+        line_handler: &mut dyn FnMut(&str),
+    ) -> Result<()> {
+        self.chroot
+            .write_bash_script_for_chroot(name, &format!("export PYTHONUNBUFFERED=1\n{script}"))?;
+        info!("Running {name} in the chroot session...");
+        writeln!(
+            self.stdin,
+            "bash -xe /cro3/tmp/{name}.sh </dev/null 2>&1; echo {SESSION_SENTINEL} $?"
+        )
+        .context("The chroot session was closed")?;
+        let mut buf = Vec::new();
+        loop {
+            buf.clear();
+            if self.stdout.read_until(b'\n', &mut buf)? == 0 {
+                return Err(anyhow!("The chroot session was closed"));
+            }
+            let line = String::from_utf8_lossy(&buf);
+            let line = line.trim_end_matches('\n');
+            if let Some(code) = line.strip_prefix(SESSION_SENTINEL) {
+                return match code.trim() {
+                    "0" => Ok(()),
+                    code => Err(anyhow!("{name} failed with exit code {code}")),
+                };
+            }
+            println!("{line}");
+            line_handler(line);
+        }
+    }
+}
+impl Drop for ChrootSession<'_> {
+    fn drop(&mut self) {
+        // Let the shell exit by itself to unmount the chroot cleanly.
+        let _ = writeln!(self.stdin, "exit");
+        let _ = self.child.wait();
+    }
+}
@@ -10,6 +10,8 @@ use argh::FromArgs;
 use cro3::cache::KvCache;
 use cro3::repo::get_cros_dir;
 use cro3::util::shell_helpers::run_bash_command;
+use cro3::version_index::latest_versions;
+use cro3::version_index::Gsutil;
 use glob::Pattern;
 
 #[derive(FromArgs, PartialEq, Debug)]
@@ -26,10 +28,12 @@ pub static BOARD_CACHE: KvCache<Vec<String>> = KvCache::new("board_cache");
 #[argh(subcommand)]
 enum SubCommand {
     List(ArgsList),
+    Versions(ArgsVersions),
 }
 pub fn run(args: &Args) -> Result<()> {
     match &args.nested {
         SubCommand::List(args) => run_board_list(args),
+        SubCommand::Versions(args) => run_board_versions(args),
     }
 }
 
@@ -93,3 +97,27 @@ fn run_board_list(args: &ArgsList) -> Result<()> {
 
     print_cached_boards(&filter)
 }
+
+#[derive(FromArgs, PartialEq, Debug)]
+/// List up the released versions of a board, newest first
+#[argh(subcommand, name = "versions")]
+pub struct ArgsVersions {
+    /// board name (e.g. brya)
+    #[argh(positional)]
+    board: String,
+
+    /// number of versions to show (default: 10)
+    #[argh(option, default = "10")]
+    latest: usize,
+
+    /// update the version index even if it is fresh
+    #[argh(switch)]
+    refresh: bool,
+}
+
+fn run_board_versions(args: &ArgsVersions) -> Result<()> {
+    for v in latest_versions(&args.board, args.latest, args.refresh, &Gsutil)? {
+        println!("{v}");
+    }
+    Ok(())
+}
@@ -8,14 +8,49 @@
 //! ```
 //! cro3 build --cros $CROS --board brya --packages sys-kernel/arcvm-kernel-ack-5_10
 //! cro3 build --full --cros $CROS --board brya
+//! # Build for multiple boards in parallel
+//! cro3 build --full --cros $CROS --board brya,volteer,trogdor
+//! # Rebuild and deploy packages whenever their sources are changed
+//! cro3 build --cros $CROS --board brya --watch --dut $DUT chromeos-base/shill
+//! # Build a full image, then write it to the inactive slot of a DUT
+//! cro3 build --full --cros $CROS --board brya --then-flash-dut $DUT
 //! ```
 
+use std::thread;
+use std::time::Duration;
+use std::time::Instant;
+
 use anyhow::anyhow;
+use anyhow::bail;
 use anyhow::Result;
 use argh::FromArgs;
+use cro3::ab_update;
+use cro3::ab_update::AbUpdateTarget;
+use cro3::binpkg_cache;
+use cro3::build_cache;
+use cro3::build_cache::CacheLimits;
+use cro3::build_cache::CacheStats;
+use cro3::build_planner::BoardState;
+use cro3::build_planner::BuildPlan;
+use cro3::build_planner::PlanInputs;
+use cro3::build_scheduler::JobBudget;
 use cro3::chroot::Chroot;
+use cro3::chroot::ChrootSession;
+use cro3::config::Config;
+use cro3::cros::ensure_testing_rsa_is_there;
+use cro3::dut::SshInfo;
+use cro3::emerge_progress::step_marker;
+use cro3::emerge_progress::BuildTelemetry;
+use cro3::image::latest_local_image;
+use cro3::image::DiskImage;
+use cro3::memory_governor::MemoryGovernor;
 use cro3::repo::get_cros_dir;
+use cro3::source_watcher::SourceWatcher;
+use cro3::source_watcher::WatchTarget;
+use rayon::prelude::*;
+use tracing::error;
 use tracing::info;
+use tracing::warn;
 
 #[derive(FromArgs, PartialEq, Debug)]
 /// build package(s)
@@ -25,7 +60,8 @@ pub struct Args {
     #[argh(option)]
     cros: Option<String>,
 
-    /// target board
+    /// target board(s). Multiple boards can be specified with commas (e.g.
+    /// brya,volteer) to build them in parallel
     #[argh(option)]
     board: String,
 
@@ -37,6 +73,10 @@ pub struct Args {
     #[argh(switch)]
     skip_setup: bool,
 
+    /// if specified, run setup_board even if the board looks up to date
+    #[argh(switch)]
+    force_setup: bool,
+
     /// if specified, do not stop working on packages already working on
     #[argh(switch)]
     keep_workon: bool,
@@ -52,15 +92,283 @@ pub struct Args {
     #[argh(switch)]
     full: bool,
 
+    /// keep watching the sources of the packages, and rebuild them (and
+    /// deploy to --dut, if given) whenever they are changed
+    #[argh(switch)]
+    watch: bool,
+
+    /// a DUT to deploy the packages on changes (requires --watch)
+    #[argh(option)]
+    dut: Option<String>,
+
+    /// a DUT to write the image to after the build finishes (requires
+    /// --full). The DUT is inspected while building, but the image is not
+    /// streamed to it during build_image. USB disks are not supported (use
+    /// `cro3 flash --usb` instead).
+    #[argh(option)]
+    then_flash_dut: Option<String>,
+
+    /// pause starting new packages (and pause running ones, if needed) while
+    /// the memory pressure of the host (PSI "some" avg10, in percent) is above
+    /// this value. 0 to disable.
+    #[argh(option, default = "20.0")]
+    memory_pressure_limit: f64,
+
+    /// if specified, do not use and update the binary package store shared
+    /// across checkouts
+    #[argh(switch)]
+    no_binpkg_cache: bool,
+
     #[argh(option, hidden_help)]
     repo: Option<String>,
 }
 #[tracing::instrument(level = "trace")]
 pub fn run(args: &Args) -> Result<()> {
-    let board = &args.board;
+    let boards = parse_boards(&args.board)?;
+    if !args.full && args.packages.is_empty() {
+        return Err(anyhow!(
+            "Please specify --full or --packages. `cro3 build --help` for more details."
+        ));
+    }
+    if args.watch && (args.full || args.packages.is_empty() || boards.len() > 1) {
+        bail!("--watch requires packages to build for a single board, without --full");
+    }
+    if args.dut.is_some() && !args.watch {
+        bail!("--dut is only used with --watch");
+    }
+    if args.then_flash_dut.is_some() && (!args.full || boards.len() > 1) {
+        bail!("--then-flash-dut requires --full for a single board");
+    }
+    let cros = get_cros_dir(&args.cros)?;
+    let chroot = Chroot::new(&cros)?;
+    let cache_limits = CacheLimits::from_config(&Config::read()?);
+    build_cache::setup_in_chroot(&chroot, &cache_limits)?;
+    match build_cache::trim_distfiles(&cache_limits) {
+        Ok(r) if r.removed_entries > 0 => info!(
+            "Removed {} old entries ({} MiB) from the shared distfiles",
+            r.removed_entries,
+            r.removed_bytes >> 20
+        ),
+        Ok(_) => {}
+        Err(e) => warn!("Failed to trim the shared distfiles: {e:#}"),
+    }
+    let inputs = PlanInputs {
+        cros: &cros,
+        packages: &args.packages,
+        use_flags: &args.use_flags,
+        skip_setup: args.skip_setup,
+        force_setup: args.force_setup,
+        keep_workon: args.keep_workon,
+    };
+    let plans = BoardState::query(&chroot, &boards)?
+        .iter()
+        .map(|state| BuildPlan::new(state, &inputs))
+        .collect::<Result<Vec<_>>>()?;
+    for plan in &plans {
+        println!("{plan}");
+    }
+    let boards_to_setup: Vec<String> = plans
+        .iter()
+        .filter(|plan| plan.needs_setup_board())
+        .map(|plan| plan.board().to_string())
+        .collect();
+    if !boards_to_setup.is_empty() {
+        setup_boards(&chroot, &boards_to_setup, boards.len() > 1)?;
+    }
+    let flash_target = args.then_flash_dut.clone().map(|dut| {
+        let board = boards[0].clone();
+        thread::spawn(move || -> Result<AbUpdateTarget> {
+            ensure_testing_rsa_is_there()?;
+            AbUpdateTarget::prepare(&SshInfo::new(&dut)?, &board)
+        })
+    });
+    let cache_stats_before = query_cache_stats(&chroot);
+    let governor = if args.memory_pressure_limit > 0.0 {
+        MemoryGovernor::start(args.memory_pressure_limit)
+            .map_err(|e| warn!("Memory pressure will not be monitored: {e:#}"))
+            .ok()
+    } else {
+        None
+    };
+    let result = build_boards(&chroot, args, &plans);
+    drop(governor);
+    for ((name, before), (_, after)) in cache_stats_before
+        .into_iter()
+        .zip(query_cache_stats(&chroot))
+    {
+        match (before, after) {
+            (Ok(before), Ok(after)) => {
+                let stats = after.since(&before);
+                if let Some(rate) = stats.hit_rate() {
+                    info!(
+                        "{name}: {:.1}% hit rate ({} hits, {} misses)",
+                        rate * 100.0,
+                        stats.hits(),
+                        stats.misses()
+                    );
+                }
+            }
+            (Err(e), _) | (_, Err(e)) => warn!("Failed to get {name} stats: {e:#}"),
+        }
+    }
+    result?;
+    if let Some(target) = flash_target {
+        let target = target
+            .join()
+            .map_err(|_| anyhow!("Failed to inspect the DUT"))??;
+        flash_image(&chroot, &cros, plans[0].board(), &target)?;
+    }
+    if args.watch {
+        watch(&chroot, &cros, args, plans[0].board())?;
+    }
+    Ok(())
+}
+
+/// Returns the stats of the compiler caches shared by the chroots
+fn query_cache_stats(chroot: &Chroot) -> Vec<(&'static str, Result<CacheStats>)> {
+    vec![
+        ("ccache", CacheStats::query_ccache(chroot)),
+        ("sccache", CacheStats::query_sccache(chroot)),
+    ]
+}
+
+/// Write the image built for the board to the DUT, and reboot it.
+fn flash_image(chroot: &Chroot, cros: &str, board: &str, target: &AbUpdateTarget) -> Result<()> {
+    let image = DiskImage::open(&latest_local_image(cros, board, "test"))?;
+    info!("Writing {:?} to the DUT...", image.path());
+    let start = Instant::now();
+    target.apply(&image, || {
+        ab_update::generate_stateful_payload(chroot, cros, image.path())
+    })?;
+    target.reboot()?;
+    info!(
+        "Wrote the image in {:.1?}. The DUT is rebooting.",
+        start.elapsed()
+    );
+    Ok(())
+}
+
+/// Rebuild (and deploy) the packages whenever their sources are changed.
+fn watch(chroot: &Chroot, cros: &str, args: &Args, board: &str) -> Result<()> {
+    let target = match &args.dut {
+        Some(dut) => {
+            ensure_testing_rsa_is_there()?;
+            // Keep the connection forwarded while watching
+            let target = SshInfo::new(dut)?.into_forwarded()?;
+            let dut_board = target.get_board()?;
+            if dut_board != board {
+                warn!("DUT board is {dut_board} but building for {board}");
+            }
+            Some(target)
+        }
+        None => None,
+    };
+    let targets = WatchTarget::query(chroot, cros, board, &args.packages)?;
+    for t in &targets {
+        info!("{}: watching {:?}", t.package(), t.dirs());
+    }
+    let mut session = chroot.start_session()?;
     let use_flags = &args.use_flags;
-    let chroot = Chroot::new(&get_cros_dir(&args.cros)?)?;
-    if !args.skip_setup {
+    let deploy = |session: &mut ChrootSession, packages: &str| -> Result<()> {
+        if let Some(target) = &target {
+            session.run(
+                "watch_deploy",
+                &format!("cros deploy --force {} {packages}", target.host_and_port()),
+                &mut |_| {},
+            )?;
+        }
+        Ok(())
+    };
+    deploy(&mut session, &args.packages.join(" "))?;
+    let mut watcher =
+        SourceWatcher::new(targets, Duration::from_millis(100), Duration::from_secs(1))?;
+    loop {
+        if !session.is_alive() {
+            // e.g. the chroot was unmounted or cros_sdk was killed
+            warn!("The chroot session exited. Starting a new one...");
+            session = chroot.start_session()?;
+        }
+        info!("Waiting for changes... (Ctrl-C to quit)");
+        let (packages, detected) = watcher.wait_for_changes()?;
+        let packages = packages.join(" ");
+        info!("Changes detected in {packages}");
+        let result = session
+            .run(
+                "watch_emerge",
+                &format!(
+                    r###"
+export USE='{use_flags}'
+emerge-{board} {packages}
+"###
+                ),
+                &mut |_| {},
+            )
+            .and_then(|_| deploy(&mut session, &packages));
+        match result {
+            Ok(()) => info!(
+                "{packages}: {} in {:.1?} after the change",
+                if target.is_some() {
+                    "deployed"
+                } else {
+                    "built"
+                },
+                detected.elapsed()
+            ),
+            Err(e) => error!("{packages}: {e:#}"),
+        }
+    }
+}
+
+fn build_boards(chroot: &Chroot, args: &Args, plans: &[BuildPlan]) -> Result<()> {
+    let budgets = JobBudget::split_host(plans.len())?;
+    if let ([plan], [budget]) = (plans, budgets.as_slice()) {
+        info!("{}: using {} jobs", plan.board(), budget.jobs());
+        build_board(chroot, args, plan, budget, false)?;
+        return plan.record();
+    }
+
+    let pipelines: Vec<(&BuildPlan, JobBudget)> = plans.iter().zip(budgets).collect();
+    for (plan, budget) in &pipelines {
+        info!("{}: using {} jobs", plan.board(), budget.jobs());
+    }
+    let results: Vec<(&BuildPlan, Result<()>)> = pipelines
+        .par_iter()
+        .map(|(plan, budget)| (*plan, build_board(chroot, args, plan, budget, true)))
+        .collect();
+    let mut failed = Vec::new();
+    for (plan, result) in results {
+        let board = plan.board();
+        match result.and_then(|_| plan.record()) {
+            Ok(()) => info!("{board}: succeeded"),
+            Err(e) => {
+                error!("{board}: failed: {e:#}");
+                failed.push(board);
+            }
+        }
+    }
+    if !failed.is_empty() {
+        bail!("Build failed for: {}", failed.join(","));
+    }
+    Ok(())
+}
+
+fn parse_boards(boards: &str) -> Result<Vec<String>> {
+    let mut list: Vec<String> = Vec::new();
+    for board in boards.split(',').map(str::trim).filter(|s| !s.is_empty()) {
+        if !list.iter().any(|b| b == board) {
+            list.push(board.to_string());
+        }
+    }
+    if list.is_empty() {
+        bail!("Please specify at least one board with --board");
+    }
+    Ok(list)
+}
+
+/// Run setup_board for the boards. `parallel` should be true if other boards
+/// will be built in parallel with them.
+fn setup_boards(chroot: &Chroot, boards: &[String], parallel: bool) -> Result<()> {
+    if let ([board], false) = (boards, parallel) {
         chroot.run_bash_script_in_chroot(
             "board_setup",
             &format!(
@@ -70,62 +378,147 @@ setup_board --force --board={board}
             ),
             None,
         )?;
+        return Ok(());
     }
-    if !args.keep_workon {
+    // Update the host packages and the cross toolchains for all the boards at
+    // once here. Board pipelines running in parallel should not touch the host
+    // packages after this, since they would conflict with each other.
+    let board_list = boards.join(",");
+    let setup_board = boards
+        .iter()
+        .map(|board| format!("setup_board --force --skip-chroot-upgrade --board={board}"))
+        .collect::<Vec<_>>()
+        .join("\n");
+    chroot.run_bash_script_in_chroot(
+        "board_setup",
+        &format!(
+            r###"
+update_chroot --toolchain_boards={board_list}
+{setup_board}
+"###,
+        ),
+        None,
+    )?;
+    Ok(())
+}
+
+/// Run workon and build steps for a board, with the parallelism limited to
+/// the budget. If `parallel` is true, the board is built in parallel with
+/// others so the output is prefixed with the board name.
+fn build_board(
+    chroot: &Chroot,
+    args: &Args,
+    plan: &BuildPlan,
+    budget: &JobBudget,
+    parallel: bool,
+) -> Result<()> {
+    let board = plan.board();
+    let use_flags = &args.use_flags;
+    let mut prologue = format!("\nexport MAKEOPTS='{}'\n", budget.make_opts());
+    let mut build_packages_opts = format!("--jobs={}", budget.emerge_jobs());
+    if parallel {
+        prologue += &format!("exec > >(sed -u 's/^/[{board}] /') 2>&1\n");
+        build_packages_opts += " --skip-chroot-upgrade";
+    }
+    let emerge_opts = budget.emerge_opts();
+    let emerge_opts = format!("{emerge_opts} {}", plan.emerge_opts());
+    let (binpkg_import, binpkg_export) = if args.no_binpkg_cache {
+        (String::new(), String::new())
+    } else {
+        (
+            binpkg_cache::import_script(board, &args.packages),
+            binpkg_cache::export_script(),
+        )
+    };
+    if !plan.workon_stop().is_empty() {
+        let package_list = plan.workon_stop().join(" ");
         chroot.run_bash_script_in_chroot(
-            "stop_workon",
+            &format!("stop_workon_{board}"),
             &format!(
-                r###"
-cros-workon-{board} stop --all
+                r###"{prologue}
+cros-workon-{board} stop {package_list}
 "###
             ),
             None,
         )?;
     }
-    if !args.packages.is_empty() {
-        let package_list = args.packages.join(" ");
+    if !plan.workon_start().is_empty() {
+        let package_list = plan.workon_start().join(" ");
         chroot.run_bash_script_in_chroot(
-            "start_workon",
+            &format!("start_workon_{board}"),
             &format!(
-                r###"
+                r###"{prologue}
 cros-workon-{board} start {package_list}
 "###
             ),
             None,
         )?;
     }
-    if args.full {
-        info!("building a full image...");
-        chroot.run_bash_script_in_chroot(
-            "build_packages",
-            &format!(
-                r###"
+    let (script_name, script, done) = if args.full {
+        info!("{board}: building a full image...");
+        (
+            format!("build_packages_{board}"),
+            format!(
+                r###"{prologue}
 export USE='{use_flags}'
-build_packages --board={board} --withdev
+{binpkg_import}
+{}
+build_packages --board={board} --withdev {build_packages_opts}
+{binpkg_export}
+{}
 build_image --board={board} --noenable_rootfs_verification test
-"###
+"###,
+                step_marker("build_packages"),
+                step_marker("build_image"),
             ),
-            None,
-        )?;
-        info!("Succesfully built a test image!");
-    } else if !args.packages.is_empty() {
+            "a test image".to_string(),
+        )
+    } else {
         let package_list = args.packages.join(" ");
-        info!("Building {package_list}...");
-        chroot.run_bash_script_in_chroot(
-            "emerge_packages",
-            &format!(
-                r###"
+        info!("{board}: Building {package_list}...");
+        (
+            format!("emerge_packages_{board}"),
+            format!(
+                r###"{prologue}
 export USE='{use_flags}'
-emerge-{board} {package_list}
-"###
+{binpkg_import}
+{}
+emerge-{board} {emerge_opts} {package_list}
+{binpkg_export}
+"###,
+                step_marker("emerge"),
             ),
-            None,
-        )?;
-        info!("Succesfully built {package_list}!");
-    } else {
-        return Err(anyhow!(
-            "Please specify --full or --packages. `cro3 build --help` for more details."
-        ));
+            package_list,
+        )
+    };
+    let mut telemetry = BuildTelemetry::new();
+    let result = chroot.run_bash_script_in_chroot_with_line_handler(
+        &script_name,
+        &script,
+        None,
+        &mut |line| telemetry.handle_line(line),
+    );
+    telemetry.finish();
+    println!("{board}: {}", telemetry.report(Some(budget.emerge_jobs())));
+    match telemetry.save_trace(board) {
+        Ok(path) => info!("{board}: trace was saved to {path:?}"),
+        Err(e) => warn!("{board}: failed to save a trace: {e:#}"),
     }
+    result?;
+    info!("{board}: Succesfully built {done}!");
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    #[test]
+    fn boards() {
+        assert_eq!(parse_boards("brya").unwrap(), vec!["brya"]);
+        assert_eq!(
+            parse_boards("brya, volteer,,brya,trogdor").unwrap(),
+            vec!["brya", "volteer", "trogdor"]
+        );
+        assert!(parse_boards(" , ").is_err());
+    }
+}
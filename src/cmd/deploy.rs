@@ -7,20 +7,49 @@
 //! ## Deploy packages
 //! ```
 //! cro3 deploy --cros $CROS --dut $DUT --package $PACKAGE_NAME --autologin
+//! # Rebuild the kernel incrementally and send only the changes
+//! cro3 deploy --cros $CROS --dut $DUT --fast-kernel sys-kernel/chromeos-kernel-5_15
+//! # Packages already identical on the DUT are skipped. Deploy them anyway:
+//! cro3 deploy --cros $CROS --dut $DUT --redeploy chromeos-base/shill
+//! # Jobs using the deployed files are restarted. Reboot the DUT instead:
+//! cro3 deploy --cros $CROS --dut $DUT --force-reboot chromeos-base/shill
+//! # Build the packages and deploy each of them as soon as it is built
+//! cro3 deploy --cros $CROS --dut $DUT --build chromeos-base/shill chromeos-base/patchpanel
+//! # Deploy to all the registered DUTs whose ID starts with "brya_", 8 at a time
+//! cro3 deploy --cros $CROS --duts 'brya_*' --jobs 8 chromeos-base/shill
 //! ```
 
 use std::cmp::Ordering;
+use std::collections::HashMap;
+use std::collections::HashSet;
+use std::sync::mpsc;
+use std::thread;
+use std::time::Duration;
+use std::time::Instant;
 
+use anyhow::anyhow;
 use anyhow::bail;
+use anyhow::Context;
 use anyhow::Result;
 use argh::FromArgs;
 use cro3::chroot::Chroot;
 use cro3::cros::ensure_testing_rsa_is_there;
+use cro3::dut::resolve_duts;
 use cro3::dut::SshInfo;
+use cro3::emerge_progress::atom_matches;
+use cro3::emerge_progress::parse_line;
+use cro3::emerge_progress::EmergeEvent;
+use cro3::kernel::KernelFastDeploy;
+use cro3::portage::changed_on_dut;
+use cro3::portage::InstalledPackage;
 use cro3::repo::get_cros_dir;
+use cro3::service_restart::RestartPlan;
 use once_cell::sync::Lazy;
+use rayon::prelude::*;
 use regex::Regex;
+use tracing::error;
 use tracing::info;
+use tracing::warn;
 
 static RE_CROS_KERNEL: Lazy<Regex> = Lazy::new(|| Regex::new("chromeos-kernel-").unwrap());
 
@@ -34,20 +63,52 @@ pub struct Args {
 
     /// a DUT identifier (e.g. 127.0.0.1, localhost:2222)
     #[argh(option)]
-    dut: String,
+    dut: Option<String>,
+
+    /// DUTs to deploy the same packages to, separated by commas. Glob
+    /// patterns (e.g. 'brya_*') are matched with the IDs of registered DUTs.
+    #[argh(option)]
+    duts: Option<String>,
+
+    /// max number of DUTs to deploy to in parallel (with --duts)
+    #[argh(option, default = "8")]
+    jobs: usize,
 
     /// packages to deploy
     #[argh(positional)]
     packages: Vec<String>,
 
-    /// if specified, it will skip automatic reboot
+    /// if specified, it will skip automatic reboot (and restarting the
+    /// affected jobs)
     #[argh(switch)]
     skip_reboot: bool,
 
+    /// reboot the DUT after deploying, instead of restarting the jobs
+    /// affected by the packages
+    #[argh(switch)]
+    force_reboot: bool,
+
+    /// deploy the packages even if the same files are already on the DUT
+    #[argh(switch)]
+    redeploy: bool,
+
     /// use ab_update for kernel package
     #[argh(switch)]
     ab_update: bool,
 
+    /// rebuild the kernel package incrementally in the build tree of the last
+    /// emerge, and send only the kernel and the changed modules (x86_64 only).
+    /// Without --ab_update, the running kernel is overwritten in place and
+    /// there is no fallback if the new one does not boot. With --ab_update,
+    /// the kernel release must differ from the running one.
+    #[argh(switch)]
+    fast_kernel: bool,
+
+    /// build the packages before deploying. Each package is deployed as soon
+    /// as it is built, while the others are still being built.
+    #[argh(switch)]
+    build: bool,
+
     #[argh(option, hidden_help)]
     repo: Option<String>,
 }
@@ -56,7 +117,12 @@ pub struct Args {
 pub fn run(args: &Args) -> Result<()> {
     ensure_testing_rsa_is_there()?;
 
-    let target = SshInfo::new(&args.dut)?.into_forwarded()?;
+    let dut = match (&args.dut, &args.duts) {
+        (Some(dut), None) => dut,
+        (None, Some(duts)) => return deploy_to_duts(args, &resolve_duts(duts)?),
+        _ => bail!("Please specify either --dut or --duts"),
+    };
+    let target = SshInfo::new(dut)?.into_forwarded()?;
     info!("Target DUT is {:?}", target);
 
     let board = target.get_board()?;
@@ -65,7 +131,65 @@ pub fn run(args: &Args) -> Result<()> {
 
     let kernel_pkg = extract_kernel_pkg(&args.packages)?;
 
-    cros_workon_user_packages(&chroot, &board, &args.packages, &packages_str, &target)?;
+    if args.build {
+        if kernel_pkg.is_some() {
+            bail!("--build can not be used with kernel packages");
+        }
+        build_and_deploy(&chroot, &board, &args.packages, &target)?;
+        if args.skip_reboot {
+            // Deployed packages did not restart the UI, so do it once here.
+            info!("Restarting UI...");
+            target.run_cmd_piped(&["restart ui"])?;
+        } else {
+            // The files are compared with the DUT only after being built and
+            // deployed, so the plan covers all the files of the packages.
+            let installed = query_contents(&chroot, &board, &args.packages);
+            let plan = restart_plan(installed.as_deref(), None, args.force_reboot);
+            activate(&plan, &target)?;
+        }
+        return Ok(());
+    }
+
+    // Compare the files with the DUT before deploying, to skip the packages
+    // already up to date and to restart only the users of the changed files.
+    let installed = if kernel_pkg.is_some() {
+        None
+    } else {
+        query_contents(&chroot, &board, &args.packages)
+    };
+    let changed = changed_files(installed.as_deref(), &target);
+    let packages = if args.redeploy {
+        args.packages.clone()
+    } else {
+        packages_to_deploy(
+            installed.as_deref(),
+            changed.as_ref(),
+            &args.packages,
+            &target,
+        )
+    };
+    if packages.is_empty() {
+        info!("All the packages are already up to date on the DUT");
+        return Ok(());
+    }
+
+    cros_workon_user_packages(
+        &chroot,
+        &board,
+        &packages,
+        &packages_str,
+        &target,
+        args.skip_reboot,
+    )?;
+
+    if let (Some(kernel_pkg), true) = (&kernel_pkg, args.fast_kernel) {
+        KernelFastDeploy::new(&chroot, &board, kernel_pkg, &target)?.run(args.ab_update)?;
+        if !args.skip_reboot {
+            info!("Rebooting DUT...");
+            target.run_cmd_piped(&["reboot; exit"])?;
+        }
+        return Ok(());
+    }
 
     if kernel_pkg.is_some() {
         chroot.run_bash_script_in_chroot(
@@ -88,10 +212,234 @@ $TOPDIR/src/scripts/update_kernel.sh {} --remote={} --ssh_port {} --remote_boota
     }
 
     if !args.skip_reboot {
+        let plan = restart_plan(installed.as_deref(), changed.as_ref(), args.force_reboot);
+        activate(&plan, &target)?;
+    }
+
+    Ok(())
+}
+
+/// Returns the contents of the packages built for the board, to compare them
+/// with the files on DUTs. Returns None if they are not available.
+fn query_contents(
+    chroot: &Chroot,
+    board: &str,
+    packages: &[String],
+) -> Option<Vec<InstalledPackage>> {
+    InstalledPackage::query(chroot, board, packages)
+        .map_err(|e| warn!("Failed to get the contents of the packages: {e:#}"))
+        .ok()
+}
+
+/// Returns the files of the packages which differ on the DUT, or None if
+/// they are unknown.
+fn changed_files(
+    installed: Option<&[InstalledPackage]>,
+    target: &SshInfo,
+) -> Option<HashSet<String>> {
+    changed_on_dut(target, installed?)
+        .map_err(|e| warn!("Failed to check the packages on the DUT: {e:#}"))
+        .ok()
+}
+
+/// Returns the packages whose files are not identical on the DUT yet.
+fn packages_to_deploy(
+    installed: Option<&[InstalledPackage]>,
+    changed: Option<&HashSet<String>>,
+    packages: &[String],
+    target: &SshInfo,
+) -> Vec<String> {
+    let (Some(installed), Some(changed)) = (installed, changed) else {
+        return packages.to_vec();
+    };
+    packages
+        .iter()
+        .filter(|atom| {
+            let matched: Vec<&InstalledPackage> = installed
+                .iter()
+                .filter(|p| atom_matches(atom, p.cpv()))
+                .collect();
+            let up_to_date = !matched.is_empty() && matched.iter().all(|p| p.is_identical(changed));
+            if up_to_date {
+                info!(
+                    "{}: skipping {atom} since it is already up to date",
+                    target.host_and_port()
+                );
+            }
+            !up_to_date
+        })
+        .cloned()
+        .collect()
+}
+
+/// Decide how to make the packages effective on a DUT, from the files
+/// installed by them and the ones which differed on the DUT.
+fn restart_plan(
+    installed: Option<&[InstalledPackage]>,
+    changed: Option<&HashSet<String>>,
+    force_reboot: bool,
+) -> RestartPlan {
+    if force_reboot {
+        return RestartPlan::Reboot {
+            reason: "--force-reboot is specified".to_string(),
+        };
+    }
+    match installed {
+        Some(installed) => RestartPlan::new(installed, changed),
+        None => RestartPlan::Reboot {
+            reason: "the contents of the packages are unknown".to_string(),
+        },
+    }
+}
+
+fn activate(plan: &RestartPlan, target: &SshInfo) -> Result<()> {
+    info!("{}: {plan}", target.host_and_port());
+    if plan.needs_reboot() {
         info!("Rebooting DUT...");
         target.run_cmd_piped(&["reboot; exit"])?;
+    } else {
+        let restarted = plan.apply(target)?;
+        info!("{}: restarted {restarted:?}", target.host_and_port());
     }
+    Ok(())
+}
 
+/// Deploy the packages to DUTs of the same board. The packages are built
+/// once (with --build), and then deployed to up to `--jobs` DUTs at once.
+fn deploy_to_duts(args: &Args, duts: &[String]) -> Result<()> {
+    if extract_kernel_pkg(&args.packages)?.is_some() {
+        bail!("--duts can not be used with kernel packages");
+    }
+    if args.packages.is_empty() {
+        bail!("Please specify packages to deploy");
+    }
+    let chroot = Chroot::new(&get_cros_dir(&args.cros)?)?;
+    let pool = rayon::ThreadPoolBuilder::new()
+        .num_threads(args.jobs.max(1))
+        .build()
+        .context("Failed to create a thread pool")?;
+    info!("Connecting to {} DUTs...", duts.len());
+    let targets: Vec<Result<(SshInfo, String)>> = pool.install(|| {
+        duts.par_iter()
+            .map(|dut| {
+                let target = SshInfo::new(dut)?.into_forwarded()?;
+                let board = target.get_board()?;
+                Ok((target, board))
+            })
+            .collect()
+    });
+    // Build for the board that most of the DUTs are running
+    let mut boards: HashMap<&str, usize> = HashMap::new();
+    for (_, board) in targets.iter().flatten() {
+        *boards.entry(board).or_default() += 1;
+    }
+    let board = boards
+        .into_iter()
+        .max_by_key(|(_, count)| *count)
+        .map(|(board, _)| board.to_string())
+        .context("None of the DUTs are reachable")?;
+    let packages_str = args.packages.join(" ");
+    chroot.run_bash_script_in_chroot(
+        "build_for_duts",
+        &format!(
+            r###"
+cros-workon-{board} start {packages_str}
+{}
+"###,
+            if args.build {
+                format!("emerge-{board} {packages_str}")
+            } else {
+                String::new()
+            }
+        ),
+        None,
+    )?;
+    let installed = query_contents(&chroot, &board, &args.packages);
+    let deploy_opts = if !args.skip_reboot {
+        "--force --no-restart-ui"
+    } else {
+        "--force"
+    };
+    let start = Instant::now();
+    let results: Vec<(Duration, Result<usize>)> = pool.install(|| {
+        targets
+            .par_iter()
+            .enumerate()
+            .map(|(i, target)| {
+                let result = match target {
+                    Ok((_, dut_board)) if *dut_board != board => {
+                        Err(anyhow!("board is {dut_board}, not {board}"))
+                    }
+                    Ok((target, _)) => {
+                        let changed = changed_files(installed.as_deref(), target);
+                        let packages = if args.redeploy {
+                            args.packages.clone()
+                        } else {
+                            packages_to_deploy(
+                                installed.as_deref(),
+                                changed.as_ref(),
+                                &args.packages,
+                                target,
+                            )
+                        };
+                        if packages.is_empty() {
+                            Ok(0)
+                        } else {
+                            chroot
+                                .run_bash_script_in_chroot(
+                                    &format!("deploy_{i}"),
+                                    &format!(
+                                        "cros deploy {deploy_opts} {} {}",
+                                        target.host_and_port(),
+                                        packages.join(" ")
+                                    ),
+                                    None,
+                                )
+                                .and_then(|_| {
+                                    if args.skip_reboot {
+                                        return Ok(());
+                                    }
+                                    let plan = restart_plan(
+                                        installed.as_deref(),
+                                        changed.as_ref(),
+                                        args.force_reboot,
+                                    );
+                                    activate(&plan, target)
+                                })
+                                .map(|_| packages.len())
+                        }
+                    }
+                    Err(e) => Err(anyhow!("{e:#}")),
+                };
+                (start.elapsed(), result)
+            })
+            .collect()
+    });
+    println!("{:<32} {:>8}  result", "DUT", "time");
+    let mut failed = Vec::new();
+    for (dut, (at, result)) in duts.iter().zip(&results) {
+        match result {
+            Ok(0) => println!("{dut:<32} {:>7.1}s  up to date", at.as_secs_f64()),
+            Ok(n) => println!(
+                "{dut:<32} {:>7.1}s  ok ({n} of {} packages deployed)",
+                at.as_secs_f64(),
+                args.packages.len()
+            ),
+            Err(e) => {
+                println!("{dut:<32} {:>7.1}s  failed: {e:#}", at.as_secs_f64());
+                failed.push(dut.as_str());
+            }
+        }
+    }
+    info!(
+        "Deployed to {} of {} DUTs in {:.1?}",
+        duts.len() - failed.len(),
+        duts.len(),
+        start.elapsed()
+    );
+    if !failed.is_empty() {
+        bail!("Failed to deploy to: {}", failed.join(","));
+    }
     Ok(())
 }
 
@@ -116,6 +464,7 @@ fn cros_workon_user_packages(
     packages: &[String],
     packages_str: &str,
     target: &SshInfo,
+    restart_ui: bool,
 ) -> Result<()> {
     // Filter out all kernel packages and join them into a space seperated list.
     let user_pkgs: String = packages
@@ -129,7 +478,8 @@ fn cros_workon_user_packages(
         chroot.run_bash_script_in_chroot(
             "deploy",
             &format!(
-                r"cros-workon-{board} start {packages_str} && cros deploy --force {} {user_pkgs}",
+                r"cros-workon-{board} start {packages_str} && cros deploy --force {} {} {user_pkgs}",
+                if restart_ui { "" } else { "--no-restart-ui" },
                 target.host_and_port()
             ),
             None,
@@ -138,3 +488,107 @@ fn cros_workon_user_packages(
 
     Ok(())
 }
+
+/// Build the packages, and deploy each of them once its binary package is
+/// ready. Since emerge merges packages in their dependency order, deploying
+/// them in the order of completion keeps the dependencies satisfied.
+fn build_and_deploy(
+    chroot: &Chroot,
+    board: &str,
+    packages: &[String],
+    target: &SshInfo,
+) -> Result<()> {
+    let packages_str = packages.join(" ");
+    let start = Instant::now();
+    let (tx, rx) = mpsc::channel::<String>();
+    let (build_result, deployed) = thread::scope(|s| {
+        let deployer = s.spawn(|| -> Result<Vec<(String, Duration, Result<()>)>> {
+            // Start the session now so that it is ready when the first
+            // package is built.
+            let mut session = chroot.start_session()?;
+            let mut deployed = Vec::new();
+            for package in rx {
+                info!("{package}: built in {:.1?}, deploying...", start.elapsed());
+                let result = session.run(
+                    "pipelined_deploy",
+                    &format!(
+                        "cros deploy --force --no-restart-ui {} {package}",
+                        target.host_and_port()
+                    ),
+                    &mut |_| {},
+                );
+                if let Err(e) = &result {
+                    error!("{package}: failed to deploy: {e:#}");
+                }
+                deployed.push((package, start.elapsed(), result));
+            }
+            Ok(deployed)
+        });
+        let build_result = chroot.run_bash_script_in_chroot_with_line_handler(
+            "build_for_deploy",
+            &format!(
+                r###"
+cros-workon-{board} start {packages_str}
+export FEATURES="buildpkg"
+emerge-{board} {packages_str}
+"###
+            ),
+            None,
+            &mut |line| {
+                if let Some(EmergeEvent::Completed { package }) = parse_line(line) {
+                    if let Some(atom) = packages.iter().find(|p| atom_matches(p, &package)) {
+                        let _ = tx.send(atom.to_string());
+                    }
+                }
+            },
+        );
+        drop(tx);
+        let deployed = deployer
+            .join()
+            .map_err(|_| anyhow!("The deploy thread panicked"));
+        (build_result, deployed)
+    });
+    build_result?;
+    let mut deployed = deployed??;
+    // Deploy the packages whose completion was not seen in the output, if any.
+    let missed: Vec<&String> = packages
+        .iter()
+        .filter(|p| !deployed.iter().any(|(d, _, _)| d == *p))
+        .collect();
+    if !missed.is_empty() {
+        let missed = missed
+            .iter()
+            .map(|p| p.as_str())
+            .collect::<Vec<_>>()
+            .join(" ");
+        let result = chroot.run_bash_script_in_chroot(
+            "pipelined_deploy",
+            &format!(
+                "cros deploy --force --no-restart-ui {} {missed}",
+                target.host_and_port()
+            ),
+            None,
+        );
+        deployed.push((missed, start.elapsed(), result.map(|_| ())));
+    }
+    println!("{:<40} {:>10}  result", "package", "deployed");
+    let mut failed = Vec::new();
+    for (package, at, result) in &deployed {
+        println!(
+            "{package:<40} {:>9.1}s  {}",
+            at.as_secs_f64(),
+            if result.is_ok() { "ok" } else { "failed" }
+        );
+        if result.is_err() {
+            failed.push(package.as_str());
+        }
+    }
+    if !failed.is_empty() {
+        bail!("Failed to deploy: {}", failed.join(" "));
+    }
+    info!(
+        "Built and deployed {packages_str} in {:.1?}",
+        start.elapsed()
+    );
+    Ok(())
+}
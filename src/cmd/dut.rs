@@ -32,6 +32,18 @@
 
 //! # Monitor DUTs and keep them accessible via local port forwarding
 //! cro3 dut monitor ${DUT}
+//!
+//! # Write an image to the inactive slot in background (20 MiB/s by default)
+//! cro3 dut stage --cros ${CROS} --dut ${DUT} --version R120-15662.0.0
+//! # Boot the staged image
+//! cro3 dut stage --dut ${DUT} --activate --reboot
+//! # Roll back to the previous image
+//! cro3 dut do switch_to_secondary reboot
+//!
+//! # Save the user state of a DUT, and reset the DUT to it later
+//! cro3 dut snapshot --dut ${DUT} save clean
+//! cro3 dut snapshot --dut ${DUT} restore clean
+//! cro3 dut snapshot list
 //! ```
 
 use std::collections::HashMap;
@@ -40,6 +52,7 @@ use std::fs::read_to_string;
 use std::io::stdout;
 use std::io::Read;
 use std::io::Write;
+use std::path::PathBuf;
 use std::thread;
 use std::time;
 
@@ -48,7 +61,10 @@ use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
 use argh::FromArgs;
+use cro3::ab_update::generate_stateful_payload;
+use cro3::ab_update::AbUpdateTarget;
 use cro3::chroot::Chroot;
+use cro3::config::Config;
 use cro3::cros;
 use cro3::dut::discover_local_nodes;
 use cro3::dut::fetch_dut_info_in_parallel;
@@ -57,10 +73,16 @@ use cro3::dut::DutInfo;
 use cro3::dut::MonitoredDut;
 use cro3::dut::SshInfo;
 use cro3::dut::SSH_CACHE;
+use cro3::image::DiskImage;
+use cro3::image_cache::ImageCache;
 use cro3::repo::get_cros_dir;
 use cro3::servo::get_cr50_attached_to_servo;
 use cro3::servo::LocalServo;
 use cro3::servo::ServoList;
+use cro3::snapshot::parse_dirs;
+use cro3::snapshot::Snapshot;
+use cro3::snapshot::DEFAULT_DIRS;
+use cro3::util::size::parse_size;
 use lazy_static::lazy_static;
 use rayon::prelude::*;
 use termion::screen::IntoAlternateScreen;
@@ -89,6 +111,8 @@ enum SubCommand {
     Pull(ArgsPull),
     Push(ArgsPush),
     Setup(ArgsSetup),
+    Snapshot(ArgsDutSnapshot),
+    Stage(ArgsDutStage),
     Vnc(ArgsVnc),
 }
 #[tracing::instrument(level = "trace")]
@@ -105,6 +129,8 @@ pub fn run(args: &Args) -> Result<()> {
         SubCommand::Pull(args) => run_dut_pull(args),
         SubCommand::Push(args) => run_dut_push(args),
         SubCommand::Setup(args) => run_setup(args),
+        SubCommand::Snapshot(args) => run_dut_snapshot(args),
+        SubCommand::Stage(args) => run_dut_stage(args),
         SubCommand::Vnc(args) => run_dut_vnc(args),
     }
 }
@@ -713,6 +739,154 @@ fn run_dut_do(args: &ArgsDutDo) -> Result<()> {
     Ok(())
 }
 
+#[derive(FromArgs, PartialEq, Debug)]
+/// write an image to the inactive slot while the DUT keeps running, and
+/// switch to it later
+#[argh(subcommand, name = "stage")]
+struct ArgsDutStage {
+    /// a DUT identifier (e.g. 127.0.0.1, localhost:2222)
+    #[argh(option)]
+    dut: String,
+    /// target cros repo dir (to generate the stateful payload)
+    #[argh(option)]
+    cros: Option<String>,
+    /// path to a test image to stage
+    #[argh(option)]
+    image: Option<String>,
+    /// version of the test image to stage (e.g. R120-15662.0.0)
+    #[argh(option)]
+    version: Option<String>,
+    /// max bandwidth per transfer in bytes per second (e.g. 20M, 0 for
+    /// unlimited)
+    #[argh(option, default = "String::from(\"20M\")")]
+    bwlimit: String,
+    /// write only the blocks which differ from the ones on the DUT
+    #[argh(switch)]
+    delta: bool,
+    /// switch to the staged slot on the next boot, instead of staging
+    #[argh(switch)]
+    activate: bool,
+    /// reboot after --activate
+    #[argh(switch)]
+    reboot: bool,
+}
+fn run_dut_stage(args: &ArgsDutStage) -> Result<()> {
+    cros::ensure_testing_rsa_is_there()?;
+    if args.reboot && !args.activate {
+        bail!("--reboot is only for --activate");
+    }
+    let ssh = SshInfo::new(&args.dut)?.into_forwarded()?;
+    let board = ssh.get_board()?;
+    let limit = parse_size(&args.bwlimit)?;
+    let target = AbUpdateTarget::prepare(&ssh, &board)?
+        .with_delta(args.delta)
+        .with_bandwidth_limit((limit > 0).then_some(limit));
+    if args.activate {
+        target.activate()?;
+        info!(
+            "The DUT will boot from KERN {} on the next boot",
+            target.slot().kern
+        );
+        if args.reboot {
+            target.reboot()?;
+        }
+        return Ok(());
+    }
+    let repo = get_cros_dir(&args.cros)?;
+    let image = match (&args.image, &args.version) {
+        (Some(image), None) => PathBuf::from(image),
+        (None, Some(version)) => ImageCache::from_config(&Config::read()?)?
+            .get_test_image(&board, &cros::lookup_full_version(version, &board)?)?,
+        _ => bail!("Please specify either --image or --version"),
+    };
+    let image = DiskImage::open(&image)?;
+    let chroot = Chroot::new(&repo)?;
+    let start = time::Instant::now();
+    target.stage(&image, || {
+        generate_stateful_payload(&chroot, &repo, image.path())
+    })?;
+    info!(
+        "Staged {:?} in {:.1?}. Run `cro3 dut stage --dut {} --activate --reboot` to boot it.",
+        image.path(),
+        start.elapsed(),
+        args.dut
+    );
+    Ok(())
+}
+
+#[derive(FromArgs, PartialEq, Debug)]
+/// save / restore the user state in the stateful partition
+#[argh(subcommand, name = "snapshot")]
+struct ArgsDutSnapshot {
+    /// a DUT identifier (e.g. 127.0.0.1, localhost:2222)
+    #[argh(option)]
+    dut: Option<String>,
+    /// dirs in the stateful partition to save (comma separated, default:
+    /// encrypted.block,encrypted.key,home,unencrypted)
+    #[argh(option)]
+    dirs: Option<String>,
+    /// do not reboot the DUT after restoring
+    #[argh(switch)]
+    no_reboot: bool,
+    /// save, restore, list, verify or delete
+    #[argh(positional)]
+    action: String,
+    /// snapshot name
+    #[argh(positional)]
+    name: Option<String>,
+}
+fn run_dut_snapshot(args: &ArgsDutSnapshot) -> Result<()> {
+    let name = || {
+        args.name
+            .as_deref()
+            .context("Please specify a snapshot name")
+    };
+    let ssh = || -> Result<SshInfo> {
+        cros::ensure_testing_rsa_is_there()?;
+        SshInfo::new(args.dut.as_ref().context("Please specify --dut")?)?.into_forwarded()
+    };
+    match args.action.as_str() {
+        "save" => {
+            let dirs: Vec<String> = match &args.dirs {
+                Some(dirs) => parse_dirs(dirs)?,
+                None => DEFAULT_DIRS.iter().map(|s| s.to_string()).collect(),
+            };
+            Snapshot::save(&ssh()?, name()?, &dirs)?;
+        }
+        "restore" => {
+            let ssh = ssh()?;
+            Snapshot::load(name()?)?.restore(&ssh)?;
+            if !args.no_reboot {
+                info!("Rebooting DUT...");
+                ssh.run_cmd_piped(&["reboot; exit"])?;
+            }
+        }
+        "verify" => {
+            Snapshot::load(name()?)?.verify()?;
+            info!("Snapshot is intact");
+        }
+        "delete" => Snapshot::delete(name()?)?,
+        "list" => {
+            println!(
+                "{:<24} {:<16} {:<20} {:>10}  created",
+                "name", "board", "dut", "size"
+            );
+            for s in Snapshot::list()? {
+                println!(
+                    "{:<24} {:<16} {:<20} {:>7} MiB  {}",
+                    s.name,
+                    s.board,
+                    s.dut,
+                    s.size >> 20,
+                    s.created
+                );
+            }
+        }
+        action => bail!("Unknown action: {action}. Use save, restore, list, verify or delete."),
+    }
+    Ok(())
+}
+
 #[derive(Debug, Copy, Clone, PartialEq, Eq)]
 enum DutStatus {
     Online,
@@ -11,20 +11,93 @@
 //! # Flash an image into a USB stick
 //! cro3 flash --cros ${CROS} --usb --board ${BOARD}
 //! ```
+//!
+//! Local images (`--image`, or cached ones of a specific `--version`) are
+//! written to USB sticks by cro3 itself. Multiple sticks can be written at
+//! once by repeating `--usb-dev` (the only removable USB disk is used if it
+//! is omitted).
+//! ```
+//! cro3 flash --usb --image chromiumos_test_image.bin.xz --usb-dev /dev/sdb --usb-dev /dev/sdc
+//! ```
+//!
+//! Test images of a specific version (e.g. `--version R120-15662.0.0`) are
+//! downloaded once into ~/.cro3/images and reused for the following flashes.
+//! ```
+//! # Limit the size of the image cache (default: 50G)
+//! cro3 config set image_cache_max_size 20G
+//! # Always let cros flash download the image
+//! cro3 flash --cros ${CROS} --dut ${DUT} --version R120-15662.0.0 --no-image-cache
+//! ```
+//!
+//! With `--duts`, the image is downloaded once and written to the inactive
+//! slot of up to `--jobs` DUTs at once, without `cros flash`. As with
+//! `cros flash`, the stateful partition is wiped and the TPM owner is cleared
+//! on the next boot.
+//! ```
+//! cro3 flash --cros ${CROS} --duts 'brya_*' --version R120-15662.0.0 --jobs 8
+//! cro3 flash --cros ${CROS} --duts ${DUT1},${DUT2} --use-local-image --board ${BOARD}
+//! ```
+//!
+//! Phases of each flash (download, partition updates, reboot, ...) are shown
+//! at the end, saved as a trace in ~/.cro3/flash_traces (open it with
+//! https://ui.perfetto.dev) and recorded in the history of the DUT.
+//! ```
+//! cro3 flash --history --dut ${DUT}
+//! ```
+//!
+//! `--delta` writes only the chunks of the partitions that differ from the
+//! ones on the DUT, which is much faster when the DUT is already running a
+//! nearby version.
+//! ```
+//! cro3 flash --cros ${CROS} --dut ${DUT} --version R120-15663.0.0 --delta
+//! ```
 
+use std::io;
+use std::io::BufRead;
+use std::io::BufReader;
+use std::io::ErrorKind;
+use std::io::Read;
+use std::path::Path;
+use std::path::PathBuf;
 use std::process::Command;
+use std::process::Stdio;
+use std::time::Duration;
+use std::time::Instant;
 
 use anyhow::anyhow;
 use anyhow::bail;
+use anyhow::Context;
 use anyhow::Result;
 use argh::FromArgs;
+use cro3::ab_update::generate_stateful_payload;
+use cro3::ab_update::AbUpdateTarget;
+use cro3::chroot::Chroot;
+use cro3::config::Config;
 use cro3::cros::ensure_testing_rsa_is_there;
 use cro3::cros::lookup_full_version;
+use cro3::dut::resolve_duts;
 use cro3::dut::DutInfo;
+use cro3::dut::SshInfo;
+use cro3::flash_progress::flash_history;
+use cro3::flash_progress::median_seconds;
+use cro3::flash_progress::record_flash;
+use cro3::flash_progress::FlashTelemetry;
+use cro3::image::latest_local_image;
+use cro3::image::DiskImage;
+use cro3::image_cache::ImageCache;
 use cro3::repo::get_cros_dir;
+use cro3::trace_event::TraceWriter;
+use cro3::usb_writer::check_usb_device;
+use cro3::usb_writer::list_usb_devices;
+use cro3::usb_writer::write_image;
+use indicatif::MultiProgress;
+use indicatif::ProgressBar;
+use indicatif::ProgressStyle;
+use rayon::prelude::*;
 use regex::Regex;
 use tracing::error;
 use tracing::info;
+use tracing::warn;
 
 fn get_board_from_dut(dut: &str) -> Result<String> {
     let dut = DutInfo::new(dut)?;
@@ -85,10 +158,23 @@ pub struct Args {
     #[argh(switch)]
     usb: bool,
 
+    /// block device of a USB stick to write to (repeatable, with --usb)
+    #[argh(option)]
+    usb_dev: Vec<String>,
+
     /// flash to a dut
     #[argh(option)]
     dut: Option<String>,
 
+    /// flash to DUTs of the same board in parallel (comma separated, glob
+    /// patterns are matched with the DUTs in `cro3 dut list`)
+    #[argh(option)]
+    duts: Option<String>,
+
+    /// max number of DUTs to flash in parallel (with --duts)
+    #[argh(option, default = "8")]
+    jobs: usize,
+
     /// target cros repo dir
     #[argh(option)]
     cros: Option<String>,
@@ -117,14 +203,37 @@ pub struct Args {
     #[argh(switch)]
     enable_rootfs_verification: bool,
 
+    /// write only the blocks which differ from the ones on the DUT (implies
+    /// the parallel A/B writer used by --duts)
+    #[argh(switch)]
+    delta: bool,
+
+    /// do not use the local image cache (~/.cro3/images)
+    #[argh(switch)]
+    no_image_cache: bool,
+
+    /// show the recorded flashes (of --dut, or all the DUTs) and exit
+    #[argh(switch)]
+    history: bool,
+
     #[argh(option, hidden_help)]
     repo: Option<String>,
 }
 #[tracing::instrument(level = "trace")]
 pub fn run(args: &Args) -> Result<()> {
-    // repo path is needed since cros flash outside chroot only works within the
-    // cros checkout
-    let repo = &get_cros_dir(&args.cros)?;
+    if args.history {
+        return print_history(args.dut.as_deref());
+    }
+    if let Some(duts) = &args.duts {
+        if args.dut.is_some() || args.usb {
+            bail!("--duts can not be used with --dut nor --usb");
+        }
+        return flash_duts(args, &get_cros_dir(&args.cros)?, &resolve_duts(duts)?);
+    }
+    if args.delta {
+        let dut = args.dut.as_ref().context("--delta needs --dut or --duts")?;
+        return flash_duts(args, &get_cros_dir(&args.cros)?, std::slice::from_ref(dut));
+    }
 
     let image_path = if let Some(image) = &args.image {
         // If --image is specified, use the local file
@@ -155,9 +264,29 @@ pub fn run(args: &Args) -> Result<()> {
             ));
         }
         let variant = if args.recovery { "signed" } else { "test" };
-        format!("xBuddy://{host}/{board_to_flash}/{version}/{variant}")
+        // latest-* are moving targets, so they are left to xBuddy.
+        if host == "remote"
+            && variant == "test"
+            && !version.starts_with("latest")
+            && !args.no_image_cache
+        {
+            ImageCache::from_config(&Config::read()?)?
+                .get_test_image(&board_to_flash, &version)?
+                .to_string_lossy()
+                .to_string()
+        } else {
+            format!("xBuddy://{host}/{board_to_flash}/{version}/{variant}")
+        }
     };
 
+    // Local images are written to USB sticks without the checkout
+    if args.usb && !image_path.starts_with("xBuddy://") {
+        return write_usb(args, &image_path);
+    }
+    // repo path is needed since cros flash outside chroot only works within the
+    // cros checkout
+    let repo = &get_cros_dir(&args.cros)?;
+
     // Determine a destination
     let destination = match (&args.dut, args.usb, args.recovery) {
         (Some(dut), false, false) => {
@@ -181,13 +310,296 @@ pub fn run(args: &Args) -> Result<()> {
     cmd_args.push(&destination);
     cmd_args.push(&image_path);
 
-    let cmd = Command::new("cros")
+    // chromite logs to stderr. It is parsed into the phases of the flash,
+    // while progress bars on stdout are left as is.
+    let mut telemetry = FlashTelemetry::new(args.dut.as_deref().unwrap_or("usb"));
+    let mut cmd = Command::new("cros")
         .current_dir(repo)
         .args(cmd_args)
+        .stderr(Stdio::piped())
         .spawn()?;
+    if let Some(stderr) = cmd.stderr.take() {
+        forward_stderr(stderr, &mut telemetry);
+    }
     let result = cmd.wait_with_output()?;
+    telemetry.finish(result.status.success());
+    println!("{}", telemetry.report());
+    match telemetry.save_trace() {
+        Ok(path) => info!("Trace of the flash: {path:?}"),
+        Err(e) => warn!("Failed to save the trace: {e:#}"),
+    }
+    if let Some(dut) = &args.dut {
+        record_flash(dut, telemetry.record(&image_path))?;
+    }
     if !result.status.success() {
         error!("cros sdk failed");
     }
     Ok(())
 }
+
+/// Forward the log of cros flash to stderr while parsing it. The pipe is
+/// drained until the end even if the log can not be read as text, so that
+/// cros flash never dies of SIGPIPE in the middle of a flash.
+fn forward_stderr(stderr: impl Read, telemetry: &mut FlashTelemetry) {
+    let mut stderr = BufReader::new(stderr);
+    let mut buf = Vec::new();
+    loop {
+        buf.clear();
+        match stderr.read_until(b'\n', &mut buf) {
+            Ok(0) => return,
+            Ok(_) => {
+                let line = String::from_utf8_lossy(&buf);
+                let line = line.trim_end_matches(['\r', '\n']);
+                eprintln!("{line}");
+                telemetry.handle_line(line);
+            }
+            Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+            Err(e) => {
+                warn!("Failed to read the log of cros flash: {e}");
+                let _ = io::copy(&mut stderr, &mut io::stderr());
+                return;
+            }
+        }
+    }
+}
+
+/// Print the recorded flashes, and how the last one compares to the median.
+fn print_history(dut: Option<&str>) -> Result<()> {
+    let history = flash_history()?;
+    println!(
+        "{:<32} {:<25} {:>8} {:>8}  slowest phase",
+        "DUT", "date", "time", "result"
+    );
+    for (name, records) in history
+        .iter()
+        .filter(|(name, _)| dut.is_none() || dut == Some(name))
+    {
+        for r in records {
+            let slowest = r
+                .phases
+                .iter()
+                .max_by(|a, b| a.1.total_cmp(&b.1))
+                .map(|(phase, secs)| format!("{phase} ({secs:.1}s)"))
+                .unwrap_or_default();
+            println!(
+                "{name:<32} {:<25} {:>7.1}s {:>8}  {slowest}",
+                r.date,
+                r.seconds,
+                if r.success { "ok" } else { "failed" },
+            );
+        }
+        if let (Some(median), Some(last)) = (median_seconds(records), records.last()) {
+            if last.success {
+                info!(
+                    "{name}: the last flash took {:+.0}% compared to the median ({median:.1}s)",
+                    (last.seconds / median - 1.0) * 100.0
+                );
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Write a local image to USB sticks without cros flash.
+fn write_usb(args: &Args, image: &str) -> Result<()> {
+    let usb_devices = list_usb_devices()?;
+    let devices: Vec<PathBuf> = if args.usb_dev.is_empty() {
+        if usb_devices.len() != 1 {
+            bail!("Found USB disks {usb_devices:?}. Please specify them with --usb-dev");
+        }
+        usb_devices.clone()
+    } else {
+        args.usb_dev.iter().map(PathBuf::from).collect()
+    };
+    let devices = devices
+        .iter()
+        .map(|dev| check_usb_device(dev, &usb_devices))
+        .collect::<Result<Vec<_>>>()?;
+    info!("Writing {image} to {devices:?}...");
+    let results = write_image(Path::new(image), &devices, true)?;
+    let mut failed = Vec::new();
+    for r in &results {
+        match &r.result {
+            Ok(()) => println!("{:<24} ok", r.destination.display()),
+            Err(e) => {
+                println!("{:<24} failed: {e:#}", r.destination.display());
+                failed.push(r.destination.display().to_string());
+            }
+        }
+    }
+    if !failed.is_empty() {
+        bail!("Failed to write to: {}", failed.join(","));
+    }
+    Ok(())
+}
+
+/// Returns the local image file to be written to the DUTs, and true if it
+/// is in the image cache.
+fn image_for_duts(args: &Args, repo: &str, board: &str) -> Result<(PathBuf, bool)> {
+    if let Some(image) = &args.image {
+        return Ok((PathBuf::from(image), false));
+    }
+    if args.use_local_image {
+        return Ok((latest_local_image(repo, board, "test"), false));
+    }
+    if args.version.starts_with("latest") {
+        bail!(
+            "--duts needs a specific --version (e.g. R120-15662.0.0), --image or --use-local-image"
+        );
+    }
+    let version = lookup_full_version(&args.version, board)?;
+    let image = ImageCache::from_config(&Config::read()?)?.get_test_image(board, &version)?;
+    Ok((image, true))
+}
+
+/// Apply the options of the command line to the writer. Stateful and the
+/// TPM owner are cleared as `cros flash` does in the other path.
+fn configure_target(target: AbUpdateTarget, args: &Args) -> AbUpdateTarget {
+    target
+        .with_delta(args.delta)
+        .with_clobber_stateful(true)
+        .with_clear_tpm_owner(true)
+}
+
+/// Write the same test image to the DUTs. The image is downloaded,
+/// decompressed and turned into a stateful payload once, and then its
+/// partitions are streamed to up to `--jobs` DUTs at once.
+fn flash_duts(args: &Args, repo: &str, duts: &[String]) -> Result<()> {
+    if args.recovery {
+        bail!("--recovery can not be used with --duts");
+    }
+    ensure_testing_rsa_is_there()?;
+    let pool = rayon::ThreadPoolBuilder::new()
+        .num_threads(args.jobs.max(1))
+        .build()
+        .context("Failed to create a thread pool")?;
+    info!("Connecting to {} DUTs...", duts.len());
+    let targets: Vec<Result<SshInfo>> = pool.install(|| {
+        duts.par_iter()
+            .map(|dut| SshInfo::new(dut)?.into_forwarded())
+            .collect()
+    });
+    let board = match &args.board {
+        Some(board) => board.clone(),
+        None => targets
+            .iter()
+            .flatten()
+            .next()
+            .context("None of the DUTs are reachable")?
+            .get_board()?,
+    };
+    let (image, cached) = image_for_duts(args, repo, &board)?;
+    let image = DiskImage::open(&image)?;
+    // The payload next to a cached image never goes stale since the cache
+    // is content-addressed.
+    let payload = image.path().with_file_name("stateful.tgz");
+    let payload = if cached && payload.exists() {
+        payload
+    } else {
+        generate_stateful_payload(&Chroot::new(repo)?, repo, image.path())?
+    };
+    info!("Writing {:?} to {} DUTs...", image.path(), duts.len());
+    let start = Instant::now();
+    let bars = MultiProgress::new();
+    let style = ProgressStyle::with_template("{prefix:<32} {elapsed:>4} {spinner} {msg}")?;
+    let results: Vec<(Duration, Result<()>, FlashTelemetry)> = pool.install(|| {
+        targets
+            .par_iter()
+            .zip(duts)
+            .map(|(ssh, dut)| {
+                // DUTs waiting for a thread get their line when they start
+                let bar = bars.add(
+                    ProgressBar::new_spinner()
+                        .with_style(style.clone())
+                        .with_prefix(dut.clone()),
+                );
+                bar.enable_steady_tick(Duration::from_millis(200));
+                let mut telemetry = FlashTelemetry::new(dut).with_progress(bar);
+                let result = ssh.as_ref().map_err(|e| anyhow!("{e:#}")).and_then(|ssh| {
+                    telemetry.phase("prepare");
+                    let target = configure_target(AbUpdateTarget::prepare(ssh, &board)?, args);
+                    telemetry.phase("write");
+                    for t in target.apply(&image, || Ok(payload.clone()))? {
+                        telemetry.add_transfer(&t.name, t.start, t.duration, t.bytes);
+                    }
+                    if !args.enable_rootfs_verification {
+                        telemetry.phase("make_dev_ssd");
+                        ssh.run_cmd_stdio(&format!(
+                            "/usr/share/vboot/bin/make_dev_ssd.sh --partitions {} \
+                             --remove_rootfs_verification --force",
+                            target.slot().kern
+                        ))?;
+                    }
+                    telemetry.phase("reboot");
+                    target.reboot()
+                });
+                telemetry.finish(result.is_ok());
+                (telemetry.started().elapsed(), result, telemetry)
+            })
+            .collect()
+    });
+    let mut trace = TraceWriter::new();
+    for (i, (dut, (_, _, telemetry))) in duts.iter().zip(&results).enumerate() {
+        let offset = telemetry.started().saturating_duration_since(start);
+        telemetry.add_to_trace(&mut trace, i, offset);
+        println!("{}", telemetry.report());
+        record_flash(dut, telemetry.record(&image.path().to_string_lossy()))?;
+    }
+    match trace.save("flash_traces", "duts") {
+        Ok(path) => info!("Trace of the flashes: {path:?}"),
+        Err(e) => warn!("Failed to save the trace: {e:#}"),
+    }
+    println!("{:<32} {:>8}  result", "DUT", "time");
+    let mut failed = Vec::new();
+    for (dut, (at, result, _)) in duts.iter().zip(&results) {
+        match result {
+            Ok(()) => println!("{dut:<32} {:>7.1}s  ok (rebooting)", at.as_secs_f64()),
+            Err(e) => {
+                println!("{dut:<32} {:>7.1}s  failed: {e:#}", at.as_secs_f64());
+                failed.push(dut.as_str());
+            }
+        }
+    }
+    info!(
+        "Flashed {} of {} DUTs in {:.1?}",
+        duts.len() - failed.len(),
+        duts.len(),
+        start.elapsed()
+    );
+    if !failed.is_empty() {
+        bail!("Failed to flash: {}", failed.join(","));
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use cro3::ab_update::Slot;
+
+    use super::*;
+
+    #[test]
+    fn invalid_utf8_log() {
+        let log = b"10:20:30: INFO: Updating rootfs \xff\xfe\n10:20:31: INFO: Rebooting device.";
+        let mut telemetry = FlashTelemetry::new("dut");
+        forward_stderr(&log[..], &mut telemetry);
+        // The lines after the broken one are still parsed
+        let phases: Vec<&str> = telemetry.phases().iter().map(|p| p.name()).collect();
+        assert_eq!(phases, vec!["rootfs", "reboot"]);
+    }
+
+    #[test]
+    fn delta_reaches_writer() {
+        let ssh = SshInfo::new_host_and_port("localhost", 22).unwrap();
+        let slot = |kern, root| Slot { kern, root };
+        let target = || AbUpdateTarget::new(&ssh, "/dev/nvme0n1", slot(2, 3), slot(4, 5));
+        for (flags, delta) in [(vec!["--duts", "dut1"], false), (vec!["--delta"], true)] {
+            let args = Args::from_args(&["flash"], &flags).unwrap();
+            let target = configure_target(target(), &args);
+            assert_eq!(target.delta(), delta);
+            // Same as the --clobber-stateful --clear-tpm-owner of cros flash
+            assert!(target.clobber_stateful());
+            assert!(target.clear_tpm_owner());
+        }
+    }
+}
@@ -12,22 +12,37 @@
 //! cro3 sync --cros /work/chromiumos_versions/R110-15248.0.0/ --version R110-15248.0.0 --reference /work/chromiumos_mirror/
 //! cro3 sync --cros /work/chromiumos_versions/R110-15248.0.0/ --version R110-15248.0.0 # you can omit --reference if the config is set
 //! ```
+//!
+//! The full output of the last `repo sync` is kept in ~/.cro3/repo_sync.log.
+//! Projects which failed to sync are retried a few times on their own, and
+//! ones with corrupted git objects are re-cloned with `--force`.
+//!
+//! Fetch / checkout time and bytes fetched per project are recorded for each
+//! sync. The slowest projects and how they compare to the previous syncs can
+//! be shown with:
+//! ```
+//! cro3 sync --cros /work/chromiumos_stable/ --report
+//! ```
 
 use std::fs;
 use std::path::Path;
 
 use anyhow::bail;
+use anyhow::Context;
 use anyhow::Result;
 use argh::FromArgs;
 use cro3::arc::lookup_arc_version;
 use cro3::arc::setup_arc_repo;
 use cro3::cros::lookup_full_version;
+use cro3::cros::lookup_full_version_of_any_board;
 use cro3::cros::setup_cros_repo;
 use cro3::repo::get_cros_dir_unchecked;
 use cro3::repo::get_current_synced_arc_version;
 use cro3::repo::get_current_synced_cros_version;
 use cro3::repo::get_reference_repo;
 use cro3::repo::repo_sync;
+use cro3::sync_stats::report;
+use cro3::sync_stats::sync_history;
 use tracing::info;
 use tracing::warn;
 
@@ -53,9 +68,15 @@ pub struct Args {
     /// e.g. for chromeOS: 14899.0.0, tot, stable (for development)
     /// e.g. for arc: rvc, tm, master (which maps to master-arc-dev)
     #[argh(option)]
-    version: String,
+    version: Option<String>,
+
+    /// board whose release builds resolve a cros --version without the
+    /// milestone (e.g. 15662.0.0). If omitted, the builds of any board are
+    /// used.
+    #[argh(option)]
+    board: Option<String>,
 
-    /// destructive sync
+    /// destructive sync (remove and re-clone the projects which are corrupted)
     #[argh(switch)]
     force: bool,
 
@@ -63,6 +84,10 @@ pub struct Args {
     #[argh(switch)]
     verbose: bool,
 
+    /// show the slowest projects of the recent syncs of the checkout and exit
+    #[argh(switch)]
+    report: bool,
+
     #[argh(option, hidden_help)]
     repo: Option<String>,
 }
@@ -75,17 +100,22 @@ pub fn run(args: &Args) -> Result<()> {
         _ => bail!("Please specify either --cros or --arc."),
     };
 
-    let version = if is_cros {
-        extract_cros_version(&args.version)?
-    } else {
-        lookup_arc_version(&args.version)?
-    };
-
     let repo = if is_cros {
         get_cros_dir_unchecked(&args.cros)?
     } else {
         get_cros_dir_unchecked(&args.arc)?
     };
+    if args.report {
+        println!("{}", report(&sync_history(&repo)?, 30));
+        return Ok(());
+    }
+
+    let version = args.version.as_ref().context("--version is required")?;
+    let version = if is_cros {
+        extract_cros_version(version, args.board.as_deref())?
+    } else {
+        lookup_arc_version(version)?
+    };
 
     // Inform user of sync information.
     info!(
@@ -115,11 +145,13 @@ pub fn run(args: &Args) -> Result<()> {
 }
 
 /// Extract a appropriate version name from a argument.
-fn extract_cros_version(version: &String) -> Result<String> {
+fn extract_cros_version(version: &String, board: Option<&str>) -> Result<String> {
     if version == "tot" || version == "stable" {
         Ok(version.clone())
+    } else if let Some(board) = board {
+        lookup_full_version(version, board)
     } else {
-        Ok(lookup_full_version(version, "eve")?)
+        lookup_full_version_of_any_board(version)
     }
 }
 
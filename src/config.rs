@@ -19,6 +19,7 @@ use tracing::warn;
 
 use crate::util::cro3_paths::gen_path_in_cro3_dir;
 use crate::util::shell_helpers::run_bash_command;
+use crate::util::size::parse_size;
 
 #[derive(Debug, Clone, Serialize, Deserialize, Default)]
 pub struct SshOverride {
@@ -109,6 +110,30 @@ pub struct Config {
     #[serde(skip_serializing_if = "HashMap::is_empty")]
     #[serde(default)]
     arc_container_cheeps_image_for_branch: HashMap<String, String>,
+    /// Directory of the binary package store shared by all the checkouts.
+    /// ~/.cro3/binpkgs is used if not set.
+    #[serde(skip_serializing_if = "Option::is_none")]
+    #[serde(default)]
+    binpkg_cache_dir: Option<String>,
+    /// Size limits of the build caches shared by all the checkouts (e.g.
+    /// "50G")
+    #[serde(skip_serializing_if = "Option::is_none")]
+    #[serde(default)]
+    ccache_max_size: Option<String>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    #[serde(default)]
+    sccache_max_size: Option<String>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    #[serde(default)]
+    distfiles_max_size: Option<String>,
+    /// Size limit of the image cache in ~/.cro3/images (e.g. "50G")
+    #[serde(skip_serializing_if = "Option::is_none")]
+    #[serde(default)]
+    image_cache_max_size: Option<String>,
+    /// Bandwidth limit of downloads in bytes per second (e.g. "20M")
+    #[serde(skip_serializing_if = "Option::is_none")]
+    #[serde(default)]
+    download_bandwidth_limit: Option<String>,
 }
 static CONFIG_FILE_NAME: &str = "config.json";
 impl Config {
@@ -247,6 +272,30 @@ impl Config {
                 self.arc_container_cheeps_image_for_branch
                     .insert(branch, target);
             }
+            "binpkg_cache_dir" => {
+                if values.len() != 1 {
+                    bail!("{key} only takes 1 params");
+                }
+                self.binpkg_cache_dir = Some(values[0].as_ref().to_string());
+            }
+            "ccache_max_size"
+            | "sccache_max_size"
+            | "distfiles_max_size"
+            | "image_cache_max_size"
+            | "download_bandwidth_limit" => {
+                if values.len() != 1 {
+                    bail!("{key} only takes 1 params");
+                }
+                let size = values[0].as_ref().to_string();
+                parse_size(&size)?;
+                match key {
+                    "ccache_max_size" => self.ccache_max_size = Some(size),
+                    "sccache_max_size" => self.sccache_max_size = Some(size),
+                    "image_cache_max_size" => self.image_cache_max_size = Some(size),
+                    "download_bandwidth_limit" => self.download_bandwidth_limit = Some(size),
+                    _ => self.distfiles_max_size = Some(size),
+                }
+            }
             _ => bail!("config key {key} is not valid"),
         }
         self.write()
@@ -300,6 +349,24 @@ impl Config {
             "arc_container_cheeps_image_for_branch" => {
                 self.arc_container_cheeps_image_for_branch.clear()
             }
+            "binpkg_cache_dir" => {
+                self.binpkg_cache_dir = None;
+            }
+            "ccache_max_size" => {
+                self.ccache_max_size = None;
+            }
+            "sccache_max_size" => {
+                self.sccache_max_size = None;
+            }
+            "distfiles_max_size" => {
+                self.distfiles_max_size = None;
+            }
+            "image_cache_max_size" => {
+                self.image_cache_max_size = None;
+            }
+            "download_bandwidth_limit" => {
+                self.download_bandwidth_limit = None;
+            }
             _ => bail!("cro3 config clear for '{key}' is not implemented"),
         }
         self.write()?;
@@ -361,4 +428,24 @@ impl Config {
     pub fn arc_container_cheeps_image_for_branch(&self) -> &HashMap<String, String> {
         &self.arc_container_cheeps_image_for_branch
     }
+    pub fn binpkg_cache_dir(&self) -> Option<String> {
+        self.binpkg_cache_dir.clone()
+    }
+    pub fn ccache_max_size(&self) -> String {
+        self.ccache_max_size.clone().unwrap_or("50G".to_string())
+    }
+    pub fn sccache_max_size(&self) -> String {
+        self.sccache_max_size.clone().unwrap_or("20G".to_string())
+    }
+    pub fn distfiles_max_size(&self) -> String {
+        self.distfiles_max_size.clone().unwrap_or("30G".to_string())
+    }
+    pub fn image_cache_max_size(&self) -> String {
+        self.image_cache_max_size
+            .clone()
+            .unwrap_or("50G".to_string())
+    }
+    pub fn download_bandwidth_limit(&self) -> Option<String> {
+        self.download_bandwidth_limit.clone()
+    }
 }
@@ -13,39 +13,39 @@ use anyhow::Result;
 use regex_macro::regex;
 use tracing::info;
 
-use crate::cache::KvCache;
 use crate::config::Config;
-use crate::google_storage;
 use crate::util::shell_helpers::run_bash_command;
-
-static VERSION_TO_MILESTONE_CACHE: KvCache<String> = KvCache::new("version_cache");
+use crate::version_index;
+use crate::version_index::CrosVersion;
+use crate::version_index::Gsutil;
 
 // TODO #83 create an enum to represent board that can be converted to string
 // (adds some type safety)
 pub fn lookup_full_version(input: &str, board: &str) -> Result<String> {
+    resolve_full_version(input, |v| {
+        version_index::find_full_version(board, v, &Gsutil)
+    })
+}
+
+/// Same as lookup_full_version, for the callers without a target board.
+pub fn lookup_full_version_of_any_board(input: &str) -> Result<String> {
+    resolve_full_version(input, |v| {
+        version_index::find_full_version_of_any_board(v, &Gsutil)
+    })
+}
+
+fn resolve_full_version(
+    input: &str,
+    find: impl FnOnce(&str) -> Result<CrosVersion>,
+) -> Result<String> {
     let input = input.trim();
     let re_cros_version_without_milestone = regex!(r"^\d+\.\d+\.\d+$");
-    let re_cros_version = regex!(r"/(R\d+\-\d+\.\d+\.\d+)/");
     let re_full_cros_version = regex!(r"(R\d+\-\d+\.\d+\.\d+)");
     if let Some(captures) = re_full_cros_version.captures(input) {
         let captures = captures.get(1).context("No match found")?;
         Ok(captures.as_str().to_string())
     } else if re_cros_version_without_milestone.is_match(input) {
-        VERSION_TO_MILESTONE_CACHE.get_or_else(input, &|key| {
-            let output = google_storage::list_gs_files(&format!(
-                "gs://chromeos-image-archive/{}-release/R*-{}/chromiumos_test_image.tar.xz",
-                board, key
-            ))
-            .context(
-                "gsutil command failed (maybe you need depot_tools and/or `gsutil.py config` with \
-                 'chromeos-swarming' project)",
-            )?;
-            let output = re_cros_version
-                .captures(output.trim())
-                .context("Invalid gsutil output")?;
-            let output = output.get(1).context("No match found")?;
-            Ok(output.as_str().to_string())
-        })
+        Ok(find(input)?.to_string())
     } else {
         bail!("Invalid version format: {}", input)
     }
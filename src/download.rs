@@ -0,0 +1,579 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Downloads large files over HTTP(S) with parallel range requests.
+//!
+//! The file is split into ranges which are fetched by curl in parallel into
+//! part files next to the destination. Part files survive interruptions, so
+//! running the same download again only fetches the missing bytes. The parts
+//! are joined and verified with the checksum when all of them are complete.
+
+use std::ffi::OsString;
+use std::fs;
+use std::fs::File;
+use std::fs::OpenOptions;
+use std::io;
+use std::io::Write;
+use std::os::unix::fs::OpenOptionsExt;
+use std::path::Path;
+use std::path::PathBuf;
+use std::process::Command;
+use std::process::Stdio;
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+use std::thread;
+use std::time::Duration;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use base64::engine::general_purpose::STANDARD as BASE64;
+use base64::Engine;
+use indicatif::ProgressBar;
+use indicatif::ProgressStyle;
+use tracing::info;
+use tracing::warn;
+
+use crate::util::hash::sha256_file;
+use crate::util::hash::sha256_hex;
+
+/// Parts smaller than this are not worth a connection
+const MIN_PART_SIZE: u64 = 16 << 20;
+const MAX_RETRIES: usize = 5;
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Checksum {
+    /// Hex encoded sha256
+    Sha256(String),
+    /// Base64 encoded md5, as in the x-goog-hash header of Cloud Storage
+    Md5Base64(String),
+}
+
+/// Response headers needed to plan a download
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+struct RemoteFile {
+    size: Option<u64>,
+    accept_ranges: bool,
+    md5: Option<String>,
+    etag: Option<String>,
+}
+impl RemoteFile {
+    /// Parse the output of `curl -I`, which has a header block per redirect.
+    fn parse(headers: &str) -> Self {
+        let last = headers
+            .replace('\r', "")
+            .split("\n\n")
+            .filter(|b| !b.trim().is_empty())
+            .last()
+            .unwrap_or_default()
+            .to_string();
+        let mut file = Self::default();
+        for line in last.lines() {
+            let Some((key, value)) = line.split_once(':') else {
+                continue;
+            };
+            let value = value.trim();
+            match key.trim().to_ascii_lowercase().as_str() {
+                "content-length" => file.size = value.parse().ok(),
+                "accept-ranges" => file.accept_ranges = value == "bytes",
+                "etag" => file.etag = Some(value.to_string()),
+                "x-goog-hash" => {
+                    for hash in value.split(',') {
+                        if let Some(md5) = hash.trim().strip_prefix("md5=") {
+                            file.md5 = Some(md5.to_string());
+                        }
+                    }
+                }
+                _ => {}
+            }
+        }
+        file
+    }
+}
+
+/// Split `size` bytes into up to `streams` ranges (inclusive ends).
+fn split_ranges(size: u64, streams: usize) -> Vec<(u64, u64)> {
+    if size == 0 {
+        return Vec::new();
+    }
+    let n = (size / MIN_PART_SIZE).clamp(1, streams.max(1) as u64);
+    let part = size.div_ceil(n);
+    (0..n)
+        .map(|i| (i * part, ((i + 1) * part).min(size) - 1))
+        .filter(|(start, end)| start <= end)
+        .collect()
+}
+
+fn file_size(path: &Path) -> u64 {
+    fs::metadata(path).map(|m| m.len()).unwrap_or(0)
+}
+
+/// Request headers passed to curl in a file only readable by the user, so
+/// that secrets (e.g. access tokens) don't show up in the command lines of
+/// the processes. The file is removed when this is dropped.
+struct HeaderFile {
+    path: Option<PathBuf>,
+}
+impl HeaderFile {
+    fn create(headers: &[String], dest: &Path) -> Result<Self> {
+        if headers.is_empty() {
+            return Ok(Self { path: None });
+        }
+        let mut name = dest.file_name().unwrap_or_default().to_os_string();
+        name.push(format!(".headers.{}", std::process::id()));
+        let path = dest.with_file_name(name);
+        let _ = fs::remove_file(&path);
+        let mut file = OpenOptions::new()
+            .write(true)
+            .create_new(true)
+            .mode(0o600)
+            .open(&path)
+            .context(format!("Failed to create {path:?}"))?;
+        // Removes the file if writing fails
+        let header_file = Self { path: Some(path) };
+        for h in headers {
+            writeln!(file, "{h}")?;
+        }
+        Ok(header_file)
+    }
+}
+impl Drop for HeaderFile {
+    fn drop(&mut self) {
+        if let Some(path) = &self.path {
+            let _ = fs::remove_file(path);
+        }
+    }
+}
+
+/// Download is a download of a URL to a local file
+#[derive(Debug, Clone)]
+pub struct Download {
+    url: String,
+    headers: Vec<String>,
+    streams: usize,
+    bandwidth_limit: Option<u64>,
+    checksum: Option<Checksum>,
+}
+impl Download {
+    pub fn new(url: &str) -> Self {
+        Self {
+            url: url.to_string(),
+            headers: Vec::new(),
+            streams: 8,
+            bandwidth_limit: None,
+            checksum: None,
+        }
+    }
+    /// Add a request header (e.g. "Authorization: Bearer ...").
+    pub fn header(mut self, header: &str) -> Self {
+        self.headers.push(header.to_string());
+        self
+    }
+    /// Max number of parallel connections
+    pub fn streams(mut self, streams: usize) -> Self {
+        self.streams = streams.max(1);
+        self
+    }
+    /// Limit of the total bandwidth in bytes per second
+    pub fn bandwidth_limit(mut self, bytes_per_sec: Option<u64>) -> Self {
+        self.bandwidth_limit = bytes_per_sec;
+        self
+    }
+    /// Verify the downloaded file. If it is not set, the md5 in the response
+    /// headers is used if available.
+    pub fn checksum(mut self, checksum: Checksum) -> Self {
+        self.checksum = Some(checksum);
+        self
+    }
+    fn curl(&self, streams: usize, headers: &HeaderFile) -> Command {
+        let mut cmd = Command::new("curl");
+        cmd.args(["-fsSL", "--retry", "3"]);
+        if let Some(path) = &headers.path {
+            let mut arg = OsString::from("@");
+            arg.push(path);
+            cmd.arg("-H").arg(arg);
+        }
+        if let Some(limit) = self.bandwidth_limit {
+            cmd.arg("--limit-rate")
+                .arg((limit / streams as u64).max(1024).to_string());
+        }
+        cmd
+    }
+    fn remote_file(&self, headers: &HeaderFile) -> Result<RemoteFile> {
+        let output = self
+            .curl(1, headers)
+            .arg("-I")
+            .arg(&self.url)
+            .stderr(Stdio::inherit())
+            .output()
+            .context("Failed to run curl")?;
+        output
+            .status
+            .exit_ok()
+            .context(format!("Failed to get the headers of {}", self.url))?;
+        Ok(RemoteFile::parse(&String::from_utf8_lossy(&output.stdout)))
+    }
+    /// Returns the path of a part. Parts are named after the URL and the
+    /// version of the object, so that a different object of the same size
+    /// (e.g. a new build downloaded to the same path) is not resumed from
+    /// them.
+    fn part_path(&self, dest: &Path, remote: &RemoteFile, index: usize, count: usize) -> PathBuf {
+        let id = sha256_hex(
+            format!(
+                "{}\n{}\n{}",
+                self.url,
+                remote.etag.as_deref().unwrap_or_default(),
+                remote.md5.as_deref().unwrap_or_default()
+            )
+            .as_bytes(),
+        );
+        let size = remote.size.unwrap_or_default();
+        let mut name = dest.file_name().unwrap_or_default().to_os_string();
+        name.push(format!(".part-{}-{size}-{index}of{count}", &id[..16]));
+        dest.with_file_name(name)
+    }
+    /// Remove the parts of the previous downloads which can not be resumed.
+    fn remove_stale_parts(dest: &Path, keep: &[PathBuf]) -> Result<()> {
+        let Some(dir) = dest.parent() else {
+            return Ok(());
+        };
+        let prefix = format!(
+            "{}.part-",
+            dest.file_name().unwrap_or_default().to_string_lossy()
+        );
+        for e in fs::read_dir(dir)? {
+            let path = e?.path();
+            let name = path.file_name().unwrap_or_default().to_string_lossy();
+            if name.starts_with(&prefix) && !keep.contains(&path) {
+                fs::remove_file(&path)?;
+            }
+        }
+        Ok(())
+    }
+    /// Fetch the range into `part`, appending to the bytes fetched before.
+    fn fetch_part(
+        &self,
+        part: &Path,
+        (start, end): (u64, u64),
+        streams: usize,
+        headers: &HeaderFile,
+    ) -> Result<()> {
+        let len = end - start + 1;
+        for attempt in 0..MAX_RETRIES {
+            let have = file_size(part);
+            if have == len {
+                return Ok(());
+            }
+            if have > len {
+                // The server does not respect the range
+                fs::remove_file(part)?;
+                bail!("Server returned more than the requested range");
+            }
+            let out = OpenOptions::new().create(true).append(true).open(part)?;
+            let status = self
+                .curl(streams, headers)
+                .arg("--range")
+                .arg(format!("{}-{end}", start + have))
+                .arg(&self.url)
+                .stdout(out)
+                .status()
+                .context("Failed to run curl")?;
+            if status.success() && file_size(part) == len {
+                return Ok(());
+            }
+            // Including the connections closed early without an error
+            warn!(
+                "Fetching bytes {}-{end} failed ({status}, {} bytes fetched), retrying \
+                 ({}/{MAX_RETRIES})",
+                start + have,
+                file_size(part).saturating_sub(have),
+                attempt + 1
+            );
+            thread::sleep(Duration::from_secs(1 << attempt));
+        }
+        if file_size(part) == len {
+            Ok(())
+        } else {
+            bail!("Failed to fetch bytes {start}-{end} of {}", self.url)
+        }
+    }
+    /// Download the URL to `dest`. Parts left by an interrupted download of
+    /// the same file are resumed.
+    pub fn to_file(&self, dest: &Path) -> Result<()> {
+        let headers = HeaderFile::create(&self.headers, dest)?;
+        let remote = self.remote_file(&headers)?;
+        let checksum = self
+            .checksum
+            .clone()
+            .or(remote.md5.clone().map(Checksum::Md5Base64));
+        let tmp = {
+            let mut name = dest.file_name().unwrap_or_default().to_os_string();
+            name.push(".tmp");
+            dest.with_file_name(name)
+        };
+        match remote.size {
+            Some(size) if remote.accept_ranges => {
+                let ranges = split_ranges(size, self.streams);
+                let parts: Vec<PathBuf> = (0..ranges.len())
+                    .map(|i| self.part_path(dest, &remote, i, ranges.len()))
+                    .collect();
+                Self::remove_stale_parts(dest, &parts)?;
+                let resumed: u64 = parts.iter().map(|p| file_size(p)).sum();
+                if resumed > 0 {
+                    info!("Resuming {} from {} MiB", self.url, resumed >> 20);
+                }
+                self.fetch_parts(size, &ranges, &parts, &headers)?;
+                let mut out = File::create(&tmp)?;
+                for part in &parts {
+                    io::copy(&mut File::open(part)?, &mut out)?;
+                }
+                out.sync_all()?;
+                for part in &parts {
+                    fs::remove_file(part)?;
+                }
+            }
+            _ => {
+                // No way to resume nor parallelize
+                self.curl(1, &headers)
+                    .arg("-o")
+                    .arg(&tmp)
+                    .arg(&self.url)
+                    .status()
+                    .context("Failed to run curl")?
+                    .exit_ok()
+                    .context(format!("Failed to download {}", self.url))?;
+            }
+        }
+        if let Some(checksum) = &checksum {
+            if let Err(e) = verify(&tmp, checksum) {
+                fs::remove_file(&tmp)?;
+                return Err(e);
+            }
+        }
+        fs::rename(&tmp, dest)?;
+        Ok(())
+    }
+    fn fetch_parts(
+        &self,
+        size: u64,
+        ranges: &[(u64, u64)],
+        parts: &[PathBuf],
+        headers: &HeaderFile,
+    ) -> Result<()> {
+        let bar = ProgressBar::new(size);
+        bar.set_style(ProgressStyle::with_template(
+            "{wide_bar} {bytes}/{total_bytes} ({bytes_per_sec}, {eta})",
+        )?);
+        let done = AtomicBool::new(false);
+        let results: Vec<Result<()>> = thread::scope(|s| {
+            s.spawn(|| {
+                while !done.load(Ordering::Relaxed) {
+                    bar.set_position(parts.iter().map(|p| file_size(p)).sum());
+                    thread::sleep(Duration::from_millis(200));
+                }
+            });
+            let handles: Vec<_> = ranges
+                .iter()
+                .zip(parts)
+                .map(|(range, part)| {
+                    s.spawn(|| self.fetch_part(part, *range, ranges.len(), headers))
+                })
+                .collect();
+            let results = handles
+                .into_iter()
+                .map(|h| h.join().map_err(|_| anyhow!("Download thread panicked"))?)
+                .collect();
+            done.store(true, Ordering::Relaxed);
+            results
+        });
+        bar.finish_and_clear();
+        results.into_iter().collect()
+    }
+}
+
+/// Check the checksum of a file.
+pub fn verify(path: &Path, checksum: &Checksum) -> Result<()> {
+    let (expected, actual) = match checksum {
+        Checksum::Sha256(expected) => (expected.clone(), sha256_file(path)?),
+        Checksum::Md5Base64(expected) => {
+            let expected: String = BASE64
+                .decode(expected)
+                .context("Invalid md5")?
+                .iter()
+                .map(|b| format!("{b:02x}"))
+                .collect();
+            let output = Command::new("md5sum")
+                .arg(path)
+                .output()
+                .context("Failed to run md5sum")?;
+            output.status.exit_ok().context("md5sum failed")?;
+            let actual = String::from_utf8_lossy(&output.stdout)
+                .split_whitespace()
+                .next()
+                .unwrap_or_default()
+                .to_string();
+            (expected, actual)
+        }
+    };
+    if expected != actual {
+        bail!("Checksum mismatch of {path:?}: expected {expected}, got {actual}");
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::BufRead;
+    use std::io::BufReader;
+    use std::net::TcpListener;
+    use std::os::unix::fs::PermissionsExt;
+    use std::sync::Arc;
+
+    use tempdir::TempDir;
+
+    use super::*;
+
+    /// Serve `data` with range support, like a Cloud Storage endpoint.
+    fn serve(data: Arc<Vec<u8>>) -> String {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = listener.local_addr().unwrap();
+        thread::spawn(move || {
+            for stream in listener.incoming() {
+                let data = data.clone();
+                thread::spawn(move || {
+                    let mut stream = stream.unwrap();
+                    let mut reader = BufReader::new(stream.try_clone().unwrap());
+                    let mut request = String::new();
+                    let mut range = None;
+                    loop {
+                        let mut line = String::new();
+                        if reader.read_line(&mut line).unwrap() == 0 || line == "\r\n" {
+                            break;
+                        }
+                        if request.is_empty() {
+                            request = line.clone();
+                        }
+                        if let Some(r) = line.strip_prefix("Range: bytes=") {
+                            let (a, b) = r.trim().split_once('-').unwrap();
+                            range =
+                                Some((a.parse::<usize>().unwrap(), b.parse::<usize>().unwrap()));
+                        }
+                    }
+                    let (status, body) = match range {
+                        Some((a, b)) => ("206 Partial Content", &data[a..=b]),
+                        None => ("200 OK", &data[..]),
+                    };
+                    let _ = write!(
+                        stream,
+                        "HTTP/1.1 {status}\r\nContent-Length: {}\r\nAccept-Ranges: \
+                         bytes\r\nConnection: close\r\n\r\n",
+                        body.len()
+                    );
+                    if !request.starts_with("HEAD") {
+                        let _ = stream.write_all(body);
+                    }
+                });
+            }
+        });
+        format!("http://{addr}/image.bin")
+    }
+
+    #[test]
+    fn ranged_download() {
+        let data: Vec<u8> = (0..(MIN_PART_SIZE * 3 + 123))
+            .map(|i| (i % 253) as u8)
+            .collect();
+        let sha256 = sha256_hex(&data);
+        let url = serve(Arc::new(data.clone()));
+        let dir = TempDir::new("cro3_download_test").unwrap();
+        let dest = dir.path().join("image.bin");
+
+        // A part left by an interrupted download is resumed
+        let ranges = split_ranges(data.len() as u64, 8);
+        assert_eq!(ranges.len(), 3);
+        let remote = RemoteFile {
+            size: Some(data.len() as u64),
+            accept_ranges: true,
+            ..Default::default()
+        };
+        let part = Download::new(&url).part_path(&dest, &remote, 1, 3);
+        fs::write(&part, &data[ranges[1].0 as usize..][..1000]).unwrap();
+        // Another object of the same size is not resumed
+        let other = RemoteFile {
+            etag: Some("\"old\"".to_string()),
+            ..remote.clone()
+        };
+        let stale = Download::new(&url).part_path(&dest, &other, 1, 3);
+        assert_ne!(part, stale);
+        fs::write(&stale, "stale").unwrap();
+
+        Download::new(&url)
+            .checksum(Checksum::Sha256(sha256.clone()))
+            .to_file(&dest)
+            .unwrap();
+        assert_eq!(fs::read(&dest).unwrap(), data);
+        assert!(!part.exists());
+        assert!(!stale.exists());
+
+        let broken = dir.path().join("broken.bin");
+        assert!(Download::new(&url)
+            .checksum(Checksum::Sha256("00".to_string()))
+            .to_file(&broken)
+            .is_err());
+        assert!(!broken.exists());
+    }
+
+    #[test]
+    fn headers() {
+        let file = RemoteFile::parse(
+            "HTTP/1.1 302 Found\r\nLocation: x\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: \
+             100\r\nAccept-Ranges: bytes\r\nETag: \"abc\"\r\nx-goog-hash: \
+             crc32c=AAAAAA==\r\nx-goog-hash: md5=1B2M2Y8AsgTpgAmY7PhCfg==\r\n\r\n",
+        );
+        assert_eq!(
+            file,
+            RemoteFile {
+                size: Some(100),
+                accept_ranges: true,
+                md5: Some("1B2M2Y8AsgTpgAmY7PhCfg==".to_string()),
+                etag: Some("\"abc\"".to_string()),
+            }
+        );
+        let dir = TempDir::new("cro3_download_test").unwrap();
+        let empty = dir.path().join("empty");
+        fs::write(&empty, "").unwrap();
+        verify(
+            &empty,
+            &Checksum::Md5Base64("1B2M2Y8AsgTpgAmY7PhCfg==".to_string()),
+        )
+        .unwrap();
+        assert_eq!(split_ranges(10, 8), vec![(0, 9)]);
+    }
+
+    #[test]
+    fn secret_headers() {
+        let dir = TempDir::new("cro3_download_test").unwrap();
+        let download = Download::new("https://example.com/image.bin")
+            .header("Authorization: Bearer secret-token");
+        let headers = HeaderFile::create(&download.headers, &dir.path().join("image.bin")).unwrap();
+        let path = headers.path.clone().unwrap();
+        assert_eq!(
+            fs::metadata(&path).unwrap().permissions().mode() & 0o777,
+            0o600
+        );
+        assert_eq!(
+            fs::read_to_string(&path).unwrap(),
+            "Authorization: Bearer secret-token\n"
+        );
+        let cmd = download.curl(1, &headers);
+        assert!(cmd
+            .get_args()
+            .all(|a| !a.to_string_lossy().contains("secret-token")));
+        drop(headers);
+        assert!(!path.exists());
+    }
+}
@@ -936,10 +936,100 @@ pub fn register_dut(dut: &str) -> Result<DutInfo> {
     Ok(info)
 }
 
+/// Returns true if `name` matches `pattern`, which may contain `*` (any
+/// string) and `?` (any character).
+fn glob_match(pattern: &str, name: &str) -> bool {
+    let pattern: Vec<char> = pattern.chars().collect();
+    let name: Vec<char> = name.chars().collect();
+    // (position in pattern, position in name) to retry from for the last `*`
+    let mut retry = None;
+    let (mut p, mut n) = (0, 0);
+    while n < name.len() {
+        match pattern.get(p) {
+            Some('*') => {
+                retry = Some((p, n));
+                p += 1;
+            }
+            Some(c) if *c == '?' || *c == name[n] => {
+                p += 1;
+                n += 1;
+            }
+            _ => match retry {
+                Some((rp, rn)) => {
+                    retry = Some((rp, rn + 1));
+                    p = rp + 1;
+                    n = rn + 1;
+                }
+                None => return false,
+            },
+        }
+    }
+    pattern[p..].iter().all(|c| *c == '*')
+}
+
+fn expand_duts(spec: &str, known: &[String]) -> Result<Vec<String>> {
+    let mut duts: Vec<String> = Vec::new();
+    for item in spec.split(',').map(str::trim).filter(|s| !s.is_empty()) {
+        let matched: Vec<String> = if item.contains(['*', '?']) {
+            known
+                .iter()
+                .filter(|k| glob_match(item, k))
+                .cloned()
+                .collect()
+        } else {
+            vec![item.to_string()]
+        };
+        if matched.is_empty() {
+            bail!("No DUT matched with {item:?}. Registered DUTs: {known:?}");
+        }
+        for dut in matched {
+            if !duts.contains(&dut) {
+                duts.push(dut);
+            }
+        }
+    }
+    if duts.is_empty() {
+        bail!("No DUTs are specified");
+    }
+    Ok(duts)
+}
+
+/// Expand a comma separated list of DUTs. Each item is a DUT identifier or
+/// a glob pattern (e.g. "brya_*") matched with the IDs of the DUTs added by
+/// `cro3 dut list --add`.
+pub fn resolve_duts(spec: &str) -> Result<Vec<String>> {
+    let mut known: Vec<String> = SSH_CACHE
+        .entries()
+        .context(anyhow!("SSH_CACHE is not initialized yet"))?
+        .keys()
+        .map(|s| s.to_string())
+        .collect();
+    known.sort();
+    expand_duts(spec, &known)
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
     #[test]
+    fn duts() {
+        assert!(glob_match("brya_*", "brya_ABC123"));
+        assert!(glob_match("*_A?C*", "brya_ABC123"));
+        assert!(!glob_match("brya_*", "volteer_XYZ"));
+        assert!(glob_match("*", ""));
+        let known = vec![
+            "brya_A".to_string(),
+            "brya_B".to_string(),
+            "volteer_C".to_string(),
+        ];
+        assert_eq!(
+            expand_duts("brya_*, 192.168.0.2:22,brya_A", &known).unwrap(),
+            vec!["brya_A", "brya_B", "192.168.0.2:22"]
+        );
+        assert!(expand_duts("trogdor_*", &known).is_err());
+        assert!(expand_duts(" , ", &known).is_err());
+    }
+    #[test]
     fn regex() {
         // bracketed ipv6 address is prohibited as an internal representation
         assert!(!RE_DUT_HOST_NAME.is_match("[fe00::]"));
@@ -0,0 +1,542 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Collects per-package timings from the output of emerge, parallel_emerge
+//! (used by build_packages) and the steps of cro3 build scripts, and reports
+//! where the time of a build was spent.
+
+use std::fmt::Write;
+use std::path::PathBuf;
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::Result;
+use once_cell::sync::Lazy;
+use regex_macro::regex;
+use regex_macro::Regex;
+
+use crate::trace_event::TraceWriter;
+
+// Output of parallel_emerge
+static RE_PARALLEL_STARTED: Lazy<&Regex> = Lazy::new(|| regex!(r"\bStarted (\S+) \(logged in "));
+static RE_PARALLEL_COMPLETED: Lazy<&Regex> = Lazy::new(|| regex!(r"\bCompleted (\S+) \(in "));
+static RE_PARALLEL_FAILED: Lazy<&Regex> = Lazy::new(|| regex!(r"\bFailed (\S+) \(in "));
+// Output of emerge
+static RE_EMERGE_PHASE: Lazy<&Regex> = Lazy::new(|| {
+    regex!(r">>> (Emerging|Emerging binary|Installing|Completed) \(\d+ of \d+\) ([^\s:]+)")
+});
+static RE_EMERGE_FAILED: Lazy<&Regex> = Lazy::new(|| regex!(r">>> Failed to emerge ([^\s:,]+)"));
+// Markers printed by cro3 build scripts. Since the scripts are run with
+// `bash -x`, this is anchored to ignore the trace of the echo command itself.
+static RE_STEP: Lazy<&Regex> = Lazy::new(|| regex!(r"^(?:\[\S+\] )?>>> cro3 step: (\S+)$"));
+// Version part of a CPV (e.g. "-0.0.1-r123", "-2.76.4_rc1", "-9999")
+static RE_VERSION_SUFFIX: Lazy<&Regex> =
+    Lazy::new(|| regex!(r"-\d+(\.\d+)*[a-z]?(_(alpha|beta|pre|rc|p)\d*)*(-r\d+)?$"));
+
+/// Returns a line that makes the build step boundary visible to
+/// BuildTelemetry. Put this in build scripts before each step.
+pub fn step_marker(step: &str) -> String {
+    format!("echo '>>> cro3 step: {step}'")
+}
+
+/// Returns the package name of a CPV (e.g. "chromeos-base/shill-0.0.1-r1"
+/// -> "chromeos-base/shill").
+pub fn package_name(cpv: &str) -> &str {
+    match RE_VERSION_SUFFIX.find(cpv) {
+        Some(m) => &cpv[..m.start()],
+        None => cpv,
+    }
+}
+
+/// Returns true if `atom` given by users (e.g. "shill" or
+/// "chromeos-base/shill") refers to the package of the CPV.
+pub fn atom_matches(atom: &str, cpv: &str) -> bool {
+    let name = package_name(cpv);
+    name == atom || name.rsplit('/').next() == Some(atom)
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum EmergeEvent {
+    /// A package started building (or merging a binary package)
+    Started {
+        package: String,
+        phase: String,
+    },
+    /// A package entered another phase (e.g. install)
+    Phase {
+        package: String,
+        phase: String,
+    },
+    Completed {
+        package: String,
+    },
+    Failed {
+        package: String,
+    },
+    /// A step of the build script (e.g. build_image) started
+    Step {
+        name: String,
+    },
+}
+
+pub fn parse_line(line: &str) -> Option<EmergeEvent> {
+    let line = String::from_utf8_lossy(&strip_ansi_escapes::strip(line)).to_string();
+    let line = line.trim_end();
+    if let Some(c) = RE_STEP.captures(line) {
+        return Some(EmergeEvent::Step {
+            name: c[1].to_string(),
+        });
+    }
+    if let Some(c) = RE_PARALLEL_STARTED.captures(line) {
+        return Some(EmergeEvent::Started {
+            package: c[1].to_string(),
+            phase: "build".to_string(),
+        });
+    }
+    if let Some(c) = RE_PARALLEL_COMPLETED.captures(line) {
+        return Some(EmergeEvent::Completed {
+            package: c[1].to_string(),
+        });
+    }
+    if let Some(c) = RE_PARALLEL_FAILED
+        .captures(line)
+        .or_else(|| RE_EMERGE_FAILED.captures(line))
+    {
+        return Some(EmergeEvent::Failed {
+            package: c[1].to_string(),
+        });
+    }
+    let c = RE_EMERGE_PHASE.captures(line)?;
+    let package = c[2].to_string();
+    Some(match &c[1] {
+        "Emerging" => EmergeEvent::Started {
+            package,
+            phase: "build".to_string(),
+        },
+        "Emerging binary" => EmergeEvent::Started {
+            package,
+            phase: "binary".to_string(),
+        },
+        "Installing" => EmergeEvent::Phase {
+            package,
+            phase: "install".to_string(),
+        },
+        _ => EmergeEvent::Completed { package },
+    })
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PackageRecord {
+    name: String,
+    start: Duration,
+    end: Option<Duration>,
+    /// Phases and their start times
+    phases: Vec<(String, Duration)>,
+    failed: bool,
+}
+impl PackageRecord {
+    pub fn name(&self) -> &str {
+        &self.name
+    }
+    fn end(&self) -> Duration {
+        self.end.unwrap_or(self.start)
+    }
+    pub fn duration(&self) -> Duration {
+        self.end() - self.start
+    }
+    /// Returns the phases and their durations
+    pub fn phases(&self) -> Vec<(&str, Duration)> {
+        self.phases
+            .iter()
+            .enumerate()
+            .map(|(i, (phase, start))| {
+                let end = self.phases.get(i + 1).map(|p| p.1).unwrap_or(self.end());
+                (phase.as_str(), end.saturating_sub(*start))
+            })
+            .collect()
+    }
+}
+
+/// BuildTelemetry records the events parsed from the output of a build.
+#[derive(Debug, Clone)]
+pub struct BuildTelemetry {
+    started: Instant,
+    packages: Vec<PackageRecord>,
+    steps: Vec<(String, Duration, Option<Duration>)>,
+}
+impl Default for BuildTelemetry {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+impl BuildTelemetry {
+    pub fn new() -> Self {
+        Self {
+            started: Instant::now(),
+            packages: Vec::new(),
+            steps: Vec::new(),
+        }
+    }
+    /// Handle a line of the build output, which is printed just now.
+    pub fn handle_line(&mut self, line: &str) {
+        let at = self.started.elapsed();
+        self.handle_line_at(line, at);
+    }
+    fn handle_line_at(&mut self, line: &str, at: Duration) {
+        let Some(event) = parse_line(line) else {
+            return;
+        };
+        match event {
+            EmergeEvent::Step { name } => {
+                self.end_step(at);
+                self.steps.push((name, at, None));
+            }
+            EmergeEvent::Started { package, phase } => {
+                // A package can be retried by parallel_emerge. Only the last
+                // attempt is recorded in that case.
+                self.packages
+                    .retain(|p| p.name != package || p.end.is_some());
+                self.packages.push(PackageRecord {
+                    name: package,
+                    start: at,
+                    end: None,
+                    phases: vec![(phase, at)],
+                    failed: false,
+                });
+            }
+            EmergeEvent::Phase { package, phase } => {
+                if let Some(p) = self.running_mut(&package) {
+                    p.phases.push((phase, at));
+                }
+            }
+            EmergeEvent::Completed { package } => {
+                if let Some(p) = self.running_mut(&package) {
+                    p.end = Some(at);
+                }
+            }
+            EmergeEvent::Failed { package } => {
+                if let Some(p) = self.running_mut(&package) {
+                    p.end = Some(at);
+                    p.failed = true;
+                }
+            }
+        }
+    }
+    fn running_mut(&mut self, package: &str) -> Option<&mut PackageRecord> {
+        self.packages
+            .iter_mut()
+            .rev()
+            .find(|p| p.name == package && p.end.is_none())
+    }
+    fn end_step(&mut self, at: Duration) {
+        if let Some(step) = self.steps.last_mut() {
+            step.2.get_or_insert(at);
+        }
+    }
+    /// Mark the end of the build. Packages which are still running (e.g.
+    /// killed by a failure of another package) are closed at this point.
+    pub fn finish(&mut self) {
+        let at = self.started.elapsed();
+        self.finish_at(at);
+    }
+    fn finish_at(&mut self, at: Duration) {
+        self.end_step(at);
+        for p in self.packages.iter_mut().filter(|p| p.end.is_none()) {
+            p.end = Some(at);
+        }
+    }
+    pub fn packages(&self) -> &[PackageRecord] {
+        &self.packages
+    }
+    /// Returns (average, max) number of packages built at the same time while
+    /// any package was being built.
+    pub fn parallelism(&self) -> (f64, usize) {
+        let (Some(first), Some(last)) = (
+            self.packages.iter().map(|p| p.start).min(),
+            self.packages.iter().map(|p| p.end()).max(),
+        ) else {
+            return (0.0, 0);
+        };
+        let busy: Duration = self.packages.iter().map(|p| p.duration()).sum();
+        let span = (last - first).as_secs_f64();
+        let avg = if span > 0.0 {
+            busy.as_secs_f64() / span
+        } else {
+            self.packages.len() as f64
+        };
+        let max = self
+            .concurrency_changes()
+            .iter()
+            .map(|(_, running)| *running)
+            .max()
+            .unwrap_or(0);
+        (avg, max)
+    }
+    /// Returns the number of running packages after each point in time it
+    /// changed.
+    fn concurrency_changes(&self) -> Vec<(Duration, usize)> {
+        let mut edges: Vec<(Duration, bool)> = self
+            .packages
+            .iter()
+            .flat_map(|p| [(p.start, true), (p.end(), false)])
+            .collect();
+        // Process ends before starts at the same time to avoid overcounting
+        edges.sort();
+        let mut running = 0usize;
+        let mut changes: Vec<(Duration, usize)> = Vec::new();
+        for (at, is_start) in edges {
+            if is_start {
+                running += 1;
+            } else {
+                running = running.saturating_sub(1);
+            }
+            match changes.last_mut() {
+                Some(last) if last.0 == at => last.1 = running,
+                _ => changes.push((at, running)),
+            }
+        }
+        changes
+    }
+    /// Estimate the critical path of the build. Since the dependency graph is
+    /// not visible from the output, this follows the package that finished
+    /// last, then the package that finished last before it started (which is
+    /// most likely what it was waiting for), and so on. Each step goes to a
+    /// package which started strictly earlier, so zero-length records can't
+    /// make it loop.
+    pub fn critical_path(&self) -> Vec<&PackageRecord> {
+        let mut path = Vec::new();
+        let mut current = self.packages.iter().max_by_key(|p| p.end());
+        while let Some(p) = current {
+            path.push(p);
+            current = self
+                .packages
+                .iter()
+                .filter(|q| q.end.is_some() && q.end() <= p.start && q.start < p.start)
+                .max_by_key(|q| q.end());
+        }
+        path.reverse();
+        path
+    }
+    /// Returns a human readable summary of the build. `jobs` is the number of
+    /// packages allowed to be built in parallel, if known.
+    pub fn report(&self, jobs: Option<usize>) -> String {
+        let mut r = String::new();
+        let wall = self.started.elapsed();
+        let _ = writeln!(r, "Build telemetry ({:.0?} in total):", wall);
+        if !self.steps.is_empty() {
+            let _ = writeln!(r, "  Steps:");
+            for (name, start, end) in &self.steps {
+                let end = end.unwrap_or(wall);
+                let _ = writeln!(r, "    {:>9.1?} {name}", end.saturating_sub(*start));
+            }
+        }
+        let failed: Vec<&str> = self
+            .packages
+            .iter()
+            .filter(|p| p.failed)
+            .map(|p| p.name())
+            .collect();
+        let _ = writeln!(
+            r,
+            "  Packages: {} built, {} failed {:?}",
+            self.packages.len() - failed.len(),
+            failed.len(),
+            failed
+        );
+        let mut slowest: Vec<&PackageRecord> = self.packages.iter().collect();
+        slowest.sort_by_key(|p| std::cmp::Reverse(p.duration()));
+        let _ = writeln!(r, "  Slowest packages:");
+        for p in slowest.iter().take(10) {
+            let phases = p
+                .phases()
+                .iter()
+                .map(|(phase, d)| format!("{phase} {d:.1?}"))
+                .collect::<Vec<_>>()
+                .join(", ");
+            let _ = writeln!(r, "    {:>9.1?} {} ({phases})", p.duration(), p.name());
+        }
+        let path = self.critical_path();
+        if let (Some(first), Some(last)) = (path.first(), path.last()) {
+            let _ = writeln!(
+                r,
+                "  Critical path (estimated, {:.1?}):",
+                last.end() - first.start
+            );
+            for p in &path {
+                let _ = writeln!(r, "    {:>9.1?} {}", p.duration(), p.name());
+            }
+        }
+        let (avg, max) = self.parallelism();
+        let _ = write!(r, "  Parallelism: {avg:.2} on average, {max} at most");
+        if let Some(jobs) = jobs {
+            let _ = write!(
+                r,
+                " ({:.0}% of {jobs} jobs)",
+                avg * 100.0 / jobs.max(1) as f64
+            );
+        }
+        r
+    }
+    pub fn trace(&self) -> TraceWriter {
+        let mut trace = TraceWriter::new();
+        trace.lane_name(0, "steps");
+        for (name, start, end) in &self.steps {
+            let end = end.unwrap_or(*start);
+            trace.span(name, "step", 0, *start, end.saturating_sub(*start));
+        }
+        // Assign packages to lanes so that they do not overlap in a lane
+        let mut lane_ends: Vec<Duration> = Vec::new();
+        let mut packages: Vec<&PackageRecord> = self.packages.iter().collect();
+        packages.sort_by_key(|p| p.start);
+        for p in packages {
+            let lane = match lane_ends.iter().position(|end| *end <= p.start) {
+                Some(i) => i,
+                None => {
+                    lane_ends.push(Duration::ZERO);
+                    trace.lane_name(lane_ends.len(), &format!("job {}", lane_ends.len()));
+                    lane_ends.len() - 1
+                }
+            };
+            lane_ends[lane] = p.end();
+            let category = if p.failed { "failed" } else { "package" };
+            trace.span(p.name(), category, lane + 1, p.start, p.duration());
+            for ((phase, duration), (_, start)) in p.phases().iter().zip(&p.phases) {
+                trace.span(phase, "phase", lane + 1, *start, *duration);
+            }
+        }
+        for (at, running) in self.concurrency_changes() {
+            trace.counter("running packages", at, running);
+        }
+        trace
+    }
+    /// Save the trace to ~/.cro3/build_traces/ and return the path of it.
+    pub fn save_trace(&self, name: &str) -> Result<PathBuf> {
+        self.trace().save("build_traces", name)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn secs(s: u64) -> Duration {
+        Duration::from_secs(s)
+    }
+
+    #[test]
+    fn parse() {
+        assert_eq!(
+            parse_line("Started chromeos-base/shill-0.0.1-r1 (logged in /tmp/shill-abc)"),
+            Some(EmergeEvent::Started {
+                package: "chromeos-base/shill-0.0.1-r1".to_string(),
+                phase: "build".to_string()
+            })
+        );
+        assert_eq!(
+            parse_line("[brya] Completed chromeos-base/shill-0.0.1-r1 (in 1m2.3s)"),
+            Some(EmergeEvent::Completed {
+                package: "chromeos-base/shill-0.0.1-r1".to_string()
+            })
+        );
+        assert_eq!(
+            parse_line(">>> Emerging binary (2 of 5) dev-libs/glib-2.76.4::portage-stable"),
+            Some(EmergeEvent::Started {
+                package: "dev-libs/glib-2.76.4".to_string(),
+                phase: "binary".to_string()
+            })
+        );
+        assert_eq!(
+            parse_line(
+                "\x1b[32m>>> Installing\x1b[0m (1 of 1) sys-apps/dbus-1.14.10::portage-stable"
+            ),
+            Some(EmergeEvent::Phase {
+                package: "sys-apps/dbus-1.14.10".to_string(),
+                phase: "install".to_string()
+            })
+        );
+        assert_eq!(
+            parse_line(">>> Failed to emerge sys-apps/dbus-1.14.10, Log file:"),
+            Some(EmergeEvent::Failed {
+                package: "sys-apps/dbus-1.14.10".to_string()
+            })
+        );
+        assert_eq!(
+            parse_line("[brya] >>> cro3 step: build_image"),
+            Some(EmergeEvent::Step {
+                name: "build_image".to_string()
+            })
+        );
+        assert_eq!(parse_line("+ echo '>>> cro3 step: build_image'"), None);
+        assert_eq!(parse_line("Pending 3/10, Running 2/10"), None);
+    }
+
+    #[test]
+    fn package_names() {
+        assert_eq!(
+            package_name("chromeos-base/shill-0.0.1-r1"),
+            "chromeos-base/shill"
+        );
+        assert_eq!(package_name("dev-libs/glib-2.76.4_rc1"), "dev-libs/glib");
+        assert_eq!(
+            package_name("sys-kernel/chromeos-kernel-5_15-9999"),
+            "sys-kernel/chromeos-kernel-5_15"
+        );
+        assert!(atom_matches("shill", "chromeos-base/shill-0.0.1-r1"));
+        assert!(atom_matches(
+            "chromeos-base/shill",
+            "chromeos-base/shill-0.0.1-r1"
+        ));
+        assert!(!atom_matches("shill", "chromeos-base/shill-test-0.0.1-r1"));
+    }
+
+    #[test]
+    fn timings() {
+        let mut t = BuildTelemetry::new();
+        t.handle_line_at(">>> cro3 step: build_packages", secs(0));
+        t.handle_line_at(">>> Emerging (1 of 3) a/base-1::gentoo", secs(0));
+        t.handle_line_at(">>> Installing (1 of 3) a/base-1::gentoo", secs(8));
+        t.handle_line_at(">>> Completed (1 of 3) a/base-1::gentoo", secs(10));
+        t.handle_line_at(">>> Emerging (2 of 3) a/lib-1::gentoo", secs(10));
+        t.handle_line_at(">>> Emerging (3 of 3) a/tool-1::gentoo", secs(11));
+        t.handle_line_at(">>> Completed (3 of 3) a/tool-1::gentoo", secs(13));
+        t.handle_line_at(">>> Completed (2 of 3) a/lib-1::gentoo", secs(30));
+        t.handle_line_at(">>> cro3 step: build_image", secs(30));
+        t.finish_at(secs(40));
+
+        let base = &t.packages()[0];
+        assert_eq!(base.duration(), secs(10));
+        assert_eq!(
+            base.phases(),
+            vec![("build", secs(8)), ("install", secs(2))]
+        );
+
+        let path: Vec<&str> = t.critical_path().iter().map(|p| p.name()).collect();
+        assert_eq!(path, vec!["a/base-1", "a/lib-1"]);
+
+        // Packages which complete as soon as they start (e.g. binpkgs)
+        let mut z = BuildTelemetry::new();
+        z.handle_line_at(">>> Emerging (1 of 2) a/first-1::gentoo", secs(5));
+        z.handle_line_at(">>> Completed (1 of 2) a/first-1::gentoo", secs(5));
+        z.handle_line_at(">>> Emerging (2 of 2) a/second-1::gentoo", secs(5));
+        z.handle_line_at(">>> Completed (2 of 2) a/second-1::gentoo", secs(5));
+        assert_eq!(z.critical_path().len(), 1);
+
+        let (avg, max) = t.parallelism();
+        assert_eq!(max, 2);
+        assert!((avg - 32.0 / 30.0).abs() < 1e-9);
+
+        let trace = t.trace().to_json();
+        let spans = trace["traceEvents"]
+            .as_array()
+            .unwrap()
+            .iter()
+            .filter(|e| e["cat"] == "package")
+            .map(|e| e["tid"].as_u64().unwrap())
+            .collect::<Vec<_>>();
+        assert_eq!(spans, vec![1, 1, 2]);
+        assert!(t.report(Some(4)).contains("Critical path"));
+    }
+}
@@ -0,0 +1,396 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Collects the phases of flashing a DUT (download, partition updates,
+//! reboot, ...) from the log of `cros flash` or from cro3 itself, and keeps
+//! the history of flashes per DUT so that slow DUTs and regressions in the
+//! provisioning time can be spotted.
+
+use std::fmt::Write;
+use std::path::PathBuf;
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::Result;
+use chrono::Local;
+use indicatif::ProgressBar;
+use once_cell::sync::Lazy;
+use regex_macro::regex;
+use regex_macro::Regex;
+use serde::Deserialize;
+use serde::Serialize;
+
+use crate::cache::KvCache;
+use crate::trace_event::TraceWriter;
+
+static FLASH_HISTORY: KvCache<Vec<FlashRecord>> = KvCache::new("flash_history");
+/// Number of flashes kept per DUT
+const HISTORY_LEN: usize = 50;
+
+// Log lines of chromite (e.g. "10:20:30.123: INFO: Updating rootfs"). Debug
+// lines are full of commands which mention every phase, so only the messages
+// of INFO and above are used to detect the phases.
+static RE_CHROMITE_LOG: Lazy<&Regex> =
+    Lazy::new(|| regex!(r"^(?:\d+:\d+:\d+(?:\.\d+)?: )?(INFO|NOTICE|WARNING|ERROR|DEBUG): (.*)$"));
+// Output of dd and similar tools (e.g. "2147483648 bytes (2.1 GB, 2.0 GiB)
+// copied, 21 s, 102 MB/s"). The count is cumulative.
+static RE_BYTES: Lazy<&Regex> = Lazy::new(|| regex!(r"\b(\d+) bytes\b"));
+/// Phases and the patterns of the messages which start them. Checked in
+/// order.
+static PHASES: Lazy<Vec<(&'static str, &Regex)>> = Lazy::new(|| {
+    vec![
+        (
+            "download",
+            regex!(r"(?i)\b(downloading|fetching|staging)\b"),
+        ),
+        ("decompress", regex!(r"(?i)\b(decompress|extract|unpack)")),
+        ("kernel", regex!(r"(?i)\bkernel\b")),
+        ("rootfs", regex!(r"(?i)\b(rootfs|root partition)\b")),
+        ("minios", regex!(r"(?i)\bminios\b")),
+        ("stateful", regex!(r"(?i)\bstateful\b")),
+        ("postinst", regex!(r"(?i)\b(postinst|post-install)")),
+        ("reboot", regex!(r"(?i)\breboot")),
+        ("verify", regex!(r"(?i)\bverif(y|ying|ication)\b")),
+    ]
+});
+
+/// Returns the phase started by the line of `cros flash -vvv`, if any.
+pub fn parse_phase(line: &str) -> Option<&'static str> {
+    let line = String::from_utf8_lossy(&strip_ansi_escapes::strip(line)).to_string();
+    let c = RE_CHROMITE_LOG.captures(line.trim())?;
+    if &c[1] == "DEBUG" {
+        return None;
+    }
+    PHASES
+        .iter()
+        .find(|(_, re)| re.is_match(&c[2]))
+        .map(|(phase, _)| *phase)
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PhaseRecord {
+    name: String,
+    start: Duration,
+    end: Option<Duration>,
+    /// Bytes transferred in the phase, if reported
+    bytes: Option<u64>,
+}
+impl PhaseRecord {
+    pub fn name(&self) -> &str {
+        &self.name
+    }
+    pub fn duration(&self) -> Duration {
+        self.end.unwrap_or(self.start).saturating_sub(self.start)
+    }
+    /// Returns bytes per second, if the amount of data is known
+    pub fn throughput(&self) -> Option<f64> {
+        let secs = self.duration().as_secs_f64();
+        self.bytes.filter(|_| secs > 0.0).map(|b| b as f64 / secs)
+    }
+}
+
+/// FlashTelemetry records the phases of a flash of a DUT.
+#[derive(Debug, Clone)]
+pub struct FlashTelemetry {
+    dut: String,
+    started: Instant,
+    phases: Vec<PhaseRecord>,
+    result: Option<bool>,
+    /// Shows the current phase, if set
+    progress: Option<ProgressBar>,
+}
+impl FlashTelemetry {
+    pub fn new(dut: &str) -> Self {
+        Self {
+            dut: dut.to_string(),
+            started: Instant::now(),
+            phases: Vec::new(),
+            result: None,
+            progress: None,
+        }
+    }
+    /// Show the current phase in `bar`.
+    pub fn with_progress(mut self, bar: ProgressBar) -> Self {
+        bar.set_message("starting");
+        self.progress = Some(bar);
+        self
+    }
+    pub fn started(&self) -> Instant {
+        self.started
+    }
+    /// Handle a line of the output of `cros flash`, which is printed just
+    /// now.
+    pub fn handle_line(&mut self, line: &str) {
+        let at = self.started.elapsed();
+        self.handle_line_at(line, at);
+    }
+    fn handle_line_at(&mut self, line: &str, at: Duration) {
+        if let Some(phase) = parse_phase(line) {
+            self.phase_at(phase, at);
+        }
+        if let (Some(c), Some(p)) = (RE_BYTES.captures(line), self.phases.last_mut()) {
+            if let Ok(bytes) = c[1].parse::<u64>() {
+                p.bytes = Some(p.bytes.unwrap_or(0).max(bytes));
+            }
+        }
+    }
+    /// Start a phase now. The current phase ends here. Continuing the same
+    /// phase is a no-op.
+    pub fn phase(&mut self, name: &str) {
+        let at = self.started.elapsed();
+        self.phase_at(name, at);
+    }
+    fn phase_at(&mut self, name: &str, at: Duration) {
+        if let Some(p) = self.open_phase() {
+            if p.name == name {
+                return;
+            }
+            p.end = Some(at);
+        }
+        if let Some(bar) = &self.progress {
+            bar.set_message(name.to_string());
+        }
+        self.phases.push(PhaseRecord {
+            name: name.to_string(),
+            start: at,
+            end: None,
+            bytes: None,
+        });
+    }
+    /// The phase in progress. Transfers are recorded after they are done, so
+    /// it is not always the last one.
+    fn open_phase(&mut self) -> Option<&mut PhaseRecord> {
+        self.phases.iter_mut().rev().find(|p| p.end.is_none())
+    }
+    /// Record a transfer which ran in the current phase, possibly in parallel
+    /// with others (e.g. the partitions written by AbUpdateTarget).
+    pub fn add_transfer(&mut self, name: &str, start: Instant, duration: Duration, bytes: u64) {
+        let start = start.saturating_duration_since(self.started);
+        self.phases.push(PhaseRecord {
+            name: name.to_string(),
+            start,
+            end: Some(start + duration),
+            bytes: Some(bytes),
+        });
+    }
+    /// Mark the end of the flash.
+    pub fn finish(&mut self, success: bool) {
+        let at = self.started.elapsed();
+        self.finish_at(success, at);
+    }
+    fn finish_at(&mut self, success: bool, at: Duration) {
+        if let Some(p) = self.open_phase() {
+            p.end = Some(at);
+        }
+        self.result = Some(success);
+        if let Some(bar) = &self.progress {
+            bar.finish_with_message(if success { "ok" } else { "failed" });
+        }
+    }
+    pub fn phases(&self) -> &[PhaseRecord] {
+        &self.phases
+    }
+    fn total(&self) -> Duration {
+        if self.result.is_none() {
+            return self.started.elapsed();
+        }
+        self.phases
+            .iter()
+            .filter_map(|p| p.end)
+            .max()
+            .unwrap_or_default()
+    }
+    /// Returns a table of the phases
+    pub fn report(&self) -> String {
+        let mut r = String::new();
+        let result = match self.result {
+            Some(true) => "ok",
+            Some(false) => "failed",
+            None => "running",
+        };
+        let _ = writeln!(
+            r,
+            "Flash of {} ({:.1?} in total, {result}):",
+            self.dut,
+            self.total()
+        );
+        let _ = writeln!(
+            r,
+            "  {:<12} {:>9} {:>10} {:>12}",
+            "phase", "time", "MiB", "MiB/s"
+        );
+        for p in &self.phases {
+            let mib = p
+                .bytes
+                .map(|b| format!("{:.1}", b as f64 / (1 << 20) as f64))
+                .unwrap_or_else(|| "-".to_string());
+            let rate = p
+                .throughput()
+                .map(|b| format!("{:.1}", b / (1 << 20) as f64))
+                .unwrap_or_else(|| "-".to_string());
+            let _ = writeln!(
+                r,
+                "  {:<12} {:>8.1}s {mib:>10} {rate:>12}",
+                p.name,
+                p.duration().as_secs_f64()
+            );
+        }
+        r.trim_end().to_string()
+    }
+    /// Add the phases to `trace` in `lane`, shifted by `offset` (the start
+    /// of this flash on the timeline of the trace).
+    pub fn add_to_trace(&self, trace: &mut TraceWriter, lane: usize, offset: Duration) {
+        trace.lane_name(lane, &self.dut);
+        for p in &self.phases {
+            trace.span(&p.name, "flash", lane, offset + p.start, p.duration());
+        }
+    }
+    /// Save the trace to ~/.cro3/flash_traces/ and return the path of it.
+    pub fn save_trace(&self) -> Result<PathBuf> {
+        let mut trace = TraceWriter::new();
+        self.add_to_trace(&mut trace, 0, Duration::ZERO);
+        trace.save("flash_traces", &self.dut.replace(['/', ':'], "_"))
+    }
+    /// Returns the record of this flash for the history
+    pub fn record(&self, image: &str) -> FlashRecord {
+        FlashRecord {
+            date: Local::now().to_rfc3339(),
+            image: image.to_string(),
+            seconds: self.total().as_secs_f64(),
+            success: self.result.unwrap_or(false),
+            phases: self
+                .phases
+                .iter()
+                .map(|p| (p.name.clone(), p.duration().as_secs_f64()))
+                .collect(),
+        }
+    }
+}
+
+/// A flash in the history of a DUT
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct FlashRecord {
+    pub date: String,
+    pub image: String,
+    pub seconds: f64,
+    pub success: bool,
+    /// Phases and their durations in seconds
+    pub phases: Vec<(String, f64)>,
+}
+
+/// Add a flash to the history of the DUT.
+pub fn record_flash(dut: &str, record: FlashRecord) -> Result<()> {
+    let mut history = FLASH_HISTORY.get(dut)?.unwrap_or_default();
+    history.push(record);
+    let excess = history.len().saturating_sub(HISTORY_LEN);
+    history.drain(..excess);
+    FLASH_HISTORY.set(dut, history)
+}
+
+/// Returns the history of flashes of all the DUTs, oldest first.
+pub fn flash_history() -> Result<Vec<(String, Vec<FlashRecord>)>> {
+    let mut entries: Vec<_> = FLASH_HISTORY.entries()?.into_iter().collect();
+    entries.sort_by(|a, b| a.0.cmp(&b.0));
+    Ok(entries)
+}
+
+/// Returns the median duration of the successful flashes in seconds.
+pub fn median_seconds(history: &[FlashRecord]) -> Option<f64> {
+    let mut secs: Vec<f64> = history
+        .iter()
+        .filter(|r| r.success)
+        .map(|r| r.seconds)
+        .collect();
+    if secs.is_empty() {
+        return None;
+    }
+    secs.sort_by(f64::total_cmp);
+    // Average of the two middle ones if the length is even
+    let n = secs.len();
+    Some((secs[(n - 1) / 2] + secs[n / 2]) / 2.0)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn secs(s: u64) -> Duration {
+        Duration::from_secs(s)
+    }
+
+    #[test]
+    fn phases() {
+        assert_eq!(
+            parse_phase("10:20:30.123: NOTICE: Updating rootfs partition..."),
+            Some("rootfs")
+        );
+        assert_eq!(
+            parse_phase("\x1b[1;32m10:20:30: INFO: Rebooting device.\x1b[0m"),
+            Some("reboot")
+        );
+        assert_eq!(
+            parse_phase("10:20:30.123: DEBUG: run: ssh root@dut reboot"),
+            None
+        );
+        assert_eq!(parse_phase("stateful"), None);
+
+        let mut t = FlashTelemetry::new("dut1");
+        t.handle_line_at("10:00:00: NOTICE: Downloading image", secs(0));
+        t.handle_line_at("10:00:01: INFO: Updating kernel partition", secs(10));
+        t.handle_line_at("10:00:02: INFO: Updating rootfs partition", secs(12));
+        t.handle_line_at("2097152 bytes (2.1 MB, 2.0 MiB) copied, 1 s", secs(13));
+        t.handle_line_at("4194304 bytes (4.2 MB, 4.0 MiB) copied, 2 s", secs(14));
+        t.handle_line_at("10:00:04: INFO: Updating rootfs: done", secs(15));
+        t.handle_line_at("10:00:05: INFO: Rebooting the device", secs(16));
+        t.finish_at(true, secs(40));
+
+        let names: Vec<&str> = t.phases().iter().map(|p| p.name()).collect();
+        assert_eq!(names, vec!["download", "kernel", "rootfs", "reboot"]);
+        let rootfs = &t.phases()[2];
+        assert_eq!(rootfs.duration(), secs(4));
+        assert_eq!(rootfs.throughput(), Some((1 << 20) as f64));
+        assert!(t.report().contains("rootfs"));
+
+        let record = t.record("image.bin");
+        assert_eq!(record.seconds, 40.0);
+        assert_eq!(record.phases[3], ("reboot".to_string(), 24.0));
+        let history = vec![
+            record.clone(),
+            FlashRecord {
+                seconds: 60.0,
+                ..record.clone()
+            },
+            FlashRecord {
+                seconds: 999.0,
+                success: false,
+                ..record
+            },
+        ];
+        assert_eq!(median_seconds(&history), Some(50.0));
+    }
+
+    #[test]
+    fn transfers() {
+        let mut t = FlashTelemetry::new("dut1");
+        t.phase_at("prepare", secs(0));
+        t.phase_at("write", secs(2));
+        let started = t.started();
+        t.add_transfer("KERN-A", started + secs(2), secs(1), 32 << 20);
+        t.add_transfer("ROOT-A", started + secs(2), secs(8), 2048 << 20);
+        t.phase_at("reboot", secs(10));
+        t.finish_at(true, secs(30));
+
+        let names: Vec<&str> = t.phases().iter().map(|p| p.name()).collect();
+        assert_eq!(
+            names,
+            vec!["prepare", "write", "KERN-A", "ROOT-A", "reboot"]
+        );
+        // The transfers don't end the phase they ran in
+        assert_eq!(t.phases()[1].duration(), secs(8));
+        assert_eq!(t.phases()[3].throughput(), Some((256 << 20) as f64));
+        assert_eq!(t.record("image.bin").seconds, 30.0);
+    }
+}
@@ -1,8 +1,21 @@
+use std::path::Path;
 use std::process::Command;
 
 use anyhow::Context;
 use anyhow::Result;
+use tracing::warn;
 
+use crate::download::Download;
+
+/// Returns true if stderr of `gsutil ls` only says that some URLs matched
+/// nothing. Other errors (e.g. auth, quota) are reported on their own lines.
+fn is_only_no_match(stderr: &str) -> bool {
+    let mut lines = stderr.lines().map(str::trim).filter(|l| !l.is_empty());
+    lines.clone().next().is_some() && lines.all(|l| l.contains("matched no objects"))
+}
+
+/// Runs `gsutil.py ls` with the pattern. URLs which match nothing are not an
+/// error: the matches of the others are returned.
 pub fn list_gs_files(pattern: &str) -> Result<String> {
     let cmd = format!("gsutil.py ls {}", pattern.trim());
     println!("{:?}", cmd);
@@ -10,8 +23,70 @@ pub fn list_gs_files(pattern: &str) -> Result<String> {
         "Failed to execute gsutil ls (maybe you need depot_tools and/or `gsutil.py config` with \
          'chromeos-swarming' project)",
     )?;
+    let stderr = String::from_utf8_lossy(&output.stderr);
+    if !output.status.success() && !is_only_no_match(&stderr) {
+        output
+            .status
+            .exit_ok()
+            .context(format!("gsutil ls failed: {}", stderr.trim()))?;
+    }
     Ok(String::from_utf8_lossy(&output.stdout)
         .to_string()
         .trim()
         .to_string())
 }
+
+fn access_token() -> Result<String> {
+    let output = Command::new("gcloud")
+        .args(["auth", "print-access-token"])
+        .output()
+        .context("Failed to run gcloud")?;
+    output
+        .status
+        .exit_ok()
+        .context("Failed to get an access token")?;
+    Ok(String::from_utf8_lossy(&output.stdout).trim().to_string())
+}
+
+/// Download a file on Cloud Storage (gs://...) to `dest`, with parallel
+/// resumable range requests if gcloud is authenticated. Falls back to
+/// `gsutil.py cp` otherwise.
+pub fn download_gs_file(url: &str, dest: &Path, bandwidth_limit: Option<u64>) -> Result<()> {
+    let object = url
+        .strip_prefix("gs://")
+        .context(format!("{url} is not a gs:// URL"))?;
+    match access_token() {
+        Ok(token) => Download::new(&format!("https://storage.googleapis.com/{object}"))
+            .header(&format!("Authorization: Bearer {token}"))
+            .bandwidth_limit(bandwidth_limit)
+            .to_file(dest),
+        Err(e) => {
+            warn!("Using gsutil.py to download {url}: {e:#}");
+            Command::new("gsutil.py")
+                .arg("cp")
+                .arg(url)
+                .arg(dest)
+                .status()
+                .context("Failed to run gsutil.py (depot_tools is needed)")?
+                .exit_ok()
+                .context(format!("Failed to download {url}"))
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn no_match() {
+        assert!(is_only_no_match(
+            "CommandException: One or more URLs matched no objects.\n"
+        ));
+        assert!(!is_only_no_match(
+            "AccessDeniedException: 403 user does not have storage.objects.list \
+             access\nCommandException: One or more URLs matched no objects.\n"
+        ));
+        assert!(!is_only_no_match(""));
+    }
+}
@@ -0,0 +1,192 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Reads the partition table of ChromiumOS disk images (e.g.
+//! chromiumos_test_image.bin).
+
+use std::fs::File;
+use std::io::Read;
+use std::io::Seek;
+use std::io::SeekFrom;
+use std::path::Path;
+use std::path::PathBuf;
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+
+pub const SECTOR_SIZE: u64 = 512;
+const GPT_SIGNATURE: &[u8; 8] = b"EFI PART";
+
+/// Partition is an entry of the GPT of an image
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Partition {
+    number: u32,
+    label: String,
+    first_lba: u64,
+    last_lba: u64,
+}
+impl Partition {
+    pub fn number(&self) -> u32 {
+        self.number
+    }
+    pub fn label(&self) -> &str {
+        &self.label
+    }
+    /// Offset from the beginning of the image, in bytes
+    pub fn offset(&self) -> u64 {
+        self.first_lba * SECTOR_SIZE
+    }
+    pub fn size(&self) -> u64 {
+        (self.last_lba + 1 - self.first_lba) * SECTOR_SIZE
+    }
+}
+
+fn u32_at(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+fn u64_at(buf: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(buf[offset..offset + 8].try_into().unwrap())
+}
+
+/// Parse the primary GPT of a disk image.
+pub fn read_partitions<R: Read + Seek>(image: &mut R) -> Result<Vec<Partition>> {
+    let mut header = [0u8; SECTOR_SIZE as usize];
+    image.seek(SeekFrom::Start(SECTOR_SIZE))?;
+    image
+        .read_exact(&mut header)
+        .context("Failed to read the GPT header")?;
+    if &header[0..8] != GPT_SIGNATURE {
+        bail!("GPT signature not found");
+    }
+    let entries_lba = u64_at(&header, 72);
+    let num_entries = u32_at(&header, 80) as usize;
+    let entry_size = u32_at(&header, 84) as usize;
+    if entry_size < 128 || num_entries > 1024 {
+        bail!("Unexpected GPT entries: {num_entries} x {entry_size} bytes");
+    }
+    let mut entries = vec![0u8; num_entries * entry_size];
+    image.seek(SeekFrom::Start(entries_lba * SECTOR_SIZE))?;
+    image
+        .read_exact(&mut entries)
+        .context("Failed to read GPT entries")?;
+    let mut partitions = Vec::new();
+    for (i, entry) in entries.chunks(entry_size).enumerate() {
+        // Skip unused entries (type GUID is zero)
+        if entry[0..16].iter().all(|b| *b == 0) {
+            continue;
+        }
+        let name: Vec<u16> = entry[56..128]
+            .chunks(2)
+            .map(|c| u16::from_le_bytes([c[0], c[1]]))
+            .take_while(|c| *c != 0)
+            .collect();
+        let partition = Partition {
+            number: i as u32 + 1,
+            label: String::from_utf16_lossy(&name),
+            first_lba: u64_at(entry, 32),
+            last_lba: u64_at(entry, 40),
+        };
+        // Reject broken entries here, so that offset() and size() can not
+        // overflow
+        partition
+            .last_lba
+            .checked_sub(partition.first_lba)
+            .and_then(|n| n.checked_add(1))
+            .and_then(|n| n.checked_mul(SECTOR_SIZE))
+            .zip(partition.last_lba.checked_mul(SECTOR_SIZE))
+            .context(format!("Invalid GPT entry: {partition:?}"))?;
+        partitions.push(partition);
+    }
+    Ok(partitions)
+}
+
+/// DiskImage is a ChromiumOS disk image file
+#[derive(Debug, Clone)]
+pub struct DiskImage {
+    path: PathBuf,
+    partitions: Vec<Partition>,
+}
+impl DiskImage {
+    pub fn open(path: &Path) -> Result<Self> {
+        let mut file = File::open(path).context(format!("Failed to open {path:?}"))?;
+        let partitions =
+            read_partitions(&mut file).context(format!("Failed to read the GPT of {path:?}"))?;
+        Ok(Self {
+            path: path.to_path_buf(),
+            partitions,
+        })
+    }
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+    pub fn partitions(&self) -> &[Partition] {
+        &self.partitions
+    }
+    /// Find a partition by its label (e.g. "KERN-A", "ROOT-A", "STATE")
+    pub fn partition(&self, label: &str) -> Result<&Partition> {
+        self.partitions
+            .iter()
+            .find(|p| p.label == label)
+            .context(format!("Partition {label} not found in {:?}", self.path))
+    }
+}
+
+/// Returns the path of the latest image built for the board in the checkout.
+pub fn latest_local_image(cros: &str, board: &str, variant: &str) -> PathBuf {
+    Path::new(cros).join(format!(
+        "src/build/images/{board}/latest/chromiumos_{variant}_image.bin"
+    ))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::Cursor;
+
+    use super::*;
+
+    /// Create a disk image with a GPT which has the given partitions as
+    /// (label, first_lba, last_lba).
+    fn fake_image(partitions: &[(&str, u64, u64)], sectors: u64) -> Vec<u8> {
+        let mut image = vec![0u8; (sectors * SECTOR_SIZE) as usize];
+        let header = SECTOR_SIZE as usize;
+        image[header..header + 8].copy_from_slice(GPT_SIGNATURE);
+        image[header + 72..header + 80].copy_from_slice(&2u64.to_le_bytes());
+        image[header + 80..header + 84].copy_from_slice(&128u32.to_le_bytes());
+        image[header + 84..header + 88].copy_from_slice(&128u32.to_le_bytes());
+        for (i, (label, first, last)) in partitions.iter().enumerate() {
+            if label.is_empty() {
+                // Leave the entry unused
+                continue;
+            }
+            let entry = 2 * SECTOR_SIZE as usize + i * 128;
+            image[entry] = 1;
+            image[entry + 32..entry + 40].copy_from_slice(&first.to_le_bytes());
+            image[entry + 40..entry + 48].copy_from_slice(&last.to_le_bytes());
+            for (j, c) in label.encode_utf16().enumerate() {
+                image[entry + 56 + j * 2..entry + 58 + j * 2].copy_from_slice(&c.to_le_bytes());
+            }
+        }
+        image
+    }
+
+    #[test]
+    fn gpt() {
+        let image = fake_image(&[("STATE", 40, 47), ("", 0, 0), ("KERN-A", 48, 51)], 64);
+        let partitions = read_partitions(&mut Cursor::new(image)).unwrap();
+        assert_eq!(partitions.len(), 2);
+        assert_eq!(partitions[0].label(), "STATE");
+        assert_eq!(partitions[0].offset(), 40 * 512);
+        assert_eq!(partitions[0].size(), 8 * 512);
+        // Numbers are the indexes of the entries
+        assert_eq!(partitions[1].number(), 3);
+        assert_eq!(partitions[1].label(), "KERN-A");
+        assert!(read_partitions(&mut Cursor::new(vec![0u8; 4096])).is_err());
+        // The last LBA is before the first one
+        let image = fake_image(&[("STATE", 47, 40)], 64);
+        assert!(read_partitions(&mut Cursor::new(image)).is_err());
+    }
+}
@@ -0,0 +1,357 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Content-addressed cache of images downloaded from Google Cloud Storage.
+//!
+//! Archives are stored as ~/.cro3/images/{sha256}.tar.xz and extracted next
+//! to them in ~/.cro3/images/{sha256}/. Archives are checked against the md5
+//! published by Cloud Storage when they are downloaded. The size and mtime
+//! of the extracted image are recorded, and checked on each use: if they
+//! changed, the archive is hashed again and the image is extracted again
+//! from it, instead of hashing the multi-GB image on every use. The index
+//! maps an image
+//! ({board}/{version}/{variant}) to the hash of its archive, so the same
+//! archive is stored once even if it is referred by multiple names. The
+//! least recently used images are removed to keep the cache under
+//! `cro3 config set image_cache_max_size`.
+
+use std::collections::HashMap;
+use std::collections::HashSet;
+use std::fs;
+use std::path::Path;
+use std::path::PathBuf;
+use std::process::Command;
+use std::sync::atomic::AtomicUsize;
+use std::sync::atomic::Ordering;
+use std::time::SystemTime;
+use std::time::UNIX_EPOCH;
+
+use anyhow::anyhow;
+use anyhow::Context;
+use anyhow::Result;
+use serde::Deserialize;
+use serde::Serialize;
+use tracing::info;
+use tracing::warn;
+
+use crate::cache::KvCache;
+use crate::config::Config;
+use crate::google_storage::download_gs_file;
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
+use crate::util::hash::sha256_file;
+use crate::util::size::parse_size;
+
+static IMAGE_CACHE_INDEX: KvCache<CachedImage> = KvCache::new("image_cache_index");
+const TEST_IMAGE_NAME: &str = "chromiumos_test_image.bin";
+
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub struct CachedImage {
+    /// sha256 of the archive
+    sha256: String,
+    /// Seconds since the UNIX epoch
+    last_used: u64,
+}
+
+fn now() -> u64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_secs()
+}
+
+/// Returns "{size} {mtime in ns}" of the file, which changes if the file is
+/// written.
+fn image_stamp(path: &Path) -> Result<String> {
+    let meta = fs::metadata(path).context(format!("Failed to stat {path:?}"))?;
+    let mtime = meta.modified()?.duration_since(UNIX_EPOCH)?.as_nanos();
+    Ok(format!("{} {mtime}", meta.len()))
+}
+
+fn disk_usage(path: &Path) -> u64 {
+    let Ok(meta) = fs::symlink_metadata(path) else {
+        return 0;
+    };
+    if !meta.is_dir() {
+        return meta.len();
+    }
+    fs::read_dir(path)
+        .map(|entries| {
+            entries
+                .filter_map(|e| e.ok())
+                .map(|e| disk_usage(&e.path()))
+                .sum()
+        })
+        .unwrap_or(0)
+}
+
+/// Returns the hashes of the archives to be removed to fit in `max_bytes`,
+/// from the least recently used one. The archive of `keep` is never removed.
+fn plan_eviction(
+    entries: &HashMap<String, CachedImage>,
+    sizes: &HashMap<String, u64>,
+    max_bytes: u64,
+    keep: &str,
+) -> Vec<String> {
+    // An archive is used as recently as the latest of the names referring it
+    let mut last_used: HashMap<&str, u64> = HashMap::new();
+    for e in entries.values() {
+        let t = last_used.entry(&e.sha256).or_default();
+        *t = (*t).max(e.last_used);
+    }
+    let mut archives: Vec<(u64, &str)> = last_used.into_iter().map(|(s, t)| (t, s)).collect();
+    archives.sort();
+    let mut total: u64 = archives
+        .iter()
+        .map(|(_, s)| sizes.get(*s).copied().unwrap_or(0))
+        .sum();
+    let mut evicted = Vec::new();
+    for (_, sha256) in archives {
+        if total <= max_bytes {
+            break;
+        }
+        if sha256 == keep {
+            continue;
+        }
+        total -= sizes.get(sha256).copied().unwrap_or(0);
+        evicted.push(sha256.to_string());
+    }
+    evicted
+}
+
+/// ImageCache holds test images for `cro3 flash`.
+pub struct ImageCache {
+    dir: PathBuf,
+    max_bytes: u64,
+    bandwidth_limit: Option<u64>,
+}
+impl ImageCache {
+    pub fn from_config(config: &Config) -> Result<Self> {
+        let dir = gen_path_in_cro3_dir("images/tmp/.keep")?;
+        let dir = dir
+            .parent()
+            .and_then(Path::parent)
+            .context("Failed to get the image cache dir")?
+            .to_path_buf();
+        Ok(Self {
+            dir,
+            max_bytes: parse_size(&config.image_cache_max_size())?,
+            bandwidth_limit: config
+                .download_bandwidth_limit()
+                .map(|s| parse_size(&s))
+                .transpose()?,
+        })
+    }
+    fn archive_path(&self, sha256: &str) -> PathBuf {
+        self.dir.join(format!("{sha256}.tar.xz"))
+    }
+    fn extracted_dir(&self, sha256: &str) -> PathBuf {
+        self.dir.join(sha256)
+    }
+    fn image_stamp_path(&self, sha256: &str) -> PathBuf {
+        self.extracted_dir(sha256)
+            .join(format!("{TEST_IMAGE_NAME}.stamp"))
+    }
+    /// Returns a path in the tmp dir which is not used by other downloads or
+    /// extractions, including the ones of other cro3 processes.
+    fn unique_tmp_path(&self, name: &str) -> PathBuf {
+        static COUNTER: AtomicUsize = AtomicUsize::new(0);
+        let n = COUNTER.fetch_add(1, Ordering::Relaxed);
+        self.dir
+            .join("tmp")
+            .join(format!("{}.{n}.{name}", std::process::id()))
+    }
+    /// Returns the path of the test image of the board and the version (e.g.
+    /// R120-15662.0.0), downloading it if it is not cached yet.
+    pub fn get_test_image(&self, board: &str, version: &str) -> Result<PathBuf> {
+        let key = format!("{board}/{version}/test");
+        if let Some(entry) = IMAGE_CACHE_INDEX.get(&key)? {
+            match self.verified_image(&entry.sha256) {
+                Ok(_) => {
+                    info!("Using the cached image for {key}");
+                    return self.use_archive(&key, &entry.sha256);
+                }
+                Err(e) => match self.verify(&entry.sha256) {
+                    Ok(()) => {
+                        warn!("Extracted image for {key} is broken, extracting again: {e:#}");
+                        let _ = fs::remove_dir_all(self.extracted_dir(&entry.sha256));
+                        return self.use_archive(&key, &entry.sha256);
+                    }
+                    Err(e) => {
+                        warn!("Cached image for {key} is broken, downloading again: {e:#}");
+                        IMAGE_CACHE_INDEX.remove(&key)?;
+                    }
+                },
+            }
+        }
+        let url = format!(
+            "gs://chromeos-image-archive/{board}-release/{version}/chromiumos_test_image.tar.xz"
+        );
+        let tmp = self.unique_tmp_path(&format!("{board}-{version}.tar.xz"));
+        info!("Downloading {url}...");
+        if let Err(e) = download_gs_file(&url, &tmp, self.bandwidth_limit) {
+            let _ = fs::remove_file(&tmp);
+            return Err(e);
+        }
+        let sha256 = sha256_file(&tmp)?;
+        let archive = self.archive_path(&sha256);
+        if archive.exists() {
+            // Same content is already cached with another name
+            fs::remove_file(&tmp)?;
+        } else {
+            fs::rename(&tmp, &archive)?;
+        }
+        self.use_archive(&key, &sha256)
+    }
+    fn verify(&self, sha256: &str) -> Result<()> {
+        let actual = sha256_file(&self.archive_path(sha256))?;
+        if actual != sha256 {
+            return Err(anyhow!("sha256 mismatch: {actual}"));
+        }
+        Ok(())
+    }
+    /// Returns the extracted image if its size and mtime are the ones
+    /// recorded at the extraction.
+    fn verified_image(&self, sha256: &str) -> Result<PathBuf> {
+        let image = self.extracted_dir(sha256).join(TEST_IMAGE_NAME);
+        let expected = fs::read_to_string(self.image_stamp_path(sha256))
+            .context("The extracted image is not recorded")?;
+        let actual = image_stamp(&image)?;
+        if actual != expected.trim() {
+            return Err(anyhow!("{image:?} was modified ({actual})"));
+        }
+        Ok(image)
+    }
+    /// Mark the archive used by `key`, extract the image if needed, and
+    /// remove old images.
+    fn use_archive(&self, key: &str, sha256: &str) -> Result<PathBuf> {
+        IMAGE_CACHE_INDEX.set(
+            key,
+            CachedImage {
+                sha256: sha256.to_string(),
+                last_used: now(),
+            },
+        )?;
+        let image = self.extract(sha256)?;
+        if let Err(e) = self.evict(sha256) {
+            warn!("Failed to remove old images: {e:#}");
+        }
+        Ok(image)
+    }
+    fn extract(&self, sha256: &str) -> Result<PathBuf> {
+        let dir = self.extracted_dir(sha256);
+        let image = dir.join(TEST_IMAGE_NAME);
+        if image.exists() && self.image_stamp_path(sha256).exists() {
+            return Ok(image);
+        }
+        let tmp = self.unique_tmp_path(sha256);
+        fs::create_dir_all(&tmp)?;
+        info!("Extracting the image...");
+        let extracted = Command::new("tar")
+            .arg("-I")
+            .arg("xz -T0")
+            .arg("-xf")
+            .arg(self.archive_path(sha256))
+            .arg("-C")
+            .arg(&tmp)
+            .status()?
+            .exit_ok()
+            .context("Failed to extract the image")
+            .and_then(|_| {
+                let stamp = image_stamp(&tmp.join(TEST_IMAGE_NAME))
+                    .context(format!("{TEST_IMAGE_NAME} is not found in the archive"))?;
+                fs::write(tmp.join(format!("{TEST_IMAGE_NAME}.stamp")), stamp)?;
+                Ok(())
+            });
+        if let Err(e) = extracted {
+            let _ = fs::remove_dir_all(&tmp);
+            return Err(e);
+        }
+        let _ = fs::remove_dir_all(&dir);
+        fs::rename(&tmp, &dir)?;
+        Ok(image)
+    }
+    fn evict(&self, keep: &str) -> Result<()> {
+        let entries = IMAGE_CACHE_INDEX.entries()?;
+        let archives: HashSet<&str> = entries.values().map(|e| e.sha256.as_str()).collect();
+        let sizes: HashMap<String, u64> = archives
+            .iter()
+            .map(|sha256| {
+                (
+                    sha256.to_string(),
+                    disk_usage(&self.archive_path(sha256))
+                        + disk_usage(&self.extracted_dir(sha256)),
+                )
+            })
+            .collect();
+        for sha256 in plan_eviction(&entries, &sizes, self.max_bytes, keep) {
+            info!("Removing a cached image {sha256}");
+            for (key, e) in &entries {
+                if e.sha256 == sha256 {
+                    IMAGE_CACHE_INDEX.remove(key)?;
+                }
+            }
+            let _ = fs::remove_file(self.archive_path(&sha256));
+            let _ = fs::remove_dir_all(self.extracted_dir(&sha256));
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn extracted_image() {
+        let dir = TempDir::new("cro3_image_cache_test").unwrap();
+        let cache = ImageCache {
+            dir: dir.path().to_path_buf(),
+            max_bytes: 0,
+            bandwidth_limit: None,
+        };
+        let image = cache.extracted_dir("aaa").join(TEST_IMAGE_NAME);
+        fs::create_dir_all(image.parent().unwrap()).unwrap();
+        fs::write(&image, "image").unwrap();
+        // Not verifiable without the recorded stamp
+        assert!(cache.verified_image("aaa").is_err());
+        fs::write(cache.image_stamp_path("aaa"), image_stamp(&image).unwrap()).unwrap();
+        assert_eq!(cache.verified_image("aaa").unwrap(), image);
+        fs::write(&image, "broken image").unwrap();
+        assert!(cache.verified_image("aaa").is_err());
+
+        assert_ne!(cache.unique_tmp_path("a"), cache.unique_tmp_path("a"));
+    }
+
+    #[test]
+    fn eviction() {
+        let entry = |sha256: &str, last_used| CachedImage {
+            sha256: sha256.to_string(),
+            last_used,
+        };
+        let entries: HashMap<String, CachedImage> = [
+            ("brya/R120-1.0.0/test", entry("aaa", 10)),
+            ("brya/R121-2.0.0/test", entry("bbb", 20)),
+            // Same archive as "aaa", used recently
+            ("brya-alias/R120-1.0.0/test", entry("aaa", 40)),
+            ("volteer/R120-1.0.0/test", entry("ccc", 30)),
+        ]
+        .into_iter()
+        .map(|(k, v)| (k.to_string(), v))
+        .collect();
+        let sizes: HashMap<String, u64> = [("aaa", 100), ("bbb", 100), ("ccc", 100)]
+            .into_iter()
+            .map(|(k, v)| (k.to_string(), v))
+            .collect();
+        assert!(plan_eviction(&entries, &sizes, 300, "aaa").is_empty());
+        assert_eq!(plan_eviction(&entries, &sizes, 250, "aaa"), vec!["bbb"]);
+        assert_eq!(
+            plan_eviction(&entries, &sizes, 100, "bbb"),
+            vec!["ccc", "aaa"]
+        );
+    }
+}
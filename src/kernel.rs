@@ -0,0 +1,373 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Fast path to deploy a kernel being developed, without emerge.
+//!
+//! The kernel is rebuilt incrementally in the build tree kept by the last
+//! emerge of the kernel package (/build/$BOARD/var/cache/portage/...), and
+//! only the kernel partition and the modules whose contents are changed are
+//! sent to the DUT.
+
+use std::collections::HashMap;
+use std::fs;
+use std::fs::File;
+use std::io::Write;
+use std::path::Path;
+use std::path::PathBuf;
+use std::process::Command;
+use std::process::Stdio;
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use tracing::info;
+
+use crate::ab_update::partition_device;
+use crate::ab_update::slots;
+use crate::chroot::Chroot;
+use crate::dut::SshInfo;
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
+use crate::util::hash::sha256_file;
+
+const KERNEL_RELEASE_PREFIX: &str = "cro3 kernel release: ";
+/// The kernel command line of dev images refers to the rootfs next to the
+/// kernel partition
+const ROOT_RELATIVE_TO_KERNEL: &str = "PARTUUID=%U/PARTNROFF=1";
+
+/// Returns the category/name of a kernel package (e.g. "chromeos-kernel-5_15"
+/// -> "sys-kernel/chromeos-kernel-5_15").
+fn kernel_package_name(package: &str) -> String {
+    if package.contains('/') {
+        package.to_string()
+    } else {
+        format!("sys-kernel/{package}")
+    }
+}
+
+/// Returns "path -> sha256" of the module files under `dir`.
+fn hash_modules(dir: &Path) -> Result<HashMap<String, String>> {
+    let mut hashes = HashMap::new();
+    let mut dirs = vec![dir.to_path_buf()];
+    while let Some(d) = dirs.pop() {
+        for e in fs::read_dir(&d)? {
+            let path = e?.path();
+            let meta = fs::symlink_metadata(&path)?;
+            if meta.is_dir() {
+                dirs.push(path);
+            } else if meta.is_file()
+                && path
+                    .file_name()
+                    .and_then(|n| n.to_str())
+                    .is_some_and(|n| n.contains(".ko"))
+            {
+                let rel = path.strip_prefix(dir)?.to_string_lossy().to_string();
+                hashes.insert(format!("./{rel}"), sha256_file(&path)?);
+            }
+        }
+    }
+    Ok(hashes)
+}
+
+/// Returns the modules which are not the same on the DUT.
+fn changed_modules(
+    built: &HashMap<String, String>,
+    on_dut: &HashMap<String, String>,
+) -> Vec<String> {
+    let mut changed: Vec<String> = built
+        .iter()
+        .filter(|(path, hash)| on_dut.get(*path) != Some(*hash))
+        .map(|(path, _)| path.clone())
+        .collect();
+    changed.sort();
+    changed
+}
+
+/// Returns the modules on the DUT which are not in the new build. They have
+/// to be removed, or they stay loadable with the new kernel.
+fn removed_modules(
+    built: &HashMap<String, String>,
+    on_dut: &HashMap<String, String>,
+) -> Vec<String> {
+    let mut removed: Vec<String> = on_dut
+        .keys()
+        .filter(|path| !built.contains_key(*path))
+        .cloned()
+        .collect();
+    removed.sort();
+    removed
+}
+
+fn parse_sha256sum(output: &str) -> HashMap<String, String> {
+    output
+        .lines()
+        .filter_map(|line| {
+            let (hash, path) = line.split_once("  ")?;
+            Some((path.to_string(), hash.to_string()))
+        })
+        .collect()
+}
+
+/// With --ab_update, the modules of the new kernel are installed in the active
+/// rootfs next to the ones of the running kernel. They must not share the
+/// directory, or the fallback kernel would boot with the new modules.
+fn ensure_release_changed(new: &str, running: &str) -> Result<()> {
+    if new == running {
+        bail!(
+            "The kernel release {new} is the same as the running one, so its modules would \
+             replace the ones of the fallback kernel. Change the release (e.g. commit the change \
+             or set CONFIG_LOCALVERSION), or deploy without --ab_update."
+        );
+    }
+    Ok(())
+}
+
+/// KernelFastDeploy rebuilds a kernel incrementally and sends the changes to
+/// a DUT.
+pub struct KernelFastDeploy<'a> {
+    chroot: &'a Chroot,
+    board: String,
+    package: String,
+    target: &'a SshInfo,
+    /// Staging dir on the host, which is /cro3/tmp/... in the chroot
+    stage: PathBuf,
+}
+impl<'a> KernelFastDeploy<'a> {
+    pub fn new(
+        chroot: &'a Chroot,
+        board: &str,
+        package: &str,
+        target: &'a SshInfo,
+    ) -> Result<Self> {
+        let stage = gen_path_in_cro3_dir(&format!("tmp/fast_kernel_{board}/.keep"))?
+            .parent()
+            .context("Failed to get the staging dir")?
+            .to_path_buf();
+        Ok(Self {
+            chroot,
+            board: board.to_string(),
+            package: kernel_package_name(package),
+            target,
+            stage,
+        })
+    }
+    fn stage_in_chroot(&self) -> String {
+        format!("/cro3/tmp/fast_kernel_{}", self.board)
+    }
+    /// Build the kernel and modules incrementally, and install them in the
+    /// staging dir. Returns the kernel release (e.g. 5.15.120-12345-g1234).
+    fn build(&self) -> Result<String> {
+        let board = &self.board;
+        let package = &self.package;
+        let stage = self.stage_in_chroot();
+        let mut release = None;
+        self.chroot.run_bash_script_in_chroot_with_line_handler(
+            "fast_kernel_build",
+            &format!(
+                r###"
+BUILD_DIR=/build/{board}/var/cache/portage/{package}
+if [ ! -f "$BUILD_DIR/.config" ]; then
+  echo "$BUILD_DIR is not found. Please deploy {package} once without --fast-kernel."
+  exit 1
+fi
+CHOST=$(portageq-{board} envvar CHOST)
+KMAKE="sudo make -C $BUILD_DIR -j$(nproc) ARCH=x86_64 CROSS_COMPILE=$CHOST- CC=$CHOST-clang LD=$CHOST-ld.lld LLVM_IAS=1"
+$KMAKE
+sudo rm -rf {stage}
+mkdir -p {stage}
+$KMAKE -s INSTALL_MOD_PATH={stage} INSTALL_MOD_STRIP=1 modules_install
+sudo cp "$BUILD_DIR/$($KMAKE -s image_name)" {stage}/vmlinuz
+sudo chown -R "$(id -u):$(id -g)" {stage}
+echo "{KERNEL_RELEASE_PREFIX}$($KMAKE -s kernelrelease)"
+"###
+            ),
+            None,
+            &mut |line| {
+                if let Some(r) = line.strip_prefix(KERNEL_RELEASE_PREFIX) {
+                    release = Some(r.trim().to_string());
+                }
+            },
+        )?;
+        release.context("Failed to get the kernel release")
+    }
+    /// Pack the kernel into a kernel partition image signed with the dev
+    /// keys, using the command line of the running kernel.
+    fn pack(&self, cmdline: &str) -> Result<PathBuf> {
+        fs::write(self.stage.join("cmdline"), cmdline)?;
+        let stage = self.stage_in_chroot();
+        self.chroot.run_bash_script_in_chroot(
+            "fast_kernel_pack",
+            &format!(
+                r###"
+vbutil_kernel --pack {stage}/kern.bin \
+  --keyblock /usr/share/vboot/devkeys/kernel.keyblock \
+  --signprivate /usr/share/vboot/devkeys/kernel_data_key.vbprivk \
+  --version 1 --config {stage}/cmdline \
+  --bootloader /lib64/bootstub/bootstub.efi \
+  --vmlinuz {stage}/vmlinuz --arch x86_64
+"###
+            ),
+            None,
+        )?;
+        Ok(self.stage.join("kern.bin"))
+    }
+    /// Send the modules which are changed, remove the ones which are not
+    /// built anymore, and update modules.dep.
+    fn send_modules(&self, release: &str) -> Result<usize> {
+        let dir = self.stage.join("lib/modules").join(release);
+        let built = hash_modules(&dir)?;
+        let on_dut = parse_sha256sum(&self.target.run_cmd_stdio(&format!(
+            "cd /lib/modules/{release} 2>/dev/null && find . -type f -name '*.ko*' -exec \
+             sha256sum {{}} + || true"
+        ))?);
+        let changed = changed_modules(&built, &on_dut);
+        let removed = removed_modules(&built, &on_dut);
+        info!(
+            "{} of {} modules are changed, {} are removed",
+            changed.len(),
+            built.len(),
+            removed.len()
+        );
+        if !removed.is_empty() {
+            // The paths are passed through stdin, not to the shell
+            let mut ssh = self.target.ssh_cmd(None)?;
+            ssh.arg(format!(
+                "mount -o remount,rw / && cd /lib/modules/{release} && xargs -0 rm -f"
+            ))
+            .stdin(Stdio::piped());
+            let mut child = ssh.spawn()?;
+            let mut stdin = child.stdin.take().context("Failed to open stdin of ssh")?;
+            stdin.write_all(removed.join("\0").as_bytes())?;
+            drop(stdin);
+            child
+                .wait()?
+                .exit_ok()
+                .context("Failed to remove the old modules")?;
+        }
+        if !changed.is_empty() {
+            let mut tar = Command::new("tar")
+                .arg("-C")
+                .arg(&dir)
+                .arg("-cf")
+                .arg("-")
+                .args(&changed)
+                .stdout(Stdio::piped())
+                .spawn()?;
+            let mut ssh = self.target.ssh_cmd(Some(&["-C"]))?;
+            ssh.arg(format!(
+                "mount -o remount,rw / && mkdir -p /lib/modules/{release} && tar -C \
+                 /lib/modules/{release} -xf -"
+            ))
+            .stdin(
+                tar.stdout
+                    .take()
+                    .context("Failed to get the output of tar")?,
+            );
+            ssh.status()?
+                .exit_ok()
+                .context("Failed to send the modules")?;
+            tar.wait()?
+                .exit_ok()
+                .context("Failed to archive the modules")?;
+        }
+        self.target.run_cmd_stdio(&format!("depmod -a {release}"))?;
+        Ok(changed.len())
+    }
+    /// Build and deploy the kernel. If `ab_update` is true, the kernel is
+    /// written to the inactive kernel partition and tried once on the next
+    /// boot, so that the DUT falls back to the current kernel if it fails.
+    /// Otherwise, the running kernel is overwritten and there is no fallback.
+    pub fn run(&self, ab_update: bool) -> Result<()> {
+        let arch = self.target.get_arch()?;
+        if arch != "x86_64" {
+            bail!("--fast-kernel only supports x86_64 DUTs for now (DUT is {arch})");
+        }
+        let release = self.build()?;
+        info!("Built {release}");
+        if ab_update {
+            ensure_release_changed(&release, self.target.run_cmd_stdio("uname -r")?.trim())?;
+        }
+
+        let disk = self.target.get_rootdisk()?;
+        let (active, inactive) = slots(
+            &self.target.get_rootdev()?,
+            &self.target.get_partnum_info()?,
+        )?;
+        let mut cmdline = self.target.run_cmd_stdio(&format!(
+            "dump_kernel_config {}",
+            partition_device(&disk, active.kern)
+        ))?;
+        let kern = if ab_update {
+            // Keep using the current rootfs, where the modules are sent.
+            let uuid = self
+                .target
+                .run_cmd_stdio(&format!("cgpt show -i {} -u {disk}", active.root))?;
+            cmdline = cmdline.replace(ROOT_RELATIVE_TO_KERNEL, &format!("PARTUUID={uuid}"));
+            inactive.kern
+        } else {
+            active.kern
+        };
+        let image = self.pack(&cmdline)?;
+        let dev = partition_device(&disk, kern);
+        let mut ssh = self.target.ssh_cmd(Some(&["-C"]))?;
+        ssh.arg(format!("dd of={dev} bs=4M conv=fsync status=none"))
+            .stdin(File::open(&image)?);
+        ssh.status()?
+            .exit_ok()
+            .context(format!("Failed to write the kernel to {dev}"))?;
+        if ab_update {
+            self.target.run_cmd_stdio(&format!(
+                "cgpt add -i {kern} -T 1 -S 0 {disk} && cgpt prioritize -i {kern} {disk}"
+            ))?;
+        }
+        info!("Wrote the kernel to {dev}");
+        let changed = self.send_modules(&release)?;
+        info!("Sent {changed} modules");
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn modules() {
+        let dir = TempDir::new("cro3_kernel_test").unwrap();
+        let dir = dir.path();
+        fs::create_dir_all(dir.join("kernel/drivers")).unwrap();
+        fs::write(dir.join("kernel/drivers/a.ko"), "a").unwrap();
+        fs::write(dir.join("kernel/drivers/b.ko.gz"), "b").unwrap();
+        fs::write(dir.join("modules.dep"), "").unwrap();
+        let built = hash_modules(dir).unwrap();
+        assert_eq!(built.len(), 2);
+        let a = built["./kernel/drivers/a.ko"].clone();
+        let on_dut = parse_sha256sum(&format!(
+            "{a}  ./kernel/drivers/a.ko\n0000  ./kernel/drivers/b.ko.gz\n"
+        ));
+        assert_eq!(
+            changed_modules(&built, &on_dut),
+            vec!["./kernel/drivers/b.ko.gz"]
+        );
+        assert!(removed_modules(&built, &on_dut).is_empty());
+        let on_dut = parse_sha256sum(&format!(
+            "{a}  ./kernel/drivers/a.ko
+1111  ./kernel/drivers/old.ko
+"
+        ));
+        assert_eq!(
+            removed_modules(&built, &on_dut),
+            vec!["./kernel/drivers/old.ko"]
+        );
+        assert!(ensure_release_changed("5.15.1-g1234-dirty", "5.15.1-g1234").is_ok());
+        assert!(ensure_release_changed("5.15.1-g1234", "5.15.1-g1234").is_err());
+        assert_eq!(
+            kernel_package_name("chromeos-kernel-5_15"),
+            "sys-kernel/chromeos-kernel-5_15"
+        );
+    }
+}
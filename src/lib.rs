@@ -12,14 +12,35 @@
 #![feature(result_option_inspect)]
 #![feature(assert_matches)]
 
+pub mod ab_update;
 pub mod arc;
+pub mod binpkg_cache;
+pub mod build_cache;
+pub mod build_planner;
+pub mod build_scheduler;
 pub mod cache;
 pub mod chroot;
 pub mod config;
 pub mod cros;
+pub mod download;
 pub mod dut;
+pub mod emerge_progress;
+pub mod flash_progress;
 pub mod google_storage;
+pub mod image;
+pub mod image_cache;
+pub mod kernel;
+pub mod memory_governor;
 pub mod parser;
+pub mod portage;
 pub mod repo;
+pub mod service_restart;
 pub mod servo;
+pub mod snapshot;
+pub mod source_watcher;
+pub mod sync_progress;
+pub mod sync_stats;
+pub mod trace_event;
+pub mod usb_writer;
 pub mod util;
+pub mod version_index;
@@ -0,0 +1,561 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Keeps the memory pressure of the host below a limit during builds.
+//!
+//! emerge can not change its job count while running, so this throttles the
+//! build from outside instead: when the memory pressure (PSI) exceeds the
+//! limit, the emerge processes are stopped (SIGSTOP) so that no new packages
+//! are started while the running ones continue. If that is not enough, the
+//! youngest running packages are stopped as well, one at a time, until the
+//! pressure goes down. Everything is resumed (SIGCONT) as the pressure drops.
+//!
+//! This relies on the processes in the chroot being visible from the host,
+//! which is the case since cro3 enters the chroot with --no-ns-pid. They run
+//! as root, so the signals are sent by a shell started with sudo when the
+//! governor starts, which keeps working after the sudo credentials expire
+//! during a long build.
+
+use std::collections::HashMap;
+use std::fs;
+use std::io::BufRead;
+use std::io::BufReader;
+use std::io::Write;
+use std::path::Path;
+use std::process::Child;
+use std::process::ChildStdin;
+use std::process::ChildStdout;
+use std::process::Command;
+use std::process::Stdio;
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::thread;
+use std::thread::JoinHandle;
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use nix::sys::signal::Signal;
+use signal_hook::consts::SIGINT;
+use tracing::error;
+use tracing::info;
+use tracing::warn;
+
+use crate::util::host_resources::MemoryPressure;
+
+const POLL_INTERVAL: Duration = Duration::from_secs(2);
+/// PSI averages take a while to reflect changes, so wait at least this long
+/// between pausing / resuming packages.
+const MIN_ACTION_INTERVAL: Duration = Duration::from_secs(10);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Action {
+    None,
+    PauseStarts,
+    PauseJob,
+    ResumeJob,
+    ResumeStarts,
+}
+
+#[derive(Debug, Default, Clone, Copy)]
+struct GovernorState {
+    starts_paused: bool,
+    paused_jobs: usize,
+    running_jobs: usize,
+}
+
+/// Decide what to do for the pressure. Resuming starts at the half of the
+/// limit to avoid flapping.
+fn decide(state: &GovernorState, pressure: &MemoryPressure, limit: f64) -> Action {
+    if pressure.some_avg10() > limit {
+        if !state.starts_paused {
+            Action::PauseStarts
+        } else if pressure.full_avg10() > limit / 2.0 && state.running_jobs > 1 {
+            // Keep at least one package running to make progress
+            Action::PauseJob
+        } else {
+            Action::None
+        }
+    } else if pressure.some_avg10() < limit / 2.0 {
+        if state.paused_jobs > 0 {
+            Action::ResumeJob
+        } else if state.starts_paused {
+            Action::ResumeStarts
+        } else {
+            Action::None
+        }
+    } else {
+        Action::None
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+struct Process {
+    pid: i32,
+    ppid: i32,
+    start_time: u64,
+    cmdline: Vec<String>,
+}
+
+/// Returns (ppid, starttime) from the contents of /proc/${PID}/stat
+fn parse_stat(stat: &str) -> Option<(i32, u64)> {
+    // The command name (2nd field) can contain spaces and parens
+    let fields: Vec<&str> = stat
+        .get(stat.rfind(')')? + 1..)?
+        .split_whitespace()
+        .collect();
+    Some((fields.get(1)?.parse().ok()?, fields.get(19)?.parse().ok()?))
+}
+
+fn list_processes() -> Vec<Process> {
+    let Ok(entries) = fs::read_dir("/proc") else {
+        return Vec::new();
+    };
+    entries
+        .filter_map(|e| {
+            let pid: i32 = e.ok()?.file_name().to_str()?.parse().ok()?;
+            let dir = Path::new("/proc").join(pid.to_string());
+            let (ppid, start_time) = parse_stat(&fs::read_to_string(dir.join("stat")).ok()?)?;
+            let cmdline = fs::read(dir.join("cmdline")).ok()?;
+            let cmdline = cmdline
+                .split(|b| *b == 0)
+                .filter(|arg| !arg.is_empty())
+                .map(|arg| String::from_utf8_lossy(arg).to_string())
+                .collect();
+            Some(Process {
+                pid,
+                ppid,
+                start_time,
+                cmdline,
+            })
+        })
+        .collect()
+}
+
+fn is_emerge(p: &Process) -> bool {
+    p.cmdline.iter().take(2).any(|arg| {
+        let name = arg.rsplit('/').next().unwrap_or(arg);
+        name == "emerge" || name == "parallel_emerge"
+    })
+}
+
+fn is_ebuild(p: &Process) -> bool {
+    p.cmdline
+        .iter()
+        .take(2)
+        .any(|arg| arg.ends_with("/ebuild.sh"))
+}
+
+/// Snapshot of the process tree
+struct ProcessTree {
+    processes: HashMap<i32, Process>,
+}
+impl ProcessTree {
+    fn new(processes: Vec<Process>) -> Self {
+        Self {
+            processes: processes.into_iter().map(|p| (p.pid, p)).collect(),
+        }
+    }
+    fn ancestors(&self, pid: i32) -> impl Iterator<Item = &Process> {
+        let mut current = self.processes.get(&pid).map(|p| p.ppid);
+        std::iter::from_fn(move || {
+            let p = self.processes.get(&current?)?;
+            current = (p.ppid != p.pid).then_some(p.ppid);
+            Some(p)
+        })
+    }
+    fn is_descendant_of(&self, pid: i32, ancestor: i32) -> bool {
+        self.ancestors(pid).any(|p| p.pid == ancestor)
+    }
+    /// emerge processes started by `root`
+    fn emerge_processes(&self, root: i32) -> Vec<i32> {
+        self.processes
+            .values()
+            .filter(|p| is_emerge(p) && self.is_descendant_of(p.pid, root))
+            .map(|p| p.pid)
+            .collect()
+    }
+    /// Packages being built under `root`, as the pids of the top-level
+    /// ebuild.sh processes sorted from the youngest.
+    fn jobs(&self, root: i32) -> Vec<i32> {
+        let mut jobs: Vec<&Process> = self
+            .processes
+            .values()
+            .filter(|p| {
+                is_ebuild(p)
+                    && self.is_descendant_of(p.pid, root)
+                    && !self.ancestors(p.pid).any(is_ebuild)
+            })
+            .collect();
+        jobs.sort_by_key(|p| std::cmp::Reverse((p.start_time, p.pid)));
+        jobs.iter().map(|p| p.pid).collect()
+    }
+    /// `pid` and all its descendants
+    fn subtree(&self, pid: i32) -> Vec<i32> {
+        let mut pids = vec![pid];
+        pids.extend(
+            self.processes
+                .keys()
+                .filter(|p| self.is_descendant_of(**p, pid)),
+        );
+        pids
+    }
+}
+
+/// Marks the end of the output for a request to [Signaller]
+const SIGNALLER_DONE: &str = "cro3-signaller-done";
+
+/// Returns the errors in the output of `kill`, except the ones for the
+/// processes which have exited already.
+fn kill_errors(output: &[String]) -> Vec<&str> {
+    output
+        .iter()
+        .map(String::as_str)
+        .filter(|line| !line.is_empty() && !line.contains("No such process"))
+        .collect()
+}
+
+/// Signaller sends signals to the processes as root, through a shell started
+/// with sudo.
+struct Signaller {
+    child: Child,
+    stdin: Option<ChildStdin>,
+    stdout: BufReader<ChildStdout>,
+}
+impl Signaller {
+    fn start() -> Result<Self> {
+        let mut child = Command::new("sudo")
+            .args([
+                "-n",
+                "sh",
+                "-c",
+                &format!(
+                    "echo ready; while read -r sig pids; do kill -s \"$sig\" $pids 2>&1; echo \
+                     {SIGNALLER_DONE}; done"
+                ),
+            ])
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .stderr(Stdio::null())
+            .spawn()
+            .context("Failed to run sudo")?;
+        let stdin = child.stdin.take().context("Failed to open stdin of sudo")?;
+        let stdout = child
+            .stdout
+            .take()
+            .context("Failed to open stdout of sudo")?;
+        let mut signaller = Self {
+            child,
+            stdin: Some(stdin),
+            stdout: BufReader::new(stdout),
+        };
+        let mut line = String::new();
+        signaller.stdout.read_line(&mut line)?;
+        if line.trim() != "ready" {
+            bail!("Failed to get the root privilege to send signals (sudo -n failed)");
+        }
+        Ok(signaller)
+    }
+    /// Sends the signal to the processes. Processes which have exited
+    /// already are ignored.
+    fn send(&mut self, pids: &[i32], signal: Signal) -> Result<()> {
+        if pids.is_empty() {
+            return Ok(());
+        }
+        let pids: Vec<String> = pids.iter().map(i32::to_string).collect();
+        let stdin = self.stdin.as_mut().context("The signaller is closed")?;
+        writeln!(
+            stdin,
+            "{} {}",
+            signal.as_str().trim_start_matches("SIG"),
+            pids.join(" ")
+        )?;
+        stdin.flush()?;
+        let mut output = Vec::new();
+        loop {
+            let mut line = String::new();
+            if self.stdout.read_line(&mut line)? == 0 {
+                bail!("The signaller exited unexpectedly");
+            }
+            let line = line.trim_end();
+            if line == SIGNALLER_DONE {
+                break;
+            }
+            output.push(line.to_string());
+        }
+        let errors = kill_errors(&output);
+        if !errors.is_empty() {
+            bail!("Failed to send {signal}: {}", errors.join(", "));
+        }
+        Ok(())
+    }
+}
+impl Drop for Signaller {
+    fn drop(&mut self) {
+        // Closing stdin ends the loop of the shell
+        self.stdin.take();
+        let _ = self.child.wait();
+    }
+}
+
+struct Governor {
+    limit: f64,
+    root: i32,
+    signaller: Signaller,
+    paused_starts: Vec<i32>,
+    paused_jobs: Vec<Vec<i32>>,
+    last_action: Option<Instant>,
+}
+impl Governor {
+    fn tick(&mut self, pressure: &MemoryPressure) {
+        let tree = ProcessTree::new(list_processes());
+        let jobs: Vec<i32> = tree
+            .jobs(self.root)
+            .into_iter()
+            .filter(|pid| !self.paused_jobs.iter().any(|paused| paused[0] == *pid))
+            .collect();
+        let state = GovernorState {
+            starts_paused: !self.paused_starts.is_empty(),
+            paused_jobs: self.paused_jobs.len(),
+            running_jobs: jobs.len(),
+        };
+        let action = decide(&state, pressure, self.limit);
+        let rate_limited = self
+            .last_action
+            .is_some_and(|t| t.elapsed() < MIN_ACTION_INTERVAL);
+        if action == Action::None || (action != Action::PauseStarts && rate_limited) {
+            return;
+        }
+        match action {
+            Action::PauseStarts => {
+                self.paused_starts = tree.emerge_processes(self.root);
+                if self.paused_starts.is_empty() {
+                    return;
+                }
+                warn!(
+                    "Memory pressure is {:.1}% (> {:.1}%): not starting new packages",
+                    pressure.some_avg10(),
+                    self.limit
+                );
+                if let Err(e) = self.signaller.send(&self.paused_starts, Signal::SIGSTOP) {
+                    warn!("Failed to pause emerge: {e:#}");
+                    // Some of them may have been stopped
+                    let paused = std::mem::take(&mut self.paused_starts);
+                    self.resume(&paused);
+                }
+            }
+            Action::PauseJob => {
+                let pids = tree.subtree(jobs[0]);
+                warn!(
+                    "Memory pressure is still {:.1}%: pausing a package ({} processes)",
+                    pressure.some_avg10(),
+                    pids.len()
+                );
+                match self.signaller.send(&pids, Signal::SIGSTOP) {
+                    Ok(()) => self.paused_jobs.push(pids),
+                    Err(e) => {
+                        warn!("Failed to pause a package: {e:#}");
+                        self.resume(&pids);
+                    }
+                }
+            }
+            Action::ResumeJob => {
+                let pids = self.paused_jobs.remove(0);
+                info!("Memory pressure went down: resuming a package");
+                self.resume(&pids);
+            }
+            Action::ResumeStarts => {
+                info!("Memory pressure went down: starting new packages again");
+                let paused = std::mem::take(&mut self.paused_starts);
+                self.resume(&paused);
+            }
+            Action::None => {}
+        }
+        self.last_action = Some(Instant::now());
+    }
+    fn resume(&mut self, pids: &[i32]) {
+        if let Err(e) = self.signaller.send(pids, Signal::SIGCONT) {
+            error!("Failed to resume processes {pids:?}: {e:#}");
+        }
+    }
+    fn resume_all(&mut self) {
+        for pids in std::mem::take(&mut self.paused_jobs) {
+            self.resume(&pids);
+        }
+        let paused = std::mem::take(&mut self.paused_starts);
+        self.resume(&paused);
+    }
+}
+
+/// MemoryGovernor throttles the builds started by this process while it is
+/// alive.
+pub struct MemoryGovernor {
+    stop: Arc<AtomicBool>,
+    handle: Option<JoinHandle<()>>,
+}
+impl MemoryGovernor {
+    /// Start throttling builds when the memory pressure ("some" avg10 of
+    /// PSI, in percent) exceeds `limit`.
+    pub fn start(limit: f64) -> Result<Self> {
+        // Fail early if PSI is not available
+        MemoryPressure::read()?;
+        let stop = Arc::new(AtomicBool::new(false));
+        // Resume everything on Ctrl-C, otherwise the stopped processes would
+        // keep the build script from exiting.
+        signal_hook::flag::register(SIGINT, Arc::clone(&stop))?;
+        let mut governor = Governor {
+            limit,
+            root: std::process::id() as i32,
+            signaller: Signaller::start()?,
+            paused_starts: Vec::new(),
+            paused_jobs: Vec::new(),
+            last_action: None,
+        };
+        let stop_flag = Arc::clone(&stop);
+        let handle = thread::spawn(move || {
+            while !stop_flag.load(Ordering::Relaxed) {
+                match MemoryPressure::read() {
+                    Ok(pressure) => governor.tick(&pressure),
+                    Err(e) => warn!("{e:#}"),
+                }
+                thread::sleep(POLL_INTERVAL);
+            }
+            governor.resume_all();
+        });
+        info!("Keeping the memory pressure below {limit:.1}%");
+        Ok(Self {
+            stop,
+            handle: Some(handle),
+        })
+    }
+}
+impl Drop for MemoryGovernor {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(handle) = self.handle.take() {
+            let _ = handle.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pressure(some: f64, full: f64) -> MemoryPressure {
+        MemoryPressure::parse(&format!(
+            "some avg10={some} avg60=0 avg300=0 total=0\nfull avg10={full} avg60=0 avg300=0 \
+             total=0\n"
+        ))
+        .unwrap()
+    }
+
+    #[test]
+    fn decisions() {
+        let mut state = GovernorState {
+            running_jobs: 3,
+            ..Default::default()
+        };
+        assert_eq!(decide(&state, &pressure(5.0, 0.0), 20.0), Action::None);
+        assert_eq!(
+            decide(&state, &pressure(25.0, 5.0), 20.0),
+            Action::PauseStarts
+        );
+        state.starts_paused = true;
+        assert_eq!(decide(&state, &pressure(25.0, 5.0), 20.0), Action::None);
+        assert_eq!(
+            decide(&state, &pressure(25.0, 15.0), 20.0),
+            Action::PauseJob
+        );
+        state.running_jobs = 1;
+        assert_eq!(decide(&state, &pressure(25.0, 15.0), 20.0), Action::None);
+        state.paused_jobs = 1;
+        assert_eq!(decide(&state, &pressure(15.0, 0.0), 20.0), Action::None);
+        assert_eq!(decide(&state, &pressure(5.0, 0.0), 20.0), Action::ResumeJob);
+        state.paused_jobs = 0;
+        assert_eq!(
+            decide(&state, &pressure(5.0, 0.0), 20.0),
+            Action::ResumeStarts
+        );
+    }
+
+    #[test]
+    fn kill_output() {
+        let output = [
+            "sh: 1: kill: No such process".to_string(),
+            String::new(),
+            "sh: 1: kill: Operation not permitted".to_string(),
+        ];
+        assert_eq!(
+            kill_errors(&output),
+            vec!["sh: 1: kill: Operation not permitted"]
+        );
+        assert!(kill_errors(&output[..2]).is_empty());
+    }
+
+    #[test]
+    fn stat() {
+        let stat = "1234 (python3 (x) y) S 1000 1234 1234 0 -1 4194560 100 0 0 0 1 2 0 0 20 0 1 0 \
+                    98765 1000000 100 18446744073709551615";
+        assert_eq!(parse_stat(stat), Some((1000, 98765)));
+        assert_eq!(parse_stat("1234 (bash"), None);
+    }
+
+    #[test]
+    fn process_tree() {
+        let p = |pid, ppid, start_time, cmdline: &str| Process {
+            pid,
+            ppid,
+            start_time,
+            cmdline: cmdline.split(' ').map(str::to_string).collect(),
+        };
+        let tree = ProcessTree::new(vec![
+            p(1, 1, 0, "/sbin/init"),
+            p(10, 1, 1, "cro3 build"),
+            p(
+                11,
+                10,
+                2,
+                "cros_sdk --no-ns-pid -- bash -xe /cro3/tmp/build.sh",
+            ),
+            p(12, 11, 3, "/usr/bin/python3 /usr/bin/emerge --board=brya"),
+            p(
+                13,
+                12,
+                4,
+                "/bin/bash /usr/lib/portage/python3.8/ebuild.sh compile",
+            ),
+            p(
+                14,
+                13,
+                5,
+                "/bin/bash /usr/lib/portage/python3.8/ebuild.sh compile",
+            ),
+            p(15, 14, 6, "clang++ -c foo.cc"),
+            p(
+                16,
+                12,
+                7,
+                "/bin/bash /usr/lib/portage/python3.8/ebuild.sh install",
+            ),
+            p(20, 1, 8, "/usr/bin/python3 /usr/bin/emerge --sync"),
+            p(
+                21,
+                20,
+                9,
+                "/bin/bash /usr/lib/portage/python3.8/ebuild.sh compile",
+            ),
+        ]);
+        assert_eq!(tree.emerge_processes(10), vec![12]);
+        assert_eq!(tree.jobs(10), vec![16, 13]);
+        let mut subtree = tree.subtree(13);
+        subtree.sort();
+        assert_eq!(subtree, vec![13, 14, 15]);
+    }
+}
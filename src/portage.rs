@@ -0,0 +1,243 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Reads the installed package database (vdb) of portage.
+
+use std::collections::HashSet;
+use std::io::Write;
+use std::process::Stdio;
+use std::thread;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+
+use crate::chroot::Chroot;
+use crate::dut::SshInfo;
+
+/// Marks the beginning of the CONTENTS of a package in the query output
+const PACKAGE_HEADER: &str = "### cro3 package: ";
+/// Files that are installed in the sysroot but not on the DUTs
+/// (INSTALL_MASK of ChromiumOS images)
+const MASKED_PATHS: [&str; 6] = [
+    "/usr/include/",
+    "/usr/share/doc/",
+    "/usr/share/man/",
+    "/usr/share/info/",
+    "/usr/lib/debug/",
+    "/pkgconfig/",
+];
+const MASKED_SUFFIXES: [&str; 2] = [".a", ".la"];
+
+/// ContentsEntry is a line of the CONTENTS file of an installed package
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum ContentsEntry {
+    Dir { path: String },
+    Obj { path: String, md5: String },
+    Sym { path: String, target: String },
+}
+impl ContentsEntry {
+    pub fn path(&self) -> &str {
+        match self {
+            Self::Dir { path } | Self::Obj { path, .. } | Self::Sym { path, .. } => path,
+        }
+    }
+    /// Parse a line of CONTENTS. Paths may contain spaces, so the fields are
+    /// taken from the end of the line.
+    fn parse(line: &str) -> Option<Self> {
+        let (kind, rest) = line.split_once(' ')?;
+        match kind {
+            "dir" => Some(Self::Dir {
+                path: rest.to_string(),
+            }),
+            "obj" => {
+                // obj <path> <md5> <mtime>
+                let (rest, _mtime) = rest.rsplit_once(' ')?;
+                let (path, md5) = rest.rsplit_once(' ')?;
+                Some(Self::Obj {
+                    path: path.to_string(),
+                    md5: md5.to_string(),
+                })
+            }
+            "sym" => {
+                // sym <path> -> <target> <mtime>
+                let (rest, _mtime) = rest.rsplit_once(' ')?;
+                let (path, target) = rest.split_once(" -> ")?;
+                Some(Self::Sym {
+                    path: path.to_string(),
+                    target: target.to_string(),
+                })
+            }
+            _ => None,
+        }
+    }
+}
+
+/// InstalledPackage is a package installed in a board sysroot
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct InstalledPackage {
+    cpv: String,
+    contents: Vec<ContentsEntry>,
+}
+impl InstalledPackage {
+    /// Query the packages matching the atoms (e.g. "shill",
+    /// "chromeos-base/shill") installed in the sysroot of the board.
+    pub fn query(chroot: &Chroot, board: &str, atoms: &[String]) -> Result<Vec<Self>> {
+        let script = atoms
+            .iter()
+            .map(|atom| {
+                format!(
+                    "for cpv in $(portageq-{board} match /build/{board} {atom}); do echo \
+                     \"{PACKAGE_HEADER}$cpv\"; cat /build/{board}/var/db/pkg/$cpv/CONTENTS; done"
+                )
+            })
+            .collect::<Vec<_>>()
+            .join("; ");
+        let output = chroot.exec_in_chroot(&["bash", "-c", &script])?;
+        let packages = Self::parse(&output);
+        if packages.len() < atoms.len() {
+            bail!("Some of {atoms:?} are not installed for {board}");
+        }
+        Ok(packages)
+    }
+    pub(crate) fn parse(output: &str) -> Vec<Self> {
+        let mut packages: Vec<Self> = Vec::new();
+        for line in output.lines() {
+            if let Some(cpv) = line.strip_prefix(PACKAGE_HEADER) {
+                packages.push(Self {
+                    cpv: cpv.trim().to_string(),
+                    contents: Vec::new(),
+                });
+            } else if let (Some(package), Some(entry)) =
+                (packages.last_mut(), ContentsEntry::parse(line))
+            {
+                package.contents.push(entry);
+            }
+        }
+        packages
+    }
+    pub fn cpv(&self) -> &str {
+        &self.cpv
+    }
+    pub fn category(&self) -> &str {
+        self.cpv.split('/').next().unwrap_or_default()
+    }
+    pub fn contents(&self) -> &[ContentsEntry] {
+        &self.contents
+    }
+    /// Returns true if none of the files is in `changed` (the result of
+    /// [changed_on_dut]).
+    pub fn is_identical(&self, changed: &HashSet<String>) -> bool {
+        self.contents.iter().all(|e| !changed.contains(e.path()))
+    }
+    /// Returns the regular files expected to be on the DUT, as "md5  path"
+    /// lines that can be verified with `md5sum -c`.
+    fn md5sum_list(&self) -> String {
+        self.contents
+            .iter()
+            .filter_map(|e| match e {
+                ContentsEntry::Obj { path, md5 }
+                    if !MASKED_PATHS.iter().any(|p| path.contains(p))
+                        && !MASKED_SUFFIXES.iter().any(|s| path.ends_with(s)) =>
+                {
+                    Some(format!("{md5}  {path}\n"))
+                }
+                _ => None,
+            })
+            .collect()
+    }
+}
+
+/// Returns the paths which failed in the output of `md5sum -c`.
+fn parse_md5sum_failures(output: &str) -> HashSet<&str> {
+    output
+        .lines()
+        .filter_map(|line| {
+            let line = line.strip_prefix("md5sum: ").unwrap_or(line);
+            let (path, result) = line.rsplit_once(": ")?;
+            (result != "OK").then_some(path)
+        })
+        .collect()
+}
+
+/// Returns the files of the packages which are missing or differ on the DUT.
+pub fn changed_on_dut(target: &SshInfo, packages: &[InstalledPackage]) -> Result<HashSet<String>> {
+    let list: String = packages.iter().map(|p| p.md5sum_list()).collect();
+    let mut ssh = target.ssh_cmd(None)?;
+    ssh.arg("md5sum -c --quiet - 2>&1; true")
+        .stdin(Stdio::piped())
+        .stdout(Stdio::piped());
+    let mut child = ssh.spawn()?;
+    let mut stdin = child.stdin.take().context("Failed to open stdin of ssh")?;
+    // Write the list in another thread since the output can be large enough
+    // to block md5sum before it reads all the list.
+    let writer = thread::spawn(move || stdin.write_all(list.as_bytes()));
+    let output = child.wait_with_output()?;
+    writer
+        .join()
+        .map_err(|_| anyhow!("Failed to send the file list"))??;
+    output
+        .status
+        .exit_ok()
+        .context("Failed to check the files on the DUT")?;
+    let output = String::from_utf8_lossy(&output.stdout);
+    Ok(parse_md5sum_failures(&output)
+        .into_iter()
+        .map(str::to_string)
+        .collect())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn contents() {
+        let packages = InstalledPackage::parse(
+            "### cro3 package: chromeos-base/shill-0.0.1-r4567\ndir /usr/bin\nobj /usr/bin/shill \
+             0123456789abcdef0123456789abcdef 1700000000\nobj /etc/init/shill.conf \
+             fedcba9876543210fedcba9876543210 1700000000\nsym /usr/lib/libshill.so -> \
+             libshill.so.1 1700000000\nobj /usr/share/a file with spaces \
+             00000000000000000000000000000000 1700000000\n### cro3 package: \
+             chromeos-base/patchpanel-0.0.1-r1\n",
+        );
+        assert_eq!(packages.len(), 2);
+        assert_eq!(packages[0].category(), "chromeos-base");
+        let contents = packages[0].contents();
+        assert_eq!(contents.len(), 5);
+        assert_eq!(
+            contents[1],
+            ContentsEntry::Obj {
+                path: "/usr/bin/shill".to_string(),
+                md5: "0123456789abcdef0123456789abcdef".to_string()
+            }
+        );
+        assert_eq!(
+            contents[3],
+            ContentsEntry::Sym {
+                path: "/usr/lib/libshill.so".to_string(),
+                target: "libshill.so.1".to_string()
+            }
+        );
+        assert_eq!(contents[4].path(), "/usr/share/a file with spaces");
+        assert!(packages[1].contents().is_empty());
+        assert_eq!(
+            packages[0].md5sum_list().lines().next(),
+            Some("0123456789abcdef0123456789abcdef  /usr/bin/shill")
+        );
+    }
+
+    #[test]
+    fn md5sum_failures() {
+        let failures = parse_md5sum_failures(
+            "/usr/bin/shill: FAILED\nmd5sum: /etc/init/shill.conf: No such file or              directory\n/etc/init/shill.conf: FAILED open or read\nmd5sum: WARNING: 1 computed              checksum did NOT match\n",
+        );
+        assert!(failures.contains("/usr/bin/shill"));
+        assert!(failures.contains("/etc/init/shill.conf"));
+        assert!(!failures.contains("/usr/bin/patchpanel"));
+    }
+}
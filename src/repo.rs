@@ -4,30 +4,54 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+use std::collections::BTreeMap;
+use std::collections::HashMap;
 use std::env;
-use std::io::BufRead;
+use std::fs;
+use std::fs::File;
 use std::io::BufReader;
+use std::io::ErrorKind;
 use std::io::Read;
+use std::io::Write;
+use std::path::Path;
 use std::path::PathBuf;
-use std::process::exit;
 use std::process::Command;
 use std::process::Stdio;
+use std::thread;
+use std::time::Duration;
 
 use anyhow::anyhow;
 use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
-use indicatif::ProgressBar;
-use indicatif::ProgressStyle;
-use regex::Regex;
 use regex_macro::regex;
 use tracing::error;
 use tracing::info;
+use tracing::warn;
 
 use crate::config::Config;
+use crate::sync_progress::is_corruption_error;
+use crate::sync_progress::SyncEvent;
+use crate::sync_progress::SyncOutputParser;
+use crate::sync_progress::SyncProgressBar;
+use crate::sync_stats::fill_bytes;
+use crate::sync_stats::merge_timings;
+use crate::sync_stats::pack_sizes;
+use crate::sync_stats::parse_event_log;
+use crate::sync_stats::record_sync;
+use crate::sync_stats::report;
+use crate::sync_stats::sync_history;
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
 use crate::util::shell_helpers::get_stdout;
 use crate::util::shell_helpers::run_bash_command;
 
+/// Number of times to retry the projects which failed to sync
+const SYNC_RETRIES: u32 = 3;
+/// Delay before the first retry, doubled for each retry
+const SYNC_RETRY_DELAY: Duration = Duration::from_secs(5);
+/// Max jobs for retries. Failures are often caused by an overloaded server.
+const SYNC_RETRY_JOBS: usize = 4;
+
 /// This tries to get ChromeOS checkout directory in the following order
 /// 1. user specified directory via a given command line argument
 /// 2. CROS_DIR environmental variables
@@ -90,138 +114,312 @@ pub fn get_reference_repo(reference: &Option<String>) -> Result<Option<String>>
     }
 }
 
-pub fn repo_sync(repo: &str, force: bool, verbose: bool) -> Result<()> {
-    let mut last_failed_repos = None;
-
-    loop {
-        info!("Running repo sync...");
-        let repo_sync = format!("repo sync -j{}", &num_cpus::get());
-
-        // `script` is a Unix command that takes a copy of all output to the terminal
-        // and writes it to `typescript` file.
-        // Below, explanation of `script` options.
-        // -q Be quiet (do not write start and done messages to standard output).
-        // -e Return the exit status of the child process.
-        // -f Flush output after each write.
-        // -c Run the command rather than an interactive shell. This makes it easy for a
-        // script to capture the output of a program that behaves differently when its
-        // stdout is not a tty.
-        let mut cmd = Command::new("script")
-            .current_dir(repo)
-            .stdout(Stdio::piped())
-            .stderr(Stdio::piped())
-            .args(["-qefc", &repo_sync])
-            .spawn()
-            .context("Failed to execute repo sync")?;
-
-        if !verbose {
-            // Show progress bar.
-            let buf_reader = BufReader::new(
-                cmd.stdout
-                    .take()
-                    .context("Failed to get stdout from script output")?,
-            );
-
-            draw_progress_bar(buf_reader).context("Failed to draw progress bar")?;
-        } else {
-            // Print stdout directly.
-            let child_stdout = cmd
-                .stdout
-                .take()
-                .context("Failed to get stdout from script output")?;
-
-            forward_to_std_out(child_stdout).context("Failed to forward to stdout")?;
+/// Result of a run of repo sync
+#[derive(Debug, Default)]
+struct SyncRun {
+    success: bool,
+    failing_repos: Vec<String>,
+    errors: Vec<String>,
+}
+impl SyncRun {
+    fn handle(&mut self, event: SyncEvent) {
+        match event {
+            SyncEvent::FailingRepo { path } => {
+                if !self.failing_repos.contains(&path) {
+                    self.failing_repos.push(path)
+                }
+            }
+            SyncEvent::Error { message } => self.errors.push(message),
+            SyncEvent::Progress { .. } => {}
         }
+    }
+}
 
-        let result = cmd
-            .wait_with_output()
-            .context("Failed to wait for repo sync")?;
-        if !result.status.success() {
-            error!("repo sync failed.");
-            let stderr = String::from_utf8_lossy(&result.stderr)
-                .to_string()
-                .trim()
-                .to_string();
-            let it = stderr
-                .split('\n')
-                .skip_while(|e| !e.contains("Failing repos:"));
-            let repos: Vec<String> = it.map(|e| e.to_string()).collect();
-            if repos.is_empty() {
-                error!("{stderr}");
-                bail!("repo sync failed (please check the above message)");
-            }
-            let repos = repos[1..=repos.len() - 2].to_owned();
-            info!("Failed repos: {:?}", &repos);
+pub fn repo_sync(repo: &str, force: bool, verbose: bool) -> Result<()> {
+    let log_path = gen_path_in_cro3_dir("repo_sync.log")?;
+    let mut log = File::create(&log_path).context("Failed to create the log of repo sync")?;
+    // repo rewrites its event log on each run, so each attempt has its own
+    let event_logs = (0..=SYNC_RETRIES)
+        .map(|attempt| gen_path_in_cro3_dir(&format!("repo_sync_events.{attempt}.json")))
+        .collect::<Result<Vec<_>>>()?;
+    for event_log in &event_logs {
+        let _ = fs::remove_file(event_log);
+    }
+    let packs_before = pack_sizes(repo);
+
+    info!("Running repo sync...");
+    let mut run = run_repo_sync(
+        repo,
+        &[format!("-j{}", &num_cpus::get())],
+        verbose,
+        &mut log,
+        &event_logs[0],
+    )?;
+    // Retry only the projects which failed, instead of walking the whole
+    // tree again.
+    for attempt in 1..=SYNC_RETRIES {
+        if run.success {
+            break;
+        }
+        error!("repo sync failed. The log is at {log_path:?}");
+        if run.failing_repos.is_empty() {
+            bail!("repo sync failed (please check the above message)");
+        }
+        let failed = std::mem::take(&mut run.failing_repos);
+        info!("Failed repos: {:?}", &failed);
+        let names = project_names(repo, &failed).unwrap_or_else(|e| {
+            warn!("Failed to get the project names: {e:#}");
+            HashMap::new()
+        });
+        let corrupted: Vec<&String> = failed
+            .iter()
+            .filter(|path| is_corrupted(path, names.get(*path), &run.errors))
+            .collect();
+        if !corrupted.is_empty() {
             if !force {
-                break;
-            }
-            if Some(&repos) == last_failed_repos.as_ref() {
-                error!("Repo is failing with the same set of the repos, aborting...");
-                exit(1);
+                bail!(
+                    "{corrupted:?} seem to be corrupted. Please run again with --force to \
+                     re-clone them"
+                );
             }
-            for dir in &repos {
-                let cmd = Command::new("rm")
-                    .current_dir(repo)
-                    .args(["-rf", dir])
-                    .spawn()
-                    .context("Failed to execute rm")?;
-                let result = cmd.wait_with_output().context("Failed to wait for rm")?;
-                if result.status.success() {
-                    info!("repo {} was deleted", dir);
-                } else {
-                    bail!("rm exited with {:?}", result.status);
-                }
+            for path in corrupted {
+                let name = names
+                    .get(path)
+                    .context(format!("Failed to find the project name of {path}"))?;
+                remove_project(repo, path, name)?;
+                info!("repo {} was deleted", path);
             }
-            last_failed_repos = Some(repos.to_owned());
-            continue;
         }
-        break;
+        let delay = SYNC_RETRY_DELAY * (1 << (attempt - 1));
+        warn!(
+            "Retrying {} projects in {delay:?} (attempt {attempt}/{SYNC_RETRIES})...",
+            failed.len()
+        );
+        thread::sleep(delay);
+        let mut args = vec![format!("-j{}", failed.len().min(SYNC_RETRY_JOBS))];
+        args.extend(
+            failed
+                .iter()
+                .map(|p| format!("'{}'", p.replace('\'', "'\\''"))),
+        );
+        run = run_repo_sync(
+            repo,
+            &args,
+            verbose,
+            &mut log,
+            &event_logs[attempt as usize],
+        )?;
+    }
+    if let Err(e) = record_sync_stats(repo, &event_logs, &packs_before) {
+        warn!("Failed to record the timings of repo sync: {e:#}");
+    }
+    if !run.success {
+        bail!(
+            "repo sync failed {SYNC_RETRIES} times. Failing repos: {:?}",
+            run.failing_repos
+        );
     }
     info!("repo sync done!");
     Ok(())
 }
 
-fn forward_to_std_out(r: impl Read) -> Result<()> {
-    let mut buffer = [0; 1];
-
-    for a_byte in r.bytes() {
-        buffer[0] = a_byte?;
-        let char = std::str::from_utf8(&buffer)?;
-        print!("{}", char);
+/// Save the per-project timings of the sync, summed over the attempts, and
+/// show the slowest ones.
+fn record_sync_stats(
+    repo: &str,
+    event_logs: &[PathBuf],
+    packs_before: &HashMap<String, u64>,
+) -> Result<()> {
+    let mut projects = BTreeMap::new();
+    // The logs of the attempts which did not run do not exist
+    for event_log in event_logs.iter().filter(|p| p.exists()) {
+        let log = fs::read_to_string(event_log).context(format!(
+            "Failed to read the event log of repo {event_log:?}"
+        ))?;
+        merge_timings(&mut projects, parse_event_log(&log));
     }
-
+    fill_bytes(&mut projects, packs_before, &pack_sizes(repo));
+    record_sync(repo, projects)?;
+    println!("{}", report(&sync_history(repo)?, 5));
     Ok(())
 }
 
-fn draw_progress_bar(r: impl BufRead) -> Result<()> {
-    let split_iter = r
-        .split(b'\r')
-        .map(|l| String::from_utf8_lossy(&l.unwrap()).to_string());
-
-    let re = Regex::new(
-        r"(?P<title>Finding sources|Fetching|Checking out):\s{1,3}(?P<percent>\d{1,3})%\s\((?P<done>\d+)\/(?P<total>\d+)\)",
-    )?;
+/// Returns the project names (e.g. chromiumos/platform2) of the paths in the
+/// checkout, with `repo list`.
+fn project_names(repo: &str, paths: &[String]) -> Result<HashMap<String, String>> {
+    let output = Command::new("repo")
+        .current_dir(repo)
+        .arg("list")
+        .args(paths)
+        .output()
+        .context("Failed to run repo list")?;
+    output.status.exit_ok().context(format!(
+        "repo list failed: {}",
+        String::from_utf8_lossy(&output.stderr).trim()
+    ))?;
+    Ok(parse_repo_list(&String::from_utf8_lossy(&output.stdout)))
+}
 
-    let bar = ProgressBar::new(0);
-    bar.set_style(ProgressStyle::with_template(
-        "{msg:>15} {wide_bar} {pos:>4}/{len:4}",
-    )?);
+/// Parse the lines of `repo list`, which are "path : name".
+fn parse_repo_list(output: &str) -> HashMap<String, String> {
+    output
+        .lines()
+        .filter_map(|line| line.split_once(" : "))
+        .map(|(path, name)| (path.trim().to_string(), name.trim().to_string()))
+        .collect()
+}
 
-    for a_line in split_iter {
-        if let Some(caps) = re.captures(&a_line) {
-            let done = caps["done"].parse::<u64>()?;
-            let total = caps["total"].parse::<u64>()?;
+/// Returns true if `message` mentions `s` as a whole path, not as a part of
+/// another one (e.g. src/platform/foo in src/platform/foo-bar).
+fn mentions(message: &str, s: &str) -> bool {
+    let is_path_char = |c: char| c.is_ascii_alphanumeric() || "_-./".contains(c);
+    !s.is_empty()
+        && message.match_indices(s).any(|(i, _)| {
+            let after = &message[i + s.len()..];
+            let after = after.strip_prefix(".git").unwrap_or(after);
+            let after = after.strip_prefix('/').unwrap_or(after);
+            !message[..i].ends_with(is_path_char) && !after.starts_with(is_path_char)
+        })
+}
 
-            bar.set_message(caps["title"].to_string());
-            bar.set_position(done);
-            bar.set_length(total);
+/// Returns true if the errors about the project at `path` indicate that its
+/// git objects are broken, which a retry of the fetch can not fix.
+fn is_corrupted(path: &str, name: Option<&String>, errors: &[String]) -> bool {
+    let path = path.trim_end_matches('/');
+    errors
+        .iter()
+        .filter(|e| mentions(e, path) || name.is_some_and(|name| mentions(e, name)))
+        .any(|e| is_corruption_error(e))
+}
 
-            if done == total {
-                bar.finish_with_message("Finished");
+/// Remove the worktree and the git dirs of a project, so that the next sync
+/// clones it again.
+fn remove_project(repo: &str, path: &str, name: &str) -> Result<()> {
+    let repo = Path::new(repo);
+    let path = path.trim_end_matches('/');
+    for dir in [
+        repo.join(path),
+        repo.join(format!(".repo/projects/{path}.git")),
+        repo.join(format!(".repo/project-objects/{name}.git")),
+    ] {
+        match fs::remove_dir_all(&dir) {
+            Err(e) if e.kind() != ErrorKind::NotFound => {
+                return Err(e).context(format!("Failed to remove {dir:?}"));
             }
+            _ => {}
         }
     }
+    Ok(())
+}
+
+/// Run `repo sync` with `args` and collect the result. The output is
+/// appended to `log`.
+fn run_repo_sync(
+    repo: &str,
+    args: &[String],
+    verbose: bool,
+    log: &mut File,
+    event_log: &Path,
+) -> Result<SyncRun> {
+    let repo_sync = format!(
+        "repo --event-log '{}' sync {}",
+        event_log.display(),
+        args.join(" ")
+    );
+
+    // `script` is a Unix command that takes a copy of all output to the terminal
+    // and writes it to `typescript` file.
+    // Below, explanation of `script` options.
+    // -q Be quiet (do not write start and done messages to standard output).
+    // -e Return the exit status of the child process.
+    // -f Flush output after each write.
+    // -c Run the command rather than an interactive shell. This makes it easy for a
+    // script to capture the output of a program that behaves differently when its
+    // stdout is not a tty.
+    let mut cmd = Command::new("script")
+        .current_dir(repo)
+        .stdout(Stdio::piped())
+        .stderr(Stdio::piped())
+        .args(["-qefc", &repo_sync])
+        .spawn()
+        .context("Failed to execute repo sync")?;
+
+    // Drain stderr in parallel so that the child never blocks on it.
+    let stderr = cmd
+        .stderr
+        .take()
+        .context("Failed to get stderr from script output")?;
+    let stderr = thread::spawn(move || -> Vec<u8> {
+        let mut buf = Vec::new();
+        let _ = BufReader::new(stderr).read_to_end(&mut buf);
+        buf
+    });
+    let stdout = cmd
+        .stdout
+        .take()
+        .context("Failed to get stdout from script output")?;
+    let mut run = SyncRun::default();
+    process_sync_output(stdout, verbose, log, &mut run).context("Failed to read repo sync")?;
+
+    let status = cmd.wait().context("Failed to wait for repo sync")?;
+    let stderr = stderr
+        .join()
+        .map_err(|_| anyhow!("Failed to read stderr of repo sync"))?;
+    log.write_all(&stderr)?;
+    let mut parser = SyncOutputParser::new();
+    parser.feed(&stderr, &mut |e| run.handle(e));
+    parser.finish(&mut |e| run.handle(e));
+    run.success = status.success();
+    if !run.success && run.failing_repos.is_empty() {
+        error!("{}", String::from_utf8_lossy(&stderr).trim());
+    }
+    Ok(run)
+}
 
+/// Read the output of repo sync in chunks, tee it to `log`, and either
+/// forward it to stdout as is (`verbose`) or show a progress bar. Failing
+/// repos and errors in the output are recorded in `run`.
+fn process_sync_output(
+    mut r: impl Read,
+    verbose: bool,
+    log: &mut impl Write,
+    run: &mut SyncRun,
+) -> Result<()> {
+    let mut parser = SyncOutputParser::new();
+    let mut bar = if verbose {
+        None
+    } else {
+        Some(SyncProgressBar::new()?)
+    };
+    let mut handler = |e| match e {
+        SyncEvent::Progress { title, done, total } => {
+            if let Some(bar) = bar.as_mut() {
+                bar.update(&title, done, total);
+            }
+        }
+        e => run.handle(e),
+    };
+    let mut stdout = std::io::stdout().lock();
+    let mut buf = vec![0u8; 64 * 1024];
+    loop {
+        let n = match r.read(&mut buf) {
+            Ok(0) => break,
+            Ok(n) => n,
+            Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e.into()),
+        };
+        let chunk = &buf[..n];
+        log.write_all(chunk)?;
+        if verbose {
+            stdout.write_all(chunk)?;
+            stdout.flush()?;
+        }
+        parser.feed(chunk, &mut handler);
+    }
+    parser.finish(&mut handler);
+    if let Some(bar) = &bar {
+        bar.finish();
+    }
     Ok(())
 }
 
@@ -258,7 +456,59 @@ fn find_cros_dir_from_cwd() -> Result<String> {
 mod tests {
     use std::assert_matches::assert_matches;
 
+    use tempdir::TempDir;
+
     use super::*;
+
+    #[test]
+    fn corrupted() {
+        let names = parse_repo_list(
+            "src/platform/foo : chromiumos/platform/foo\nsrc/platform/foo-bar : \
+             chromiumos/platform/foo-bar\n",
+        );
+        let name = names.get("src/platform/foo");
+        assert_eq!(name.map(String::as_str), Some("chromiumos/platform/foo"));
+        let errors = vec![
+            "error: src/platform/foo-bar/: fatal: bad object HEAD".to_string(),
+            "error: Cannot fetch chromiumos/platform/foo from https://example.com".to_string(),
+        ];
+        // Neither a project with a longer path nor a network error counts
+        assert!(!is_corrupted("src/platform/foo", name, &errors));
+        assert!(is_corrupted(
+            "src/platform/foo-bar",
+            names.get("src/platform/foo-bar"),
+            &errors
+        ));
+        let errors = vec!["fatal: chromiumos/platform/foo.git: missing blob 1234abcd".to_string()];
+        assert!(is_corrupted("src/platform/foo/", name, &errors));
+        assert!(!is_corrupted("src/other/foo", None, &errors));
+
+        let repo = TempDir::new("cro3_repo_test").unwrap();
+        let root = repo.path();
+        for dir in [
+            "src/platform/foo",
+            ".repo/projects/src/platform/foo.git",
+            ".repo/project-objects/chromiumos/platform/foo.git",
+            ".repo/project-objects/chromiumos/platform/foo-bar.git",
+        ] {
+            fs::create_dir_all(root.join(dir)).unwrap();
+        }
+        remove_project(
+            root.to_str().unwrap(),
+            "src/platform/foo/",
+            "chromiumos/platform/foo",
+        )
+        .unwrap();
+        assert!(!root.join("src/platform/foo").exists());
+        assert!(!root.join(".repo/projects/src/platform/foo.git").exists());
+        assert!(!root
+            .join(".repo/project-objects/chromiumos/platform/foo.git")
+            .exists());
+        assert!(root
+            .join(".repo/project-objects/chromiumos/platform/foo-bar.git")
+            .exists());
+    }
+
     #[test]
     fn reference_match() {
         let _default = Config::read().unwrap().default_cros_reference();
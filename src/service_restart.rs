@@ -0,0 +1,304 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Decides how to make deployed packages effective on a DUT: restarting the
+//! upstart jobs that use the changed files, or rebooting if the packages
+//! affect the kernel, firmware, C libraries or early boot.
+
+use std::collections::HashSet;
+use std::fmt;
+
+use anyhow::Result;
+use once_cell::sync::Lazy;
+use regex_macro::regex;
+use regex_macro::Regex;
+
+use crate::dut::SshInfo;
+use crate::portage::ContentsEntry;
+use crate::portage::InstalledPackage;
+
+/// Packages in these categories always require a reboot. sys-libs (e.g.
+/// glibc) is loaded by init, which can not be restarted.
+const REBOOT_CATEGORIES: [&str; 3] = ["sys-kernel", "sys-boot", "sys-libs"];
+/// Files under these paths are used before upstart jobs start, or by the
+/// kernel
+const REBOOT_PATHS: [&str; 9] = [
+    "/boot/",
+    "/lib/modules/",
+    "/lib/firmware/",
+    "/lib/udev/",
+    "/etc/udev/",
+    "/sbin/init",
+    "/sbin/chromeos_startup",
+    "/usr/sbin/chromeos_startup",
+    "/usr/sbin/chromeos-firmwareupdate",
+];
+/// Shared libraries. The jobs whose processes map them are restarted.
+static RE_SHARED_LIB: Lazy<&Regex> = Lazy::new(|| regex!(r"^/(usr/)?lib(64)?/[^/]+\.so(\.|$)"));
+static RE_UPSTART_CONF: Lazy<&Regex> = Lazy::new(|| regex!(r"^/etc/init/([^/]+)\.conf$"));
+static RE_EXECUTABLE: Lazy<&Regex> =
+    Lazy::new(|| regex!(r"^/(usr/)?(s?bin|libexec)/|^/opt/google/"));
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum RestartPlan {
+    /// Nothing to restart (e.g. data only packages)
+    Nothing,
+    Reboot {
+        reason: String,
+    },
+    Restart {
+        /// Jobs whose config files are changed
+        jobs: Vec<String>,
+        /// Changed executables. Jobs that refer to them are restarted.
+        executables: Vec<String>,
+        /// Changed shared libraries. Jobs whose processes (or their
+        /// descendants) map them are restarted.
+        libraries: Vec<String>,
+        /// True if the D-Bus policies are changed
+        reload_dbus: bool,
+    },
+}
+impl RestartPlan {
+    /// Makes a plan from the files of the packages. If `changed` is given
+    /// (the files which differed on the DUT before deploying), the other files
+    /// are ignored.
+    pub fn new(packages: &[InstalledPackage], changed: Option<&HashSet<String>>) -> Self {
+        let mut jobs: Vec<String> = Vec::new();
+        let mut executables = Vec::new();
+        let mut libraries = Vec::new();
+        let mut reload_dbus = false;
+        for package in packages {
+            let paths: Vec<&String> = package
+                .contents()
+                .iter()
+                .filter_map(|e| match e {
+                    ContentsEntry::Obj { path, .. } => Some(path),
+                    _ => None,
+                })
+                .filter(|path| match changed {
+                    Some(changed) => changed.contains(*path),
+                    None => true,
+                })
+                .collect();
+            if changed.is_some() && paths.is_empty() {
+                continue;
+            }
+            if REBOOT_CATEGORIES.contains(&package.category()) {
+                return Self::Reboot {
+                    reason: format!("{} is a kernel, boot or libc package", package.cpv()),
+                };
+            }
+            for path in paths {
+                if REBOOT_PATHS.iter().any(|p| path.starts_with(p)) {
+                    return Self::Reboot {
+                        reason: format!("{path} of {} is changed", package.cpv()),
+                    };
+                }
+                if let Some(c) = RE_UPSTART_CONF.captures(path) {
+                    jobs.push(c[1].to_string());
+                } else if path.starts_with("/opt/google/chrome/") {
+                    jobs.push("ui".to_string());
+                } else if path.starts_with("/etc/dbus-1/") {
+                    reload_dbus = true;
+                } else if RE_SHARED_LIB.is_match(path) {
+                    libraries.push(path.clone());
+                } else if RE_EXECUTABLE.is_match(path) {
+                    executables.push(path.clone());
+                }
+            }
+        }
+        jobs.sort();
+        jobs.dedup();
+        if jobs.is_empty() && executables.is_empty() && libraries.is_empty() && !reload_dbus {
+            Self::Nothing
+        } else {
+            Self::Restart {
+                jobs,
+                executables,
+                libraries,
+                reload_dbus,
+            }
+        }
+    }
+    pub fn needs_reboot(&self) -> bool {
+        matches!(self, Self::Reboot { .. })
+    }
+    /// Returns a script to be run on the DUT, which restarts the running jobs
+    /// in the plan and the ones that run the changed executables or
+    /// libraries.
+    fn script(&self) -> String {
+        let Self::Restart {
+            jobs,
+            executables,
+            libraries,
+            reload_dbus,
+        } = self
+        else {
+            return String::new();
+        };
+        let mut script = String::new();
+        if *reload_dbus {
+            script += "dbus-send --system --type=method_call --dest=org.freedesktop.DBus / \
+                       org.freedesktop.DBus.ReloadConfig\n";
+        }
+        script += &format!("jobs='{}'\n", jobs.join(" "));
+        for exe in executables {
+            script += &format!(
+                "jobs=\"$jobs $(grep -lF -- '{exe}' /etc/init/*.conf | xargs -r -n1 basename -s \
+                 .conf)\"\n"
+            );
+        }
+        if !libraries.is_empty() {
+            // The deployed libraries replaced the mapped ones, which are
+            // still listed in the maps as "(deleted)". Each process using
+            // them is attributed to the nearest ancestor that is the main
+            // process of a running job. Processes outside of jobs (and init)
+            // are left as is.
+            let patterns: String = libraries.iter().map(|l| format!(" -e '{l}'")).collect();
+            script += &format!(
+                r#"mains=$(initctl list | sed -n 's/^\([^ ]*\) start\/running, process \([0-9]*\)$/\2 \1/p')
+for pid in $(grep -lF{patterns} /proc/[0-9]*/maps 2>/dev/null | cut -d/ -f3); do
+  while [ "${{pid:-1}}" -gt 1 ]; do
+    job=$(echo "$mains" | awk -v p="$pid" '$1 == p {{ print $2 }}')
+    if [ -n "$job" ]; then jobs="$jobs $job"; break; fi
+    pid=$(sed -n 's/.*) . \([0-9]*\) .*/\1/p' /proc/$pid/stat 2>/dev/null)
+  done
+done
+"#
+            );
+        }
+        // Jobs which are not running (e.g. tasks done at boot) are left
+        // as is. stop/start is used instead of restart to reload the configs.
+        script += r#"for job in $(echo $jobs | tr ' ' '\n' | sort -u); do
+  if status "$job" 2>/dev/null | grep -q start/running; then
+    stop "$job" >/dev/null; start "$job" >/dev/null && echo "restarted $job"
+  fi
+done
+"#;
+        script
+    }
+    /// Apply the plan to the DUT, except rebooting. Returns the restarted
+    /// jobs.
+    pub fn apply(&self, target: &SshInfo) -> Result<Vec<String>> {
+        if !matches!(self, Self::Restart { .. }) {
+            return Ok(Vec::new());
+        }
+        let output = target.run_cmd_stdio(&self.script())?;
+        Ok(output
+            .lines()
+            .filter_map(|line| line.strip_prefix("restarted "))
+            .map(str::to_string)
+            .collect())
+    }
+}
+impl fmt::Display for RestartPlan {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Self::Nothing => write!(f, "nothing to restart"),
+            Self::Reboot { reason } => write!(f, "reboot ({reason})"),
+            Self::Restart {
+                jobs,
+                executables,
+                libraries,
+                reload_dbus,
+            } => {
+                write!(f, "restart jobs {jobs:?} and the users of {executables:?}")?;
+                if !libraries.is_empty() {
+                    write!(f, ", {libraries:?}")?;
+                }
+                if *reload_dbus {
+                    write!(f, ", reload D-Bus config")?;
+                }
+                Ok(())
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn package(cpv: &str, objs: &[&str]) -> InstalledPackage {
+        let contents = std::iter::once(format!("### cro3 package: {cpv}"))
+            .chain(
+                objs.iter()
+                    .map(|p| format!("obj {p} 0123456789abcdef0123456789abcdef 1700000000")),
+            )
+            .collect::<Vec<_>>()
+            .join("\n");
+        InstalledPackage::parse(&contents).remove(0)
+    }
+
+    #[test]
+    fn plan() {
+        let shill = package(
+            "chromeos-base/shill-0.0.1-r1",
+            &[
+                "/usr/bin/shill",
+                "/etc/init/shill.conf",
+                "/etc/dbus-1/system.d/org.chromium.flimflam.conf",
+                "/usr/share/shill/README",
+            ],
+        );
+        let plan = RestartPlan::new(std::slice::from_ref(&shill), None);
+        assert_eq!(
+            plan,
+            RestartPlan::Restart {
+                jobs: vec!["shill".to_string()],
+                executables: vec!["/usr/bin/shill".to_string()],
+                libraries: vec![],
+                reload_dbus: true
+            }
+        );
+        assert!(plan.script().contains("grep -lF -- '/usr/bin/shill'"));
+        assert!(!plan.script().contains("/proc/"));
+        // Only the files which differed on the DUT matter
+        let changed = HashSet::from(["/usr/bin/shill".to_string()]);
+        assert_eq!(
+            RestartPlan::new(std::slice::from_ref(&shill), Some(&changed)),
+            RestartPlan::Restart {
+                jobs: vec![],
+                executables: vec!["/usr/bin/shill".to_string()],
+                libraries: vec![],
+                reload_dbus: false
+            }
+        );
+
+        let chrome = package(
+            "chromeos-base/chromeos-chrome-120",
+            &["/opt/google/chrome/chrome"],
+        );
+        assert!(matches!(
+            RestartPlan::new(&[chrome], None),
+            RestartPlan::Restart { jobs, .. } if jobs == ["ui"]
+        ));
+
+        let lib = package(
+            "chromeos-base/libbrillo-0.0.1-r1",
+            &["/usr/lib64/libbrillo.so.1"],
+        );
+        let plan = RestartPlan::new(&[lib], None);
+        assert!(matches!(
+            &plan,
+            RestartPlan::Restart { libraries, .. } if *libraries == ["/usr/lib64/libbrillo.so.1"]
+        ));
+        assert!(plan
+            .script()
+            .contains("grep -lF -e '/usr/lib64/libbrillo.so.1' /proc/[0-9]*/maps"));
+        let kernel = package(
+            "sys-kernel/chromeos-kernel-5_15-9999",
+            &["/boot/vmlinuz-5.15"],
+        );
+        assert!(RestartPlan::new(std::slice::from_ref(&kernel), None).needs_reboot());
+        // The kernel package is deployed but nothing is changed
+        assert!(!RestartPlan::new(&[kernel], Some(&HashSet::new())).needs_reboot());
+        let glibc = package("sys-libs/glibc-2.35", &["/lib64/libc.so.6"]);
+        assert!(RestartPlan::new(&[glibc], None).needs_reboot());
+        let data = package("chromeos-base/fonts-1", &["/usr/share/fonts/a.ttf"]);
+        assert_eq!(RestartPlan::new(&[data], None), RestartPlan::Nothing);
+    }
+}
@@ -0,0 +1,580 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Snapshots of the stateful partition of DUTs, stored on the host.
+//!
+//! A snapshot is a tar stream of the selected dirs of the stateful partition,
+//! split into content-defined chunks. Chunks are stored compressed under
+//! ~/.cro3/snapshots/chunks by their sha256, so the data shared by snapshots
+//! (or repeated in a snapshot, like the zeros in encrypted.block) is stored
+//! only once. Each chunk is verified when it is read back.
+
+use std::collections::HashSet;
+use std::fs;
+use std::fs::File;
+use std::io::Read;
+use std::io::Write;
+use std::path::Path;
+use std::path::PathBuf;
+use std::process::Stdio;
+use std::sync::atomic::AtomicUsize;
+use std::sync::atomic::Ordering;
+use std::sync::mpsc;
+use std::sync::Arc;
+use std::sync::Mutex;
+use std::thread;
+use std::time::Instant;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use chrono::Local;
+use flate2::read::DeflateDecoder;
+use flate2::write::DeflateEncoder;
+use flate2::Compression;
+use once_cell::sync::Lazy;
+use rayon::prelude::*;
+use serde::Deserialize;
+use serde::Serialize;
+use sha2::Digest;
+use sha2::Sha256;
+use tracing::info;
+
+use crate::dut::SshInfo;
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
+use crate::util::hash::hex_digest;
+use crate::util::hash::sha256_hex;
+
+const STATEFUL_DIR: &str = "/mnt/stateful_partition";
+/// Dirs that hold the user state: the encrypted stateful (/var,
+/// /home/chronos), cryptohome vaults and the unencrypted data.
+pub const DEFAULT_DIRS: [&str; 4] = ["encrypted.block", "encrypted.key", "home", "unencrypted"];
+
+/// Parse the comma separated names of the dirs in the stateful partition.
+pub fn parse_dirs(dirs: &str) -> Result<Vec<String>> {
+    let dirs: Vec<String> = dirs.split(',').map(|d| d.trim().to_string()).collect();
+    quoted_dirs(&dirs)?;
+    Ok(dirs)
+}
+
+/// Returns the names of the dirs quoted for the shell of the DUT. The names
+/// are run as root, so only plain names of the top level of the stateful
+/// partition are accepted (no paths, "..", or shell metacharacters).
+fn quoted_dirs(dirs: &[String]) -> Result<String> {
+    if dirs.is_empty() {
+        bail!("No dirs are specified");
+    }
+    for dir in dirs {
+        if dir.is_empty()
+            || dir == "."
+            || dir == ".."
+            || !dir
+                .chars()
+                .all(|c| c.is_ascii_alphanumeric() || "._-".contains(c))
+        {
+            bail!("Invalid dir name {dir:?}: only names in {STATEFUL_DIR} are allowed");
+        }
+    }
+    Ok(dirs
+        .iter()
+        .map(|d| format!("'{d}'"))
+        .collect::<Vec<_>>()
+        .join(" "))
+}
+
+const MIN_CHUNK: usize = 64 << 10;
+const MAX_CHUNK: usize = 4 << 20;
+/// Cut a chunk when the low 18 bits of the rolling hash are zero (256KiB
+/// chunks on average)
+const CUT_MASK: u64 = (1 << 18) - 1;
+
+/// Random table of the gear hash, generated by splitmix64 so that the chunk
+/// boundaries are stable across builds.
+static GEAR: Lazy<[u64; 256]> = Lazy::new(|| {
+    let mut state: u64 = 0x63726f33;
+    let mut table = [0u64; 256];
+    for v in table.iter_mut() {
+        state = state.wrapping_add(0x9e3779b97f4a7c15);
+        let mut z = state;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d049bb133111eb);
+        *v = z ^ (z >> 31);
+    }
+    table
+});
+
+/// Split a stream into content-defined chunks, so that an insertion or a
+/// deletion only changes the chunks around it.
+fn split_chunks(mut src: impl Read, mut emit: impl FnMut(Vec<u8>) -> Result<()>) -> Result<()> {
+    let mut buf = vec![0u8; 1 << 20];
+    let mut chunk = Vec::with_capacity(MAX_CHUNK);
+    let mut h: u64 = 0;
+    loop {
+        let n = src.read(&mut buf)?;
+        if n == 0 {
+            break;
+        }
+        for &b in &buf[..n] {
+            chunk.push(b);
+            h = (h << 1).wrapping_add(GEAR[b as usize]);
+            if (chunk.len() >= MIN_CHUNK && h & CUT_MASK == 0) || chunk.len() >= MAX_CHUNK {
+                emit(std::mem::replace(&mut chunk, Vec::with_capacity(MAX_CHUNK)))?;
+                h = 0;
+            }
+        }
+    }
+    if !chunk.is_empty() {
+        emit(chunk)?;
+    }
+    Ok(())
+}
+
+/// ChunkStore holds compressed chunks named by the sha256 of their contents
+pub struct ChunkStore {
+    dir: PathBuf,
+}
+impl ChunkStore {
+    pub fn new(dir: &Path) -> Result<Self> {
+        fs::create_dir_all(dir)?;
+        Ok(Self {
+            dir: dir.to_path_buf(),
+        })
+    }
+    fn path(&self, hash: &str) -> PathBuf {
+        self.dir.join(&hash[..2]).join(hash)
+    }
+    /// Store a chunk. Returns true if it was not stored yet.
+    pub fn put(&self, hash: &str, data: &[u8]) -> Result<bool> {
+        let path = self.path(hash);
+        if path.exists() {
+            return Ok(false);
+        }
+        let dir = path.parent().context("Invalid chunk path")?;
+        fs::create_dir_all(dir)?;
+        // Write to a unique file and rename, so that a concurrent writer of
+        // the same chunk or an interruption never leaves a partial chunk.
+        let tmp = dir.join(format!("{hash}.{:?}.tmp", thread::current().id()));
+        let mut encoder = DeflateEncoder::new(File::create(&tmp)?, Compression::fast());
+        encoder.write_all(data)?;
+        encoder.finish()?.sync_all()?;
+        fs::rename(&tmp, &path)?;
+        Ok(true)
+    }
+    /// Read a chunk and verify its contents.
+    pub fn get(&self, hash: &str) -> Result<Vec<u8>> {
+        let path = self.path(hash);
+        let mut data = Vec::new();
+        DeflateDecoder::new(File::open(&path).context(format!("Chunk {hash} is missing"))?)
+            .read_to_end(&mut data)
+            .context(format!("Chunk {hash} is broken"))?;
+        let actual = sha256_hex(&data);
+        if actual != hash {
+            bail!("Chunk {hash} is broken (sha256 is {actual})");
+        }
+        Ok(data)
+    }
+    /// Remove the chunks which are not in `used`. Returns the number of
+    /// removed chunks.
+    pub fn retain(&self, used: &HashSet<String>) -> Result<usize> {
+        let mut removed = 0;
+        for d in fs::read_dir(&self.dir)? {
+            let d = d?.path();
+            if !d.is_dir() {
+                continue;
+            }
+            for f in fs::read_dir(&d)? {
+                let f = f?.path();
+                let name = f.file_name().unwrap_or_default().to_string_lossy();
+                if !used.contains(name.as_ref()) {
+                    fs::remove_file(&f)?;
+                    removed += 1;
+                }
+            }
+        }
+        Ok(removed)
+    }
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct Snapshot {
+    pub name: String,
+    pub board: String,
+    /// Serial number of the DUT (or its host name if it has none)
+    #[serde(default)]
+    pub dut: String,
+    /// sha256 of encrypted.key, which is wrapped by a key in the TPM and
+    /// regenerated when the TPM is cleared
+    #[serde(default)]
+    pub encrypted_key_sha256: String,
+    pub created: String,
+    /// Dirs in the stateful partition
+    pub dirs: Vec<String>,
+    /// Size of the tar stream
+    pub size: u64,
+    /// sha256 of the tar stream
+    pub sha256: String,
+    pub chunks: Vec<String>,
+}
+
+fn snapshots_dir() -> Result<PathBuf> {
+    Ok(gen_path_in_cro3_dir("snapshots/.keep")?
+        .parent()
+        .context("Failed to get the snapshot dir")?
+        .to_path_buf())
+}
+
+fn chunk_store() -> Result<ChunkStore> {
+    ChunkStore::new(&snapshots_dir()?.join("chunks"))
+}
+
+/// Returns the serial number of the DUT, or the host name if it has none
+/// (e.g. VMs).
+fn dut_identity(ssh: &SshInfo) -> Result<String> {
+    let serial = ssh.run_cmd_stdio("vpd -g serial_number 2>/dev/null || true")?;
+    Ok(if serial.is_empty() {
+        ssh.host().to_string()
+    } else {
+        serial
+    })
+}
+
+fn encrypted_key_sha256(ssh: &SshInfo) -> Result<String> {
+    ssh.run_cmd_stdio(&format!(
+        "sha256sum {STATEFUL_DIR}/encrypted.key 2>/dev/null | cut -d ' ' -f 1"
+    ))
+}
+
+fn manifest_path(name: &str) -> Result<PathBuf> {
+    if name.is_empty() || name.contains(['/', '.']) {
+        bail!("Invalid snapshot name: {name:?}");
+    }
+    Ok(snapshots_dir()?.join(format!("{name}.json")))
+}
+
+impl Snapshot {
+    pub fn load(name: &str) -> Result<Self> {
+        let path = manifest_path(name)?;
+        let s = fs::read_to_string(&path).context(format!("Snapshot {name} is not found"))?;
+        Ok(serde_json::from_str(&s)?)
+    }
+    pub fn list() -> Result<Vec<Self>> {
+        let mut snapshots = Vec::new();
+        for e in fs::read_dir(snapshots_dir()?)? {
+            let path = e?.path();
+            if path.extension().is_some_and(|e| e == "json") {
+                snapshots.push(serde_json::from_str(&fs::read_to_string(&path)?)?);
+            }
+        }
+        snapshots.sort_by(|a: &Self, b| a.created.cmp(&b.created));
+        Ok(snapshots)
+    }
+    /// Capture the dirs of the stateful partition of the DUT. The UI is
+    /// stopped (which logs out the user) and the filesystems are frozen
+    /// while they are archived, so that encrypted.block and the files are
+    /// consistent.
+    pub fn save(ssh: &SshInfo, name: &str, dirs: &[String]) -> Result<Self> {
+        let quoted = quoted_dirs(dirs)?;
+        let path = manifest_path(name)?;
+        let board = ssh.get_board()?;
+        let dut = dut_identity(ssh)?;
+        let encrypted_key_sha256 = encrypted_key_sha256(ssh)?;
+        let store = chunk_store()?;
+        let start = Instant::now();
+        let mut cmd = ssh.ssh_cmd(Some(&["-C"]))?;
+        // The encrypted stateful is frozen before the stateful partition
+        // which holds its backing file, and thawed in the reverse order.
+        // They are thawed even if tar or the connection fails.
+        cmd.arg(format!(
+            r#"set -e
+command -v fsfreeze >/dev/null || {{ echo "fsfreeze is not found on the DUT" >&2; exit 1; }}
+stop ui >/dev/null 2>&1 || true
+frozen=""
+thaw() {{ for m in $frozen; do fsfreeze -u $m; done; start ui >/dev/null 2>&1 || true; }}
+trap thaw EXIT
+sync
+for m in {STATEFUL_DIR}/encrypted {STATEFUL_DIR}; do
+  if mountpoint -q $m; then fsfreeze -f $m; frozen="$m $frozen"; fi
+done
+cd {STATEFUL_DIR}
+tar -cSf - --numeric-owner $(ls -d {quoted} 2>/dev/null)"#
+        ))
+        .stdout(Stdio::piped());
+        let mut child = cmd.spawn()?;
+        let stdout = child
+            .stdout
+            .take()
+            .context("Failed to get the output of ssh")?;
+
+        let mut chunks = Vec::new();
+        let mut total = Sha256::new();
+        let mut size = 0u64;
+        let new_chunks = AtomicUsize::new(0);
+        // Compressing is the bottleneck, so the chunks are stored in parallel
+        let (tx, rx) = mpsc::sync_channel::<(String, Vec<u8>)>(num_cpus::get() * 2);
+        let rx = Arc::new(Mutex::new(rx));
+        thread::scope(|s| -> Result<()> {
+            let workers: Vec<_> = (0..num_cpus::get())
+                .map(|_| {
+                    let rx = rx.clone();
+                    let store = &store;
+                    let new_chunks = &new_chunks;
+                    s.spawn(move || -> Result<()> {
+                        loop {
+                            let Ok((hash, data)) = rx.lock().unwrap().recv() else {
+                                return Ok(());
+                            };
+                            if store.put(&hash, &data)? {
+                                new_chunks.fetch_add(1, Ordering::Relaxed);
+                            }
+                        }
+                    })
+                })
+                .collect();
+            let result = split_chunks(stdout, |data| {
+                total.update(&data);
+                size += data.len() as u64;
+                let hash = sha256_hex(&data);
+                chunks.push(hash.clone());
+                tx.send((hash, data))
+                    .map_err(|_| anyhow!("Failed to store chunks"))
+            });
+            drop(tx);
+            for w in workers {
+                w.join().map_err(|_| anyhow!("Chunk writer panicked"))??;
+            }
+            result
+        })?;
+        child
+            .wait()?
+            .exit_ok()
+            .context("Failed to archive the stateful partition")?;
+        let snapshot = Self {
+            name: name.to_string(),
+            board,
+            dut,
+            encrypted_key_sha256,
+            created: Local::now().to_rfc3339(),
+            dirs: dirs.to_vec(),
+            size,
+            sha256: hex_digest(total),
+            chunks,
+        };
+        fs::write(&path, serde_json::to_string_pretty(&snapshot)?)?;
+        info!(
+            "Saved snapshot {name} ({} MiB, {} chunks, {} new) in {:.1?}",
+            size >> 20,
+            snapshot.chunks.len(),
+            new_chunks.load(Ordering::Relaxed),
+            start.elapsed()
+        );
+        Ok(snapshot)
+    }
+    /// Check that all the chunks are stored and intact.
+    pub fn verify(&self) -> Result<()> {
+        let store = chunk_store()?;
+        let unique: HashSet<&String> = self.chunks.iter().collect();
+        unique
+            .into_par_iter()
+            .map(|hash| store.get(hash).map(|_| ()))
+            .collect::<Result<Vec<()>>>()?;
+        Ok(())
+    }
+    /// Check that the snapshot can be restored on the DUT: it has to be the
+    /// DUT where the snapshot was saved, and its TPM must not have been
+    /// cleared since then (or the encrypted data can't be decrypted).
+    fn check_target(&self, board: &str, dut: &str, encrypted_key_sha256: &str) -> Result<()> {
+        if board != self.board {
+            bail!("Snapshot {} is for {}, not {board}", self.name, self.board);
+        }
+        if self.dut.is_empty() {
+            bail!(
+                "Snapshot {} does not record the DUT it was saved from. Please save it again.",
+                self.name
+            );
+        }
+        if dut != self.dut {
+            bail!(
+                "Snapshot {} was saved from {}, not {dut}",
+                self.name,
+                self.dut
+            );
+        }
+        if encrypted_key_sha256 != self.encrypted_key_sha256 {
+            bail!(
+                "The encryption key of the stateful partition has changed since snapshot {} was \
+                 saved (the TPM was cleared or the DUT was powerwashed)",
+                self.name
+            );
+        }
+        Ok(())
+    }
+    /// Replace the dirs of the stateful partition of the DUT with the
+    /// snapshot. The DUT should be rebooted afterwards.
+    pub fn restore(&self, ssh: &SshInfo) -> Result<()> {
+        self.check_target(
+            &ssh.get_board()?,
+            &dut_identity(ssh)?,
+            &encrypted_key_sha256(ssh)?,
+        )?;
+        // Do not touch the DUT if the snapshot is broken (or the manifest
+        // was edited)
+        let quoted = quoted_dirs(&self.dirs)?;
+        self.verify()?;
+        let store = chunk_store()?;
+        let start = Instant::now();
+        let mut cmd = ssh.ssh_cmd(Some(&["-C"]))?;
+        cmd.arg(format!(
+            "stop ui >/dev/null 2>&1; cd {STATEFUL_DIR} && rm -rf {quoted} && tar -xpSf - \
+             --numeric-owner && sync"
+        ))
+        .stdin(Stdio::piped());
+        let mut child = cmd.spawn()?;
+        let mut stdin = child.stdin.take().context("Failed to open stdin of ssh")?;
+        let mut total = Sha256::new();
+        for hash in &self.chunks {
+            let data = store.get(hash)?;
+            total.update(&data);
+            stdin
+                .write_all(&data)
+                .context("Failed to send the snapshot")?;
+        }
+        drop(stdin);
+        child
+            .wait()?
+            .exit_ok()
+            .context("Failed to restore the stateful partition")?;
+        let sha256 = hex_digest(total);
+        if sha256 != self.sha256 {
+            bail!("Snapshot {} is broken (sha256 is {sha256})", self.name);
+        }
+        info!(
+            "Restored snapshot {} ({} MiB) in {:.1?}",
+            self.name,
+            self.size >> 20,
+            start.elapsed()
+        );
+        Ok(())
+    }
+    /// Delete a snapshot and the chunks which are no longer used.
+    pub fn delete(name: &str) -> Result<()> {
+        fs::remove_file(manifest_path(name)?).context(format!("Snapshot {name} is not found"))?;
+        let used: HashSet<String> = Self::list()?.into_iter().flat_map(|s| s.chunks).collect();
+        let removed = chunk_store()?.retain(&used)?;
+        info!("Deleted snapshot {name} ({removed} chunks removed)");
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use tempdir::TempDir;
+
+    use super::*;
+
+    fn chunks_of(data: &[u8]) -> Vec<String> {
+        let mut hashes = Vec::new();
+        split_chunks(data, |c| {
+            hashes.push(sha256_hex(&c));
+            Ok(())
+        })
+        .unwrap();
+        hashes
+    }
+
+    #[test]
+    fn content_defined_chunks() {
+        // xorshift64 for reproducible random data
+        let mut x: u64 = 88172645463325252;
+        let data: Vec<u8> = (0..8 << 20)
+            .map(|_| {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                (x >> 56) as u8
+            })
+            .collect();
+        let chunks = chunks_of(&data);
+        assert!(chunks.len() > 4);
+        // Inserting bytes at the beginning only changes the first chunks
+        let mut shifted = b"inserted".to_vec();
+        shifted.extend_from_slice(&data);
+        let shifted = chunks_of(&shifted);
+        let common = shifted.iter().filter(|c| chunks.contains(c)).count();
+        assert!(common >= chunks.len() - 2, "{common} of {}", chunks.len());
+        // Runs of zeros are deduplicated
+        let zeros = chunks_of(&vec![0u8; 3 * MAX_CHUNK]);
+        assert_eq!(zeros.len(), 3);
+        assert!(zeros.iter().all(|c| *c == zeros[0]));
+    }
+
+    #[test]
+    fn dir_names() {
+        assert_eq!(
+            parse_dirs("home, encrypted.block").unwrap(),
+            vec!["home", "encrypted.block"]
+        );
+        assert_eq!(
+            quoted_dirs(&parse_dirs("home,dev_image").unwrap()).unwrap(),
+            "'home' 'dev_image'"
+        );
+        for dirs in [
+            "home,../../usr",
+            "/usr",
+            "home/..",
+            "..",
+            "a;reboot",
+            "$(reboot)",
+            "a b",
+            "",
+        ] {
+            assert!(parse_dirs(dirs).is_err(), "{dirs}");
+        }
+    }
+
+    #[test]
+    fn restore_target() {
+        let snapshot = Snapshot {
+            name: "clean".to_string(),
+            board: "brya".to_string(),
+            dut: "SERIAL1".to_string(),
+            encrypted_key_sha256: "aaaa".to_string(),
+            created: String::new(),
+            dirs: Vec::new(),
+            size: 0,
+            sha256: String::new(),
+            chunks: Vec::new(),
+        };
+        assert!(snapshot.check_target("brya", "SERIAL1", "aaaa").is_ok());
+        assert!(snapshot.check_target("volteer", "SERIAL1", "aaaa").is_err());
+        assert!(snapshot.check_target("brya", "SERIAL2", "aaaa").is_err());
+        // The TPM was cleared
+        assert!(snapshot.check_target("brya", "SERIAL1", "bbbb").is_err());
+        let old = Snapshot {
+            dut: String::new(),
+            ..snapshot
+        };
+        assert!(old.check_target("brya", "", "aaaa").is_err());
+    }
+
+    #[test]
+    fn store_and_verify() {
+        let dir = TempDir::new("cro3_snapshot_test").unwrap();
+        let store = ChunkStore::new(dir.path()).unwrap();
+        let data = b"stateful".repeat(1000);
+        let hash = sha256_hex(&data);
+        assert!(store.put(&hash, &data).unwrap());
+        assert!(!store.put(&hash, &data).unwrap());
+        assert_eq!(store.get(&hash).unwrap(), data);
+        // Corrupted chunks are detected
+        let other = sha256_hex(b"other");
+        store.put(&other, b"other").unwrap();
+        fs::copy(store.path(&hash), store.path(&other)).unwrap();
+        assert!(store.get(&other).is_err());
+        assert_eq!(store.retain(&HashSet::from([hash.clone()])).unwrap(), 1);
+        assert!(store.get(&hash).is_ok());
+    }
+}
@@ -0,0 +1,336 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Watches the source directories of cros-workon packages for changes.
+//!
+//! Only the directories copied into the build of each package
+//! (CROS_WORKON_SUBDIRS_TO_COPY, or CROS_WORKON_SUBTREE) are watched, with
+//! inotify, so that waiting for changes does not scan the checkout.
+
+use std::collections::BTreeSet;
+use std::collections::HashMap;
+use std::fs;
+use std::path::Path;
+use std::path::PathBuf;
+use std::thread;
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use nix::errno::Errno;
+use nix::sys::inotify::AddWatchFlags;
+use nix::sys::inotify::InitFlags;
+use nix::sys::inotify::Inotify;
+use nix::sys::inotify::WatchDescriptor;
+
+use crate::chroot::Chroot;
+
+/// Path of the checkout in the chroot
+const SOURCE_ROOT_IN_CHROOT: &str = "/mnt/host/source";
+
+/// WatchTarget is a cros-workon package and the directories to be watched
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct WatchTarget {
+    package: String,
+    dirs: Vec<PathBuf>,
+}
+impl WatchTarget {
+    /// Query the source directories of the packages from cros-workon and
+    /// CROS_WORKON_SUBDIRS_TO_COPY / CROS_WORKON_SUBTREE of their ebuilds.
+    pub fn query(
+        chroot: &Chroot,
+        cros: &str,
+        board: &str,
+        packages: &[String],
+    ) -> Result<Vec<Self>> {
+        let script = packages
+            .iter()
+            .map(|p| {
+                format!(
+                    "e=\"$(equery-{board} which {p})\"; printf '%s\\t%s\\t%s\\n' \
+                     \"$(cros-workon-{board} info {p})\" \"$(grep -m1 \
+                     '^CROS_WORKON_SUBDIRS_TO_COPY=' \"$e\" 2>/dev/null | cut -d= -f2-)\" \
+                     \"$(grep -m1 '^CROS_WORKON_SUBTREE=' \"$e\" 2>/dev/null | cut -d= -f2-)\""
+                )
+            })
+            .collect::<Vec<_>>()
+            .join("; ");
+        let output = chroot.exec_in_chroot(&["bash", "-c", &script])?;
+        let targets = Self::parse(Path::new(cros), &output);
+        if targets.len() != packages.len() {
+            bail!("Failed to get the source dirs of {packages:?}: {output}");
+        }
+        Ok(targets)
+    }
+    /// Parse lines of "${ATOM} ${PROJECTS}
+    /// ${SRCPATHS}\t${CROS_WORKON_SUBDIRS_TO_COPY}\t${CROS_WORKON_SUBTREE}"
+    fn parse(cros: &Path, output: &str) -> Vec<Self> {
+        output
+            .lines()
+            .filter_map(|line| {
+                let mut fields = line.split('\t');
+                let mut info = fields.next()?.split_whitespace();
+                let subdirs = fields.next().and_then(parse_subdirs);
+                let subtree = fields.next().and_then(parse_subdirs);
+                let package = info.next()?.to_string();
+                let srcpaths = info.nth(1)?;
+                let srcpaths: Vec<PathBuf> = srcpaths
+                    .split(',')
+                    .map(|p| match Path::new(p).strip_prefix(SOURCE_ROOT_IN_CHROOT) {
+                        Ok(p) => cros.join(p),
+                        Err(_) => cros.join(p.trim_start_matches('/')),
+                    })
+                    .collect();
+                // Subdirs are handled only for a single project. For multiple
+                // projects, the whole projects are watched.
+                let dirs = match (srcpaths.as_slice(), subdirs.or(subtree)) {
+                    ([srcpath], Some(subdirs)) => subdirs.iter().map(|s| srcpath.join(s)).collect(),
+                    _ => srcpaths,
+                };
+                Some(Self { package, dirs })
+            })
+            .collect()
+    }
+    pub fn package(&self) -> &str {
+        &self.package
+    }
+    pub fn dirs(&self) -> &[PathBuf] {
+        &self.dirs
+    }
+}
+
+/// Returns the subdirs in the value of CROS_WORKON_SUBDIRS_TO_COPY or
+/// CROS_WORKON_SUBTREE, as a string or an array. Returns None if it is empty
+/// or refers to variables.
+fn parse_subdirs(value: &str) -> Option<Vec<&str>> {
+    let value = value.trim();
+    let value = value
+        .strip_prefix('(')
+        .and_then(|v| v.strip_suffix(')'))
+        .unwrap_or(value);
+    let dirs: Vec<&str> = value
+        .split_whitespace()
+        .map(|s| s.trim_matches(|c| c == '"' || c == '\''))
+        .filter(|s| !s.is_empty())
+        .collect();
+    (!dirs.is_empty() && !dirs.iter().any(|s| s.contains('$'))).then_some(dirs)
+}
+
+/// Events which mean that the sources are changed
+fn watch_flags() -> AddWatchFlags {
+    AddWatchFlags::IN_MODIFY
+        | AddWatchFlags::IN_ATTRIB
+        | AddWatchFlags::IN_CREATE
+        | AddWatchFlags::IN_DELETE
+        | AddWatchFlags::IN_DELETE_SELF
+        | AddWatchFlags::IN_MOVED_FROM
+        | AddWatchFlags::IN_MOVED_TO
+        | AddWatchFlags::IN_MOVE_SELF
+}
+
+/// SourceWatcher reports the packages whose sources are changed.
+pub struct SourceWatcher {
+    inotify: Inotify,
+    /// The index of the package and the path of each watch
+    watches: HashMap<WatchDescriptor, (usize, PathBuf)>,
+    packages: Vec<String>,
+    poll_interval: Duration,
+    debounce: Duration,
+}
+impl SourceWatcher {
+    pub fn new(
+        targets: Vec<WatchTarget>,
+        poll_interval: Duration,
+        debounce: Duration,
+    ) -> Result<Self> {
+        let inotify = Inotify::init(InitFlags::IN_NONBLOCK | InitFlags::IN_CLOEXEC)
+            .context("Failed to initialize inotify")?;
+        let mut watcher = Self {
+            inotify,
+            watches: HashMap::new(),
+            packages: targets.iter().map(|t| t.package.clone()).collect(),
+            poll_interval,
+            debounce,
+        };
+        for (i, t) in targets.iter().enumerate() {
+            for dir in t.dirs() {
+                watcher.add_tree(i, dir)?;
+            }
+        }
+        Ok(watcher)
+    }
+    /// Watch `path` and the directories under it, except .git
+    fn add_tree(&mut self, index: usize, path: &Path) -> Result<()> {
+        let Ok(meta) = fs::symlink_metadata(path) else {
+            return Ok(());
+        };
+        let wd = match self.inotify.add_watch(path, watch_flags()) {
+            Ok(wd) => wd,
+            // Removed while adding the watches
+            Err(Errno::ENOENT) => return Ok(()),
+            Err(Errno::ENOSPC) => {
+                bail!("Too many directories to watch. Please raise fs.inotify.max_user_watches")
+            }
+            Err(e) => return Err(e).with_context(|| format!("Failed to watch {path:?}")),
+        };
+        self.watches.insert(wd, (index, path.to_path_buf()));
+        if meta.is_dir() {
+            let Ok(entries) = fs::read_dir(path) else {
+                return Ok(());
+            };
+            for e in entries.flatten() {
+                if e.file_name() != ".git" && e.file_type().is_ok_and(|t| t.is_dir()) {
+                    self.add_tree(index, &e.path())?;
+                }
+            }
+        }
+        Ok(())
+    }
+    /// Returns the packages whose sources are changed since the last call.
+    fn changed(&mut self) -> Result<BTreeSet<usize>> {
+        let mut changed = BTreeSet::new();
+        loop {
+            let events = match self.inotify.read_events() {
+                Ok(events) => events,
+                Err(Errno::EAGAIN) => return Ok(changed),
+                Err(e) => return Err(e).context("Failed to read inotify events"),
+            };
+            for event in events {
+                let Some((index, path)) = self.watches.get(&event.wd).cloned() else {
+                    continue;
+                };
+                if event.mask.contains(AddWatchFlags::IN_IGNORED) {
+                    // The watched path is removed. Watch it again if it is
+                    // replaced (e.g. a file saved by renaming a new one).
+                    self.watches.remove(&event.wd);
+                    self.add_tree(index, &path)?;
+                    continue;
+                }
+                let path = match &event.name {
+                    Some(name) if name == ".git" => continue,
+                    Some(name) => path.join(name),
+                    None => path,
+                };
+                if event.mask.contains(AddWatchFlags::IN_ISDIR)
+                    && event
+                        .mask
+                        .intersects(AddWatchFlags::IN_CREATE | AddWatchFlags::IN_MOVED_TO)
+                {
+                    self.add_tree(index, &path)?;
+                }
+                changed.insert(index);
+            }
+        }
+    }
+    /// Block until some sources are changed and stay unchanged for the
+    /// debounce period. Returns the changed packages and the time when the
+    /// first change was detected.
+    pub fn wait_for_changes(&mut self) -> Result<(Vec<String>, Instant)> {
+        let mut changed = loop {
+            let changed = self.changed()?;
+            if !changed.is_empty() {
+                break changed;
+            }
+            thread::sleep(self.poll_interval);
+        };
+        let detected = Instant::now();
+        let mut last_change = detected;
+        while last_change.elapsed() < self.debounce {
+            thread::sleep(self.poll_interval);
+            let more = self.changed()?;
+            if !more.is_empty() {
+                changed.extend(more);
+                last_change = Instant::now();
+            }
+        }
+        let packages = changed
+            .into_iter()
+            .map(|i| self.packages[i].clone())
+            .collect();
+        Ok((packages, detected))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn parse() {
+        let cros = Path::new("/work/cros");
+        let targets = WatchTarget::parse(
+            cros,
+            "chromeos-base/shill platform2 /mnt/host/source/src/platform2\t\t\"common-mk shill \
+             .gn\"\nchromeos-base/crosvm crosvm src/crosvm\t\t\nchromeos-base/vm_host_tools \
+             platform2 /mnt/host/source/src/platform2\t( common-mk vm_tools .gn )\t\"common-mk \
+             vm_tools .gn chromeos-config\"\nchromeos-base/foo platform2 \
+             src/platform2\t\"${CROS_WORKON_SUBTREE}\"\t\"foo\"\n",
+        );
+        assert_eq!(targets.len(), 4);
+        assert_eq!(targets[0].package(), "chromeos-base/shill");
+        assert_eq!(
+            targets[0].dirs(),
+            &[
+                PathBuf::from("/work/cros/src/platform2/common-mk"),
+                PathBuf::from("/work/cros/src/platform2/shill"),
+                PathBuf::from("/work/cros/src/platform2/.gn"),
+            ]
+        );
+        assert_eq!(targets[1].dirs(), &[PathBuf::from("/work/cros/src/crosvm")]);
+        // CROS_WORKON_SUBDIRS_TO_COPY is preferred
+        assert_eq!(targets[2].dirs().len(), 3);
+        assert_eq!(
+            targets[2].dirs()[1],
+            PathBuf::from("/work/cros/src/platform2/vm_tools")
+        );
+        assert_eq!(
+            targets[3].dirs(),
+            &[PathBuf::from("/work/cros/src/platform2/foo")]
+        );
+    }
+
+    #[test]
+    fn changes() {
+        let dir = TempDir::new("cro3_source_watcher_test").unwrap();
+        let a = dir.path().join("a");
+        let b = dir.path().join("b");
+        fs::create_dir_all(a.join(".git")).unwrap();
+        fs::create_dir_all(&b).unwrap();
+        fs::write(a.join("main.cc"), "int main() {}").unwrap();
+        let targets = vec![
+            WatchTarget {
+                package: "pkg/a".to_string(),
+                dirs: vec![a.clone()],
+            },
+            WatchTarget {
+                package: "pkg/b".to_string(),
+                dirs: vec![b.clone()],
+            },
+        ];
+        let mut watcher = SourceWatcher::new(
+            targets,
+            Duration::from_millis(10),
+            Duration::from_millis(50),
+        )
+        .unwrap();
+        // Changes in .git should be ignored
+        fs::write(a.join(".git/index"), "x").unwrap();
+        assert!(watcher.changed().unwrap().is_empty());
+        fs::write(b.join("new.rs"), "fn main() {}").unwrap();
+        let (packages, _) = watcher.wait_for_changes().unwrap();
+        assert_eq!(packages, vec!["pkg/b"]);
+        assert!(watcher.changed().unwrap().is_empty());
+        // New directories are watched as well
+        fs::create_dir(a.join("sub")).unwrap();
+        assert_eq!(watcher.changed().unwrap(), BTreeSet::from([0]));
+        fs::write(a.join("sub/lib.cc"), "").unwrap();
+        assert_eq!(watcher.changed().unwrap(), BTreeSet::from([0]));
+    }
+}
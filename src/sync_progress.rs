@@ -0,0 +1,225 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Parses the output of `repo sync` incrementally. The output is handled in
+//! chunks as it arrives, so that forwarding and parsing it stays cheap even
+//! with hundreds of jobs updating the progress line.
+
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::Result;
+use indicatif::ProgressBar;
+use indicatif::ProgressStyle;
+use once_cell::sync::Lazy;
+use regex_macro::regex;
+use regex_macro::Regex;
+
+static RE_PROGRESS: Lazy<&Regex> = Lazy::new(|| {
+    regex!(
+        r"(?P<title>Finding sources|Fetching|Checking out):\s{1,3}(?P<percent>\d{1,3})%\s\((?P<done>\d+)/(?P<total>\d+)\)"
+    )
+});
+// Errors of git which mean that the local objects are broken
+static RE_CORRUPTION: Lazy<&Regex> = Lazy::new(|| {
+    regex!(
+        r"(?i)(corrupt|bad object|missing (blob|tree|commit)|loose object .* is empty|object file .* is empty|unable to read tree|did not send all necessary objects|index file smaller than expected|fsck)"
+    )
+});
+/// Minimum interval between redraws of the progress bar
+const REDRAW_INTERVAL: Duration = Duration::from_millis(100);
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum SyncEvent {
+    /// Progress of a stage of the sync (e.g. "Fetching")
+    Progress {
+        title: String,
+        done: u64,
+        total: u64,
+    },
+    /// An error reported by repo or git (e.g. "error: Cannot fetch ...")
+    Error { message: String },
+    /// A project listed under "Failing repos:" at the end of the sync
+    FailingRepo { path: String },
+}
+
+/// Returns true if the error means that the git objects of a project are
+/// broken. Such projects have to be cloned again instead of just retried.
+pub fn is_corruption_error(message: &str) -> bool {
+    RE_CORRUPTION.is_match(message)
+}
+
+/// SyncOutputParser splits the output into lines (progress updates are
+/// terminated by \r) and turns them into SyncEvents.
+#[derive(Debug, Default)]
+pub struct SyncOutputParser {
+    partial: Vec<u8>,
+    in_failing_repos: bool,
+}
+impl SyncOutputParser {
+    pub fn new() -> Self {
+        Self::default()
+    }
+    /// Feed a chunk of the output. Events of the complete lines in it are
+    /// passed to `handler`.
+    pub fn feed(&mut self, chunk: &[u8], handler: &mut dyn FnMut(SyncEvent)) {
+        let mut rest = chunk;
+        while let Some(i) = rest.iter().position(|b| *b == b'\r' || *b == b'\n') {
+            if self.partial.is_empty() {
+                self.handle_line(&rest[..i], handler);
+            } else {
+                self.partial.extend_from_slice(&rest[..i]);
+                let line = std::mem::take(&mut self.partial);
+                self.handle_line(&line, handler);
+            }
+            rest = &rest[i + 1..];
+        }
+        self.partial.extend_from_slice(rest);
+    }
+    /// Handle the last line without a terminator, if any.
+    pub fn finish(&mut self, handler: &mut dyn FnMut(SyncEvent)) {
+        let line = std::mem::take(&mut self.partial);
+        self.handle_line(&line, handler);
+    }
+    fn handle_line(&mut self, line: &[u8], handler: &mut dyn FnMut(SyncEvent)) {
+        if line.is_empty() {
+            // \r\n and blank lines
+            return;
+        }
+        let line = String::from_utf8_lossy(line);
+        let line = line.trim();
+        if self.in_failing_repos {
+            if line.is_empty() || line.starts_with("Try re-running") || line.contains(':') {
+                self.in_failing_repos = false;
+            } else {
+                handler(SyncEvent::FailingRepo {
+                    path: line.to_string(),
+                });
+                return;
+            }
+        }
+        if line.starts_with("Failing repos") {
+            self.in_failing_repos = true;
+        } else if line.starts_with("error:") || line.starts_with("fatal:") {
+            handler(SyncEvent::Error {
+                message: line.to_string(),
+            });
+        } else if line.contains('%') {
+            // Checking '%' first skips the regex for most of the lines
+            if let Some(c) = RE_PROGRESS.captures(line) {
+                if let (Ok(done), Ok(total)) = (c["done"].parse(), c["total"].parse()) {
+                    handler(SyncEvent::Progress {
+                        title: c["title"].to_string(),
+                        done,
+                        total,
+                    });
+                }
+            }
+        }
+    }
+}
+
+/// Shows the progress of a sync with a bounded redraw rate.
+pub struct SyncProgressBar {
+    bar: ProgressBar,
+    last_draw: Option<Instant>,
+    title: String,
+}
+impl SyncProgressBar {
+    pub fn new() -> Result<Self> {
+        let bar = ProgressBar::new(0);
+        bar.set_style(ProgressStyle::with_template(
+            "{msg:>15} {wide_bar} {pos:>4}/{len:4}",
+        )?);
+        Ok(Self {
+            bar,
+            last_draw: None,
+            title: String::new(),
+        })
+    }
+    pub fn update(&mut self, title: &str, done: u64, total: u64) {
+        let now = Instant::now();
+        let due = !matches!(self.last_draw, Some(t) if now.duration_since(t) < REDRAW_INTERVAL);
+        // Stage changes and completions are always drawn
+        if !due && title == self.title && done != total {
+            return;
+        }
+        self.last_draw = Some(now);
+        if title != self.title {
+            self.title = title.to_string();
+            self.bar.set_message(self.title.clone());
+        }
+        self.bar.set_length(total);
+        self.bar.set_position(done);
+    }
+    pub fn finish(&self) {
+        self.bar.finish_with_message("Finished");
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn corruption() {
+        assert!(is_corruption_error(
+            "error: src/platform/foo/: fatal: bad object HEAD"
+        ));
+        assert!(is_corruption_error(
+            "fatal: loose object 1234abcd (stored in .git/objects/12/34abcd) is corrupt"
+        ));
+        assert!(!is_corruption_error(
+            "error: Cannot fetch chromiumos/platform/foo from https://example.com"
+        ));
+    }
+
+    #[test]
+    fn parse_chunks() {
+        let output = "Fetching:  10% (1/10) 0:01 | 8 jobs\rFetching:  20% (2/10) 0:02\r\n\
+                      error: Cannot fetch chromiumos/platform/foo from https://example.com\n\
+                      Checking out: 100% (10/10), done.\n\
+                      Failing repos:\nsrc/platform/foo\nsrc/third_party/bar\n\
+                      Try re-running with \"-j1 --fail-fast\" to exit at the first error.\n";
+        let mut events = Vec::new();
+        let mut parser = SyncOutputParser::new();
+        // Split in the middle of lines
+        for chunk in output.as_bytes().chunks(7) {
+            parser.feed(chunk, &mut |e| events.push(e));
+        }
+        parser.finish(&mut |e| events.push(e));
+        assert_eq!(
+            events,
+            vec![
+                SyncEvent::Progress {
+                    title: "Fetching".to_string(),
+                    done: 1,
+                    total: 10
+                },
+                SyncEvent::Progress {
+                    title: "Fetching".to_string(),
+                    done: 2,
+                    total: 10
+                },
+                SyncEvent::Error {
+                    message: "error: Cannot fetch chromiumos/platform/foo from https://example.com"
+                        .to_string()
+                },
+                SyncEvent::Progress {
+                    title: "Checking out".to_string(),
+                    done: 10,
+                    total: 10
+                },
+                SyncEvent::FailingRepo {
+                    path: "src/platform/foo".to_string()
+                },
+                SyncEvent::FailingRepo {
+                    path: "src/third_party/bar".to_string()
+                },
+            ]
+        );
+    }
+}
@@ -0,0 +1,283 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Per-project timings of `repo sync`, to find the projects which dominate
+//! the sync time.
+//!
+//! The fetch (sync-network) and checkout (sync-local) durations come from the
+//! event log of repo (`repo --event-log FILE sync`). The bytes fetched are
+//! estimated from the growth of the packs of each project.
+
+use std::collections::BTreeMap;
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::fs;
+use std::path::Path;
+
+use anyhow::Result;
+use chrono::Local;
+use serde::Deserialize;
+use serde::Serialize;
+use serde_json::Value;
+
+use crate::cache::KvCache;
+
+static SYNC_STATS: KvCache<Vec<SyncStats>> = KvCache::new("sync_stats");
+/// Number of syncs kept per checkout
+const HISTORY_LEN: usize = 10;
+
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct ProjectTiming {
+    /// Name of the project on the server (e.g. chromiumos/platform2)
+    pub project: String,
+    /// Seconds spent to fetch, including retries
+    pub fetch: f64,
+    /// Seconds spent to check out
+    pub checkout: f64,
+    /// Bytes added to the packs of the project
+    pub bytes: u64,
+}
+impl ProjectTiming {
+    pub fn total(&self) -> f64 {
+        self.fetch + self.checkout
+    }
+}
+
+/// Timings of a sync, keyed by the path of the projects
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct SyncStats {
+    pub date: String,
+    pub projects: BTreeMap<String, ProjectTiming>,
+}
+
+/// Parse the event log of repo. Each line is a JSON object like
+/// {"name": "src/platform2", "project": "chromiumos/platform2",
+///  "task_name": "sync-network", "start_time": 1.0, "finish_time": 2.5, ...}
+pub fn parse_event_log(log: &str) -> BTreeMap<String, ProjectTiming> {
+    let mut projects: BTreeMap<String, ProjectTiming> = BTreeMap::new();
+    for line in log.lines() {
+        let Ok(event) = serde_json::from_str::<Value>(line) else {
+            continue;
+        };
+        let (Some(path), Some(task), Some(start), Some(finish)) = (
+            event["name"].as_str(),
+            event["task_name"].as_str(),
+            event["start_time"].as_f64(),
+            event["finish_time"].as_f64(),
+        ) else {
+            continue;
+        };
+        let seconds = (finish - start).max(0.0);
+        let p = projects.entry(path.to_string()).or_default();
+        if let Some(project) = event["project"].as_str() {
+            p.project = project.to_string();
+        }
+        match task {
+            "sync-network" => p.fetch += seconds,
+            "sync-local" => p.checkout += seconds,
+            _ => {}
+        }
+    }
+    // Commands (e.g. "sync" itself) are logged with the same format
+    projects.retain(|_, p| !p.project.is_empty());
+    projects
+}
+
+/// Add the timings of another run of repo (e.g. a retry) to `projects`.
+pub fn merge_timings(
+    projects: &mut BTreeMap<String, ProjectTiming>,
+    other: BTreeMap<String, ProjectTiming>,
+) {
+    for (path, timing) in other {
+        let p = projects.entry(path).or_default();
+        if p.project.is_empty() {
+            p.project = timing.project;
+        }
+        p.fetch += timing.fetch;
+        p.checkout += timing.checkout;
+    }
+}
+
+/// Returns the total size of the packs of each project in the checkout,
+/// keyed by the name of the project.
+pub fn pack_sizes(repo: &str) -> HashMap<String, u64> {
+    let root = Path::new(repo).join(".repo/project-objects");
+    let mut sizes = HashMap::new();
+    let mut dirs = vec![root.clone()];
+    while let Some(dir) = dirs.pop() {
+        let Ok(entries) = fs::read_dir(&dir) else {
+            continue;
+        };
+        for entry in entries.flatten() {
+            let path = entry.path();
+            if !entry.file_type().is_ok_and(|t| t.is_dir()) {
+                continue;
+            }
+            let Some(name) = path
+                .strip_prefix(&root)
+                .ok()
+                .and_then(|p| p.to_str())
+                .and_then(|p| p.strip_suffix(".git"))
+            else {
+                dirs.push(path);
+                continue;
+            };
+            let size = fs::read_dir(path.join("objects/pack"))
+                .map(|packs| {
+                    packs
+                        .flatten()
+                        .filter_map(|f| f.metadata().ok())
+                        .map(|m| m.len())
+                        .sum()
+                })
+                .unwrap_or(0);
+            sizes.insert(name.to_string(), size);
+        }
+    }
+    sizes
+}
+
+/// Fill the bytes of the projects with the growth of their packs.
+pub fn fill_bytes(
+    projects: &mut BTreeMap<String, ProjectTiming>,
+    before: &HashMap<String, u64>,
+    after: &HashMap<String, u64>,
+) {
+    for p in projects.values_mut() {
+        let before = before.get(&p.project).copied().unwrap_or(0);
+        let after = after.get(&p.project).copied().unwrap_or(0);
+        // Packs can shrink with gc
+        p.bytes = after.saturating_sub(before);
+    }
+}
+
+/// Add the stats of a sync of the checkout to the history.
+pub fn record_sync(repo: &str, projects: BTreeMap<String, ProjectTiming>) -> Result<()> {
+    let mut history = SYNC_STATS.get(repo)?.unwrap_or_default();
+    history.push(SyncStats {
+        date: Local::now().to_rfc3339(),
+        projects,
+    });
+    let excess = history.len().saturating_sub(HISTORY_LEN);
+    history.drain(..excess);
+    SYNC_STATS.set(repo, history)
+}
+
+/// Returns the recorded syncs of the checkout, oldest first.
+pub fn sync_history(repo: &str) -> Result<Vec<SyncStats>> {
+    Ok(SYNC_STATS.get(repo)?.unwrap_or_default())
+}
+
+/// Returns the slowest `n` projects of the last sync, and how they compare
+/// to the previous syncs.
+pub fn report(history: &[SyncStats], n: usize) -> String {
+    let mut r = String::new();
+    let Some((last, previous)) = history.split_last() else {
+        return "No syncs are recorded yet".to_string();
+    };
+    let fetch: f64 = last.projects.values().map(|p| p.fetch).sum();
+    let checkout: f64 = last.projects.values().map(|p| p.checkout).sum();
+    let bytes: u64 = last.projects.values().map(|p| p.bytes).sum();
+    let _ = writeln!(
+        r,
+        "Sync at {}: {} projects, fetch {fetch:.0}s, checkout {checkout:.0}s (summed over jobs), \
+         {:.1} MiB fetched",
+        last.date,
+        last.projects.len(),
+        bytes as f64 / (1 << 20) as f64
+    );
+    let _ = writeln!(
+        r,
+        "  {:<48} {:>9} {:>9} {:>10} {:>16}",
+        "project", "fetch", "checkout", "MiB", "vs prev. median"
+    );
+    let mut slowest: Vec<(&String, &ProjectTiming)> = last.projects.iter().collect();
+    slowest.sort_by(|a, b| b.1.total().total_cmp(&a.1.total()));
+    for (path, p) in slowest.iter().take(n) {
+        let mut past: Vec<f64> = previous
+            .iter()
+            .filter_map(|s| s.projects.get(*path))
+            .map(|p| p.total())
+            .collect();
+        past.sort_by(f64::total_cmp);
+        let trend = if past.is_empty() {
+            "-".to_string()
+        } else {
+            // Average of the two middle ones if the length is even
+            let k = past.len();
+            let median = (past[(k - 1) / 2] + past[k / 2]) / 2.0;
+            if median > 0.0 {
+                format!("{:+.0}%", (p.total() / median - 1.0) * 100.0)
+            } else {
+                "-".to_string()
+            }
+        };
+        let _ = writeln!(
+            r,
+            "  {path:<48} {:>8.1}s {:>8.1}s {:>10.1} {trend:>16}",
+            p.fetch,
+            p.checkout,
+            p.bytes as f64 / (1 << 20) as f64
+        );
+    }
+    r.trim_end().to_string()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn event_log() {
+        let log = r#"{"id": ["RepoOp", 1], "name": "src/platform2", "project": "chromiumos/platform2", "task_name": "sync-network", "start_time": 10.0, "finish_time": 40.0, "success": false, "try": 1}
+{"id": ["RepoOp", 2], "name": "src/platform2", "project": "chromiumos/platform2", "task_name": "sync-network", "start_time": 50.0, "finish_time": 60.0, "success": true, "try": 2}
+{"id": ["RepoOp", 3], "name": "src/platform2", "project": "chromiumos/platform2", "task_name": "sync-local", "start_time": 70.0, "finish_time": 75.0, "success": true, "try": 1}
+{"id": ["RepoOp", 4], "name": "chromite", "project": "chromiumos/chromite", "task_name": "sync-network", "start_time": 10.0, "finish_time": 12.0, "success": true, "try": 1}
+{"id": ["RepoOp", 5], "name": "sync", "task_name": "command", "start_time": 0.0, "finish_time": 80.0, "success": true}
+not a json
+"#;
+        let mut projects = parse_event_log(log);
+        assert_eq!(projects.len(), 2);
+        let platform2 = &projects["src/platform2"];
+        assert_eq!(platform2.fetch, 40.0);
+        assert_eq!(platform2.checkout, 5.0);
+
+        // The log of a retry of the project is added up
+        let retry = r#"{"id": ["RepoOp", 1], "name": "src/platform2", "project": "chromiumos/platform2", "task_name": "sync-network", "start_time": 100.0, "finish_time": 104.0, "success": true, "try": 1}"#;
+        let mut merged = projects.clone();
+        merge_timings(&mut merged, parse_event_log(retry));
+        assert_eq!(merged.len(), 2);
+        assert_eq!(merged["src/platform2"].fetch, 44.0);
+        assert_eq!(merged["src/platform2"].project, "chromiumos/platform2");
+
+        let before = HashMap::from([("chromiumos/platform2".to_string(), 100)]);
+        let after = HashMap::from([
+            ("chromiumos/platform2".to_string(), 300),
+            ("chromiumos/chromite".to_string(), 50),
+        ]);
+        fill_bytes(&mut projects, &before, &after);
+        assert_eq!(projects["src/platform2"].bytes, 200);
+        assert_eq!(projects["chromite"].bytes, 50);
+
+        let mut previous = projects.clone();
+        previous.get_mut("src/platform2").unwrap().fetch = 20.0;
+        let history = vec![
+            SyncStats {
+                date: "1".to_string(),
+                projects: previous,
+            },
+            SyncStats {
+                date: "2".to_string(),
+                projects,
+            },
+        ];
+        let report = report(&history, 10);
+        let lines: Vec<&str> = report.lines().collect();
+        // The slowest one comes first, and took 45s while 25s before
+        assert!(lines[2].starts_with("  src/platform2"), "{report}");
+        assert!(lines[2].ends_with("+80%"), "{report}");
+    }
+}
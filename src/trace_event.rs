@@ -0,0 +1,108 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Writes Chrome trace event files, which can be opened with
+//! chrome://tracing or https://ui.perfetto.dev.
+
+use std::fs;
+use std::path::PathBuf;
+use std::time::Duration;
+
+use anyhow::Context;
+use anyhow::Result;
+use chrono::Local;
+use serde_json::json;
+use serde_json::Value;
+
+use crate::util::cro3_paths::gen_path_in_cro3_dir;
+
+#[derive(Debug, Default)]
+pub struct TraceWriter {
+    events: Vec<Value>,
+}
+impl TraceWriter {
+    pub fn new() -> Self {
+        Self::default()
+    }
+    /// Add a span which starts at `start` (relative to the beginning of the
+    /// trace) and lasts for `duration`. Spans with the same `lane` are shown
+    /// in the same row.
+    pub fn span(
+        &mut self,
+        name: &str,
+        category: &str,
+        lane: usize,
+        start: Duration,
+        duration: Duration,
+    ) {
+        self.events.push(json!({
+            "name": name,
+            "cat": category,
+            "ph": "X",
+            "pid": 1,
+            "tid": lane,
+            "ts": start.as_micros() as u64,
+            "dur": duration.as_micros() as u64,
+        }));
+    }
+    /// Add a sample of a counter, shown as a graph.
+    pub fn counter(&mut self, name: &str, at: Duration, value: usize) {
+        self.events.push(json!({
+            "name": name,
+            "ph": "C",
+            "pid": 1,
+            "ts": at.as_micros() as u64,
+            "args": { name: value },
+        }));
+    }
+    /// Give a name to a lane.
+    pub fn lane_name(&mut self, lane: usize, name: &str) {
+        self.events.push(json!({
+            "name": "thread_name",
+            "ph": "M",
+            "pid": 1,
+            "tid": lane,
+            "args": { "name": name },
+        }));
+    }
+    pub fn to_json(&self) -> Value {
+        json!({ "traceEvents": self.events })
+    }
+    /// Write the trace to ~/.cro3/{dir}/{prefix}-{timestamp}.json and return
+    /// the path of it.
+    pub fn save(&self, dir: &str, prefix: &str) -> Result<PathBuf> {
+        let timestamp = Local::now().format("%Y%m%d-%H%M%S");
+        let path = gen_path_in_cro3_dir(&format!("{dir}/{prefix}-{timestamp}.json"))?;
+        fs::write(&path, self.to_json().to_string())
+            .context(format!("Failed to write a trace to {path:?}"))?;
+        Ok(path)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    #[test]
+    fn events() {
+        let mut trace = TraceWriter::new();
+        trace.lane_name(0, "slot 0");
+        trace.span(
+            "chromeos-base/shill",
+            "build",
+            0,
+            Duration::from_millis(1500),
+            Duration::from_secs(2),
+        );
+        trace.counter("running", Duration::from_secs(1), 3);
+        let json = trace.to_json();
+        let events = json["traceEvents"].as_array().unwrap();
+        assert_eq!(events.len(), 3);
+        assert_eq!(events[1]["ph"], "X");
+        assert_eq!(events[1]["ts"], 1_500_000);
+        assert_eq!(events[1]["dur"], 2_000_000);
+        assert_eq!(events[2]["args"]["running"], 3);
+    }
+}
@@ -0,0 +1,464 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Writes an image to USB sticks (or any block devices / files).
+//!
+//! The image is decompressed by multi-threaded xz / zstd if needed, and read
+//! into large aligned blocks. The blocks are queued to a writer thread per
+//! destination, which writes them with O_DIRECT, and to a hasher thread so
+//! that the written data can be verified without reading the image again.
+
+use std::fs::File;
+use std::fs::OpenOptions;
+use std::io::Read;
+use std::io::Write;
+use std::os::unix::fs::FileExt;
+use std::os::unix::fs::OpenOptionsExt;
+use std::path::Path;
+use std::path::PathBuf;
+use std::process::Child;
+use std::process::Command;
+use std::process::Stdio;
+use std::sync::mpsc;
+use std::sync::Arc;
+use std::thread;
+use std::time::Instant;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use indicatif::ProgressBar;
+use indicatif::ProgressStyle;
+use nix::libc::O_DIRECT;
+use sha2::Digest;
+use sha2::Sha256;
+use tracing::info;
+use tracing::warn;
+
+use crate::util::hash::hex_digest;
+
+const BLOCK_SIZE: usize = 8 << 20;
+/// O_DIRECT requires the buffer, offset and length to be aligned to the
+/// logical block size of the device. 4KiB covers all the common devices.
+const ALIGN: usize = 4096;
+/// Blocks queued per destination. Bounds the memory usage while letting
+/// slower sticks fall behind for a while.
+const QUEUE_DEPTH: usize = 8;
+/// Blocks kept for reuse. A block is in a queue, being written / hashed, or
+/// being filled, so this many are enough to avoid allocating new ones.
+const POOL_SIZE: usize = QUEUE_DEPTH + 2;
+
+/// A block of the image in an aligned buffer
+struct Block {
+    buf: Vec<u8>,
+    start: usize,
+    len: usize,
+}
+impl Block {
+    fn new() -> Self {
+        let buf = vec![0u8; BLOCK_SIZE + ALIGN];
+        let start = buf.as_ptr().align_offset(ALIGN);
+        Self { buf, start, len: 0 }
+    }
+    fn data(&self) -> &[u8] {
+        &self.buf[self.start..self.start + self.len]
+    }
+    /// Fill the block from `src`. Returns false on EOF.
+    fn fill(&mut self, src: &mut impl Read) -> Result<bool> {
+        let buf = &mut self.buf[self.start..self.start + BLOCK_SIZE];
+        let mut len = 0;
+        while len < BLOCK_SIZE {
+            let n = src.read(&mut buf[len..])?;
+            if n == 0 {
+                break;
+            }
+            len += n;
+        }
+        self.len = len;
+        Ok(len > 0)
+    }
+}
+
+/// Give a block back to the reader, if this was its last user.
+fn recycle(block: Arc<Block>, pool: &mpsc::SyncSender<Block>) {
+    if let Some(block) = Arc::into_inner(block) {
+        // Dropped if the pool is full or the reader has stopped
+        let _ = pool.try_send(block);
+    }
+}
+
+/// Open the image, decompressing it with an external tool if needed.
+fn open_image(image: &Path) -> Result<(Box<dyn Read + Send>, Option<Child>)> {
+    let name = image.to_string_lossy();
+    let decompress = if name.ends_with(".tar.xz") {
+        Some(vec![
+            "tar",
+            "-I",
+            "xz -T0",
+            "-xOf",
+            &name,
+            "--wildcards",
+            "*.bin",
+        ])
+    } else if name.ends_with(".xz") {
+        Some(vec!["xz", "-dc", "-T0", &name])
+    } else if name.ends_with(".zst") {
+        Some(vec!["zstd", "-dc", "-T0", &name])
+    } else {
+        None
+    };
+    let Some(cmd) = decompress else {
+        let file = File::open(image).context(format!("Failed to open {image:?}"))?;
+        return Ok((Box::new(file), None));
+    };
+    let mut child = Command::new(cmd[0])
+        .args(&cmd[1..])
+        .stdout(Stdio::piped())
+        .spawn()
+        .context(format!("Failed to run {}", cmd[0]))?;
+    let stdout = child
+        .stdout
+        .take()
+        .context(format!("Failed to get the output of {}", cmd[0]))?;
+    Ok((Box::new(stdout), Some(child)))
+}
+
+/// Open a destination for writing, with O_DIRECT if it supports.
+fn open_destination(path: &Path) -> Result<(File, bool)> {
+    let direct = OpenOptions::new()
+        .write(true)
+        .custom_flags(O_DIRECT)
+        .open(path);
+    match direct {
+        Ok(file) => Ok((file, true)),
+        Err(e) => {
+            // e.g. files on tmpfs
+            warn!("{path:?} does not support O_DIRECT ({e}), using buffered writes");
+            let file = OpenOptions::new()
+                .write(true)
+                .open(path)
+                .context(format!("Failed to open {path:?}"))?;
+            Ok((file, false))
+        }
+    }
+}
+
+/// Write the blocks received from `rx` to `path`. Returns the bytes written.
+fn write_blocks(
+    path: &Path,
+    rx: mpsc::Receiver<Arc<Block>>,
+    pool: mpsc::SyncSender<Block>,
+) -> Result<u64> {
+    let (mut file, direct) = open_destination(path)?;
+    let mut written = 0u64;
+    for block in rx {
+        let data = block.data();
+        if direct && data.len() % ALIGN != 0 {
+            // The unaligned tail of the image can not be written with
+            // O_DIRECT.
+            let tail = OpenOptions::new().write(true).open(path)?;
+            tail.write_all_at(data, written)?;
+            tail.sync_all()?;
+        } else {
+            file.write_all(data)
+                .context(format!("Failed to write to {path:?} at {written}"))?;
+        }
+        written += data.len() as u64;
+        recycle(block, &pool);
+    }
+    file.sync_all()
+        .context(format!("Failed to flush {path:?}"))?;
+    Ok(written)
+}
+
+/// Returns the sha256 of the first `len` bytes of `path`.
+fn hash_destination(path: &Path, len: u64) -> Result<String> {
+    let mut file = match OpenOptions::new()
+        .read(true)
+        .custom_flags(O_DIRECT)
+        .open(path)
+    {
+        Ok(file) => file,
+        Err(_) => File::open(path).context(format!("Failed to open {path:?}"))?,
+    };
+    let mut hasher = Sha256::new();
+    let mut block = Block::new();
+    let mut remaining = len;
+    while remaining > 0 {
+        // Reads with O_DIRECT have to be aligned. Data beyond the image
+        // (if any) is just ignored.
+        let want = (remaining as usize).min(BLOCK_SIZE).next_multiple_of(ALIGN);
+        let buf = &mut block.buf[block.start..block.start + want];
+        let n = file.read(buf)?;
+        if n == 0 {
+            bail!("{path:?} is shorter than the image");
+        }
+        let n = (n as u64).min(remaining);
+        hasher.update(&buf[..n as usize]);
+        remaining -= n;
+    }
+    Ok(hex_digest(hasher))
+}
+
+/// Result of writing to a destination
+#[derive(Debug)]
+pub struct WriteResult {
+    pub destination: PathBuf,
+    pub result: Result<()>,
+}
+
+/// Write `image` (.bin, .bin.xz, .bin.zst or an archive .tar.xz with a .bin
+/// in it) to all the `destinations` at once, and verify them. Each
+/// destination succeeds or fails independently.
+pub fn write_image(
+    image: &Path,
+    destinations: &[PathBuf],
+    verify: bool,
+) -> Result<Vec<WriteResult>> {
+    if destinations.is_empty() {
+        bail!("No destinations to write to");
+    }
+    let (mut src, decompressor) = open_image(image)?;
+    let start = Instant::now();
+    let bar = ProgressBar::new_spinner();
+    bar.set_style(ProgressStyle::with_template(
+        "{spinner} {msg} {bytes} written ({bytes_per_sec}, {elapsed})",
+    )?);
+    bar.set_message(format!("{}", image.display()));
+
+    let (hash_tx, hash_rx) = mpsc::sync_channel::<Arc<Block>>(QUEUE_DEPTH);
+    // Blocks come back here once they are hashed and written everywhere
+    let (pool_tx, pool_rx) = mpsc::sync_channel::<Block>(POOL_SIZE);
+    let (written, source_hash, read_result) = thread::scope(|s| {
+        let pool = pool_tx.clone();
+        let hasher = s.spawn(move || {
+            let mut hasher = Sha256::new();
+            let mut len = 0u64;
+            for block in hash_rx {
+                hasher.update(block.data());
+                len += block.data().len() as u64;
+                recycle(block, &pool);
+            }
+            (hex_digest(hasher), len)
+        });
+        let mut senders = Vec::new();
+        let mut writers = Vec::new();
+        for dst in destinations {
+            let (tx, rx) = mpsc::sync_channel::<Arc<Block>>(QUEUE_DEPTH);
+            senders.push(Some(tx));
+            let pool = pool_tx.clone();
+            writers.push(s.spawn(move || write_blocks(dst, rx, pool)));
+        }
+        drop(pool_tx);
+        let read_result = (|| -> Result<()> {
+            loop {
+                let mut block = pool_rx.try_recv().unwrap_or_else(|_| Block::new());
+                if !block.fill(&mut src)? {
+                    return Ok(());
+                }
+                let block = Arc::new(block);
+                bar.inc(block.len as u64);
+                hash_tx
+                    .send(block.clone())
+                    .map_err(|_| anyhow!("Hashing thread stopped"))?;
+                for tx in senders.iter_mut() {
+                    // A failed writer drops its receiver. Keep writing to
+                    // the others.
+                    if tx.as_ref().is_some_and(|t| t.send(block.clone()).is_err()) {
+                        *tx = None;
+                    }
+                }
+                if senders.iter().all(Option::is_none) {
+                    bail!("Failed to write to all the destinations");
+                }
+            }
+        })();
+        drop(hash_tx);
+        drop(senders);
+        let written: Vec<Result<u64>> = writers
+            .into_iter()
+            .map(|w| w.join().map_err(|_| anyhow!("Writer thread panicked"))?)
+            .collect();
+        (written, hasher.join(), read_result)
+    });
+    bar.finish_and_clear();
+    // Close the pipe first, so that the decompressor can't block on it
+    drop(src);
+    if let Some(mut child) = decompressor {
+        if read_result.is_err() {
+            // The rest of the output was not read
+            let _ = child.kill();
+            let _ = child.wait();
+        } else {
+            child
+                .wait()?
+                .exit_ok()
+                .context("Failed to decompress the image")?;
+        }
+    }
+    let (source_hash, len) = source_hash.map_err(|_| anyhow!("Hashing thread panicked"))?;
+    // Errors of the writers are more informative than the one of the reader
+    // in that case.
+    if let Err(e) = read_result {
+        if written.iter().any(|w| w.is_ok()) {
+            return Err(e);
+        }
+    }
+    info!(
+        "Wrote {} MiB to {} destinations in {:.1?}",
+        len >> 20,
+        destinations.len(),
+        start.elapsed()
+    );
+    let results = thread::scope(|s| {
+        let handles: Vec<_> = destinations
+            .iter()
+            .zip(written)
+            .map(|(dst, written)| {
+                let source_hash = &source_hash;
+                s.spawn(move || -> Result<()> {
+                    let written = written?;
+                    if written != len {
+                        bail!("Only {written} of {len} bytes were written");
+                    }
+                    if verify {
+                        let hash = hash_destination(dst, len)?;
+                        if &hash != source_hash {
+                            bail!("Hash mismatch: expected {source_hash}, but got {hash}");
+                        }
+                    }
+                    Ok(())
+                })
+            })
+            .collect();
+        destinations
+            .iter()
+            .zip(handles)
+            .map(|(dst, h)| WriteResult {
+                destination: dst.clone(),
+                result: h
+                    .join()
+                    .map_err(|_| anyhow!("Verification thread panicked"))
+                    .and_then(|r| r),
+            })
+            .collect()
+    });
+    Ok(results)
+}
+
+/// Returns the removable USB block devices (e.g. /dev/sdb).
+pub fn list_usb_devices() -> Result<Vec<PathBuf>> {
+    let output = Command::new("lsblk")
+        .args(["-dnpo", "NAME,TRAN,RM"])
+        .output()
+        .context("Failed to run lsblk")?;
+    output.status.exit_ok().context("lsblk failed")?;
+    Ok(String::from_utf8_lossy(&output.stdout)
+        .lines()
+        .filter_map(|line| {
+            let fields: Vec<&str> = line.split_whitespace().collect();
+            (fields.len() == 3 && fields[1] == "usb" && fields[2] == "1")
+                .then(|| PathBuf::from(fields[0]))
+        })
+        .collect())
+}
+
+/// Parse the output of `lsblk -nrpo NAME,MOUNTPOINT` into the mounted
+/// devices and their mount points.
+fn parse_mounts(output: &str) -> Vec<(String, String)> {
+    output
+        .lines()
+        .filter_map(|line| {
+            let (name, mountpoint) = line.split_once(' ')?;
+            let mountpoint = mountpoint.trim();
+            (!mountpoint.is_empty()).then(|| (name.to_string(), mountpoint.to_string()))
+        })
+        .collect()
+}
+
+/// Make sure that `dev` is one of the removable USB disks, and that none of
+/// its partitions is mounted, before overwriting it.
+pub fn check_usb_device(dev: &Path, usb_devices: &[PathBuf]) -> Result<PathBuf> {
+    let dev = dev
+        .canonicalize()
+        .context(format!("Failed to resolve {dev:?}"))?;
+    if !usb_devices.contains(&dev) {
+        bail!("{dev:?} is not a removable USB disk (found: {usb_devices:?})");
+    }
+    let output = Command::new("lsblk")
+        .args(["-nrpo", "NAME,MOUNTPOINT"])
+        .arg(&dev)
+        .output()
+        .context("Failed to run lsblk")?;
+    output.status.exit_ok().context("lsblk failed")?;
+    let mounts = parse_mounts(&String::from_utf8_lossy(&output.stdout));
+    if !mounts.is_empty() {
+        bail!("{dev:?} has mounted partitions: {mounts:?}. Please unmount them first.");
+    }
+    Ok(dev)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+
+    use tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn write_to_files() {
+        let dir = TempDir::new("cro3_usb_writer_test").unwrap();
+        let dir = dir.path();
+        // Not a multiple of the block size nor the alignment
+        let image: Vec<u8> = (0..BLOCK_SIZE * 2 + 12345)
+            .map(|i| (i % 251) as u8)
+            .collect();
+        let image_path = dir.join("image.bin");
+        fs::write(&image_path, &image).unwrap();
+        // Like loop devices, destinations exist and are larger than the image
+        let destinations: Vec<PathBuf> = (0..2).map(|i| dir.join(format!("usb{i}"))).collect();
+        for dst in &destinations {
+            fs::write(dst, vec![0xffu8; image.len() + 4096]).unwrap();
+        }
+        let missing = dir.join("missing/usb");
+        let mut all = destinations.clone();
+        all.push(missing.clone());
+        let results = write_image(&image_path, &all, true).unwrap();
+        assert_eq!(results.len(), 3);
+        for r in &results[..2] {
+            assert!(r.result.is_ok(), "{:?}", r.result);
+            let written = fs::read(&r.destination).unwrap();
+            assert_eq!(&written[..image.len()], &image[..]);
+        }
+        assert_eq!(results[2].destination, missing);
+        assert!(results[2].result.is_err());
+    }
+
+    #[test]
+    fn mounts() {
+        let output =
+            "/dev/sdb \n/dev/sdb1 /media/user/STATE\n/dev/sdb3 \n/dev/sdb12                       \
+             /media/user/EFI\\x20SYSTEM\n";
+        assert_eq!(
+            parse_mounts(output),
+            vec![
+                ("/dev/sdb1".to_string(), "/media/user/STATE".to_string()),
+                (
+                    "/dev/sdb12".to_string(),
+                    "/media/user/EFI\\x20SYSTEM".to_string()
+                ),
+            ]
+        );
+        assert!(parse_mounts("/dev/sdc \n/dev/sdc1 \n").is_empty());
+
+        let dir = TempDir::new("cro3_usb_writer_test").unwrap();
+        let dev = dir.path().join("sdz");
+        fs::write(&dev, "").unwrap();
+        assert!(check_usb_device(&dev, &[PathBuf::from("/dev/sdb")]).is_err());
+    }
+}
@@ -5,5 +5,8 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 pub mod cro3_paths;
+pub mod hash;
+pub mod host_resources;
 pub mod shell_helpers;
+pub mod size;
 pub mod super_user_helpers;
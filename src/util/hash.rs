@@ -0,0 +1,53 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+use std::fs::File;
+use std::io;
+use std::path::Path;
+
+use anyhow::Context;
+use anyhow::Result;
+use sha2::Digest;
+use sha2::Sha256;
+
+/// Returns the hex encoded sha256 of the data fed to `hasher`.
+pub fn hex_digest(hasher: Sha256) -> String {
+    format!("{:x}", hasher.finalize())
+}
+
+/// Returns the hex encoded sha256 of `data`.
+pub fn sha256_hex(data: &[u8]) -> String {
+    hex_digest(Sha256::new_with_prefix(data))
+}
+
+/// Returns the hex encoded sha256 of the file.
+pub fn sha256_file(path: &Path) -> Result<String> {
+    let mut hasher = Sha256::new();
+    io::copy(
+        &mut File::open(path).context(format!("Failed to open {path:?}"))?,
+        &mut hasher,
+    )
+    .context(format!("Failed to read {path:?}"))?;
+    Ok(hex_digest(hasher))
+}
+
+#[cfg(test)]
+mod tests {
+    use tempdir::TempDir;
+
+    use super::*;
+
+    #[test]
+    fn sha256() {
+        let abc = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+        assert_eq!(sha256_hex(b"abc"), abc);
+        let dir = TempDir::new("cro3_hash_test").unwrap();
+        let path = dir.path().join("abc");
+        std::fs::write(&path, "abc").unwrap();
+        assert_eq!(sha256_file(&path).unwrap(), abc);
+        assert!(sha256_file(&dir.path().join("missing")).is_err());
+    }
+}
@@ -0,0 +1,116 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+use std::fs::read_to_string;
+
+use anyhow::Context;
+use anyhow::Result;
+
+pub fn cpu_count() -> usize {
+    num_cpus::get()
+}
+
+/// MemInfo holds the memory stats of the host, taken from /proc/meminfo
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct MemInfo {
+    total_kib: u64,
+    available_kib: u64,
+}
+impl MemInfo {
+    pub fn read() -> Result<Self> {
+        let meminfo = read_to_string("/proc/meminfo").context("Failed to read /proc/meminfo")?;
+        Self::parse(&meminfo)
+    }
+    fn parse(meminfo: &str) -> Result<Self> {
+        let get = |key: &str| -> Result<u64> {
+            let line = meminfo
+                .lines()
+                .find(|line| line.starts_with(key))
+                .context(format!("{key} not found in /proc/meminfo"))?;
+            line.trim_start_matches(key)
+                .trim()
+                .trim_end_matches("kB")
+                .trim()
+                .parse::<u64>()
+                .context(format!("Failed to parse {key} in /proc/meminfo"))
+        };
+        Ok(Self {
+            total_kib: get("MemTotal:")?,
+            available_kib: get("MemAvailable:")?,
+        })
+    }
+    pub fn total_kib(&self) -> u64 {
+        self.total_kib
+    }
+    pub fn available_kib(&self) -> u64 {
+        self.available_kib
+    }
+}
+
+/// MemoryPressure holds the pressure stall information (PSI) of memory, taken
+/// from /proc/pressure/memory. Values are the percentage of the time in the
+/// last 10 seconds some (or all) tasks were stalled waiting for memory.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct MemoryPressure {
+    some_avg10: f64,
+    full_avg10: f64,
+}
+impl MemoryPressure {
+    pub fn read() -> Result<Self> {
+        let psi = read_to_string("/proc/pressure/memory")
+            .context("Failed to read /proc/pressure/memory (PSI is not enabled?)")?;
+        Self::parse(&psi)
+    }
+    /// Parse the contents of /proc/pressure/memory
+    pub fn parse(psi: &str) -> Result<Self> {
+        let get = |kind: &str| -> Result<f64> {
+            psi.lines()
+                .filter_map(|line| line.strip_prefix(kind))
+                .flat_map(|line| line.split_whitespace())
+                .find_map(|field| field.strip_prefix("avg10="))
+                .context(format!("{kind}avg10 not found in /proc/pressure/memory"))?
+                .parse::<f64>()
+                .context("Failed to parse /proc/pressure/memory")
+        };
+        Ok(Self {
+            some_avg10: get("some ")?,
+            full_avg10: get("full ")?,
+        })
+    }
+    pub fn some_avg10(&self) -> f64 {
+        self.some_avg10
+    }
+    pub fn full_avg10(&self) -> f64 {
+        self.full_avg10
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    #[test]
+    fn parse_meminfo() {
+        let meminfo = "MemTotal:       263781916 kB
+MemFree:        100000000 kB
+MemAvailable:   200000000 kB
+Buffers:          1234567 kB
+";
+        let info = MemInfo::parse(meminfo).unwrap();
+        assert_eq!(info.total_kib(), 263781916);
+        assert_eq!(info.available_kib(), 200000000);
+        assert!(MemInfo::parse("MemTotal: 1 kB").is_err());
+    }
+    #[test]
+    fn parse_psi() {
+        let psi = "some avg10=12.50 avg60=3.00 avg300=1.00 total=123456
+full avg10=4.25 avg60=1.00 avg300=0.50 total=65432
+";
+        let p = MemoryPressure::parse(psi).unwrap();
+        assert_eq!(p.some_avg10(), 12.5);
+        assert_eq!(p.full_avg10(), 4.25);
+        assert!(MemoryPressure::parse("some avg10=1.00").is_err());
+    }
+}
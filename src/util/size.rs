@@ -0,0 +1,45 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+
+/// Parse a size like "512M", "50G" or "1T" into bytes.
+pub fn parse_size(size: &str) -> Result<u64> {
+    let size = size.trim();
+    let (num, unit) = size.split_at(
+        size.find(|c: char| !c.is_ascii_digit())
+            .unwrap_or(size.len()),
+    );
+    let num: u64 = num.parse().context(format!("Invalid size: {size:?}"))?;
+    let shift = match unit.trim_end_matches(['B', 'i']) {
+        "" => 0,
+        "K" | "k" => 10,
+        "M" => 20,
+        "G" => 30,
+        "T" => 40,
+        _ => bail!("Invalid unit of size: {size:?}"),
+    };
+    num.checked_mul(1 << shift)
+        .context(format!("Too large size: {size:?}"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn size() {
+        assert_eq!(parse_size("1234").unwrap(), 1234);
+        assert_eq!(parse_size("512M").unwrap(), 512 << 20);
+        assert_eq!(parse_size("50G").unwrap(), 50 << 30);
+        assert_eq!(parse_size("2TiB").unwrap(), 2 << 40);
+        assert!(parse_size("10X").is_err());
+        assert!(parse_size("G").is_err());
+        assert!(parse_size("100000000T").is_err());
+    }
+}
@@ -0,0 +1,345 @@
+// Copyright 2023 The ChromiumOS Authors
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+//! Per-board index of the ChromiumOS versions built by the release builders.
+//!
+//! The index is built from one listing of
+//! gs://chromeos-image-archive/{board}-release/ and kept in
+//! ~/.cro3/version_index. Later refreshes only list the latest milestones,
+//! so resolving a version is a local lookup in most cases.
+
+use std::collections::BTreeSet;
+use std::fmt;
+use std::str::FromStr;
+
+use anyhow::Context;
+use anyhow::Result;
+use chrono::Utc;
+use once_cell::sync::Lazy;
+use regex_macro::regex;
+use regex_macro::Regex;
+use serde::Deserialize;
+use serde::Serialize;
+use tracing::info;
+
+use crate::cache::KvCache;
+use crate::google_storage::list_gs_files;
+
+static VERSION_INDEX: KvCache<BoardIndex> = KvCache::new("version_index");
+static RE_VERSION_DIR: Lazy<&Regex> =
+    Lazy::new(|| regex!(r"/([^/]+)-release/(R\d+-\d+\.\d+\.\d+)/?$"));
+/// "latest" lookups refresh the index if it is older than this
+const MAX_AGE_SECS: i64 = 60 * 60;
+
+/// GsLister lists objects / prefixes on Cloud Storage. It is a trait so that
+/// tests can serve a fake bucket.
+pub trait GsLister {
+    /// Returns the URLs matching the patterns, like `gsutil ls -d`.
+    fn list(&self, patterns: &[String]) -> Result<Vec<String>>;
+}
+
+/// Lists with gsutil.py
+pub struct Gsutil;
+impl GsLister for Gsutil {
+    fn list(&self, patterns: &[String]) -> Result<Vec<String>> {
+        let output = list_gs_files(&format!("-d {}", patterns.join(" ")))?;
+        Ok(output.lines().map(str::to_string).collect())
+    }
+}
+
+/// A full version of ChromiumOS (e.g. R120-15662.0.0)
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct CrosVersion {
+    pub milestone: u32,
+    pub build: u32,
+    pub branch: u32,
+    pub patch: u32,
+}
+impl CrosVersion {
+    /// Returns the version without the milestone (e.g. 15662.0.0)
+    pub fn platform_version(&self) -> String {
+        format!("{}.{}.{}", self.build, self.branch, self.patch)
+    }
+}
+impl FromStr for CrosVersion {
+    type Err = anyhow::Error;
+    fn from_str(s: &str) -> Result<Self> {
+        let c = regex!(r"^R(\d+)-(\d+)\.(\d+)\.(\d+)$")
+            .captures(s.trim())
+            .context(format!("Invalid version: {s}"))?;
+        Ok(Self {
+            milestone: c[1].parse()?,
+            build: c[2].parse()?,
+            branch: c[3].parse()?,
+            patch: c[4].parse()?,
+        })
+    }
+}
+impl fmt::Display for CrosVersion {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "R{}-{}.{}.{}",
+            self.milestone, self.build, self.branch, self.patch
+        )
+    }
+}
+
+/// Versions of a board
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct BoardIndex {
+    versions: BTreeSet<String>,
+    /// Unix time of the last refresh
+    updated: i64,
+}
+impl BoardIndex {
+    fn parsed(&self) -> impl Iterator<Item = CrosVersion> + '_ {
+        self.versions.iter().filter_map(|v| v.parse().ok())
+    }
+    fn add_listing(&mut self, urls: &[String]) {
+        for url in urls {
+            if let Some(c) = RE_VERSION_DIR.captures(url.trim()) {
+                self.versions.insert(c[2].to_string());
+            }
+        }
+    }
+    /// Fetch the versions. The whole listing is fetched for the first time,
+    /// and only the latest milestone and the next one after that.
+    pub fn refresh(&mut self, board: &str, lister: &dyn GsLister) -> Result<()> {
+        let base = format!("gs://chromeos-image-archive/{board}-release");
+        let patterns = match self.parsed().map(|v| v.milestone).max() {
+            Some(m) => vec![format!("{base}/R{m}-*"), format!("{base}/R{}-*", m + 1)],
+            None => vec![format!("{base}/")],
+        };
+        let urls = lister.list(&patterns)?;
+        self.add_listing(&urls);
+        self.updated = Utc::now().timestamp();
+        Ok(())
+    }
+    /// Look for a platform version in any milestone. Builds of older branches
+    /// (e.g. R118-15000.12.0) are not covered by the incremental refresh.
+    fn fetch_version(
+        &mut self,
+        board: &str,
+        platform_version: &str,
+        lister: &dyn GsLister,
+    ) -> Result<Option<CrosVersion>> {
+        let pattern = format!("gs://chromeos-image-archive/{board}-release/R*-{platform_version}");
+        self.add_listing(&lister.list(&[pattern])?);
+        Ok(self.find(platform_version))
+    }
+    fn is_stale(&self) -> bool {
+        Utc::now().timestamp() - self.updated > MAX_AGE_SECS
+    }
+    /// Find the full version of a platform version (e.g. 15662.0.0).
+    pub fn find(&self, platform_version: &str) -> Option<CrosVersion> {
+        self.parsed()
+            .find(|v| v.platform_version() == platform_version)
+    }
+    /// Returns the latest `n` versions, newest first.
+    pub fn latest(&self, n: usize) -> Vec<CrosVersion> {
+        let mut versions: Vec<CrosVersion> = self.parsed().collect();
+        versions.sort();
+        versions.into_iter().rev().take(n).collect()
+    }
+}
+
+fn load(board: &str) -> Result<BoardIndex> {
+    Ok(VERSION_INDEX.get(board)?.unwrap_or_default())
+}
+
+/// Resolve a platform version (e.g. 15662.0.0) of the board to the full
+/// version (e.g. R120-15662.0.0). The index is refreshed only if the version
+/// is not known yet.
+pub fn find_full_version(
+    board: &str,
+    platform_version: &str,
+    lister: &dyn GsLister,
+) -> Result<CrosVersion> {
+    let mut index = load(board)?;
+    if let Some(v) = index.find(platform_version) {
+        return Ok(v);
+    }
+    info!("Updating the version index of {board}...");
+    index.refresh(board, lister)?;
+    VERSION_INDEX.set(board, index.clone())?;
+    if let Some(v) = index.find(platform_version) {
+        return Ok(v);
+    }
+    let found = index.fetch_version(board, platform_version, lister)?;
+    VERSION_INDEX.set(board, index)?;
+    found.context(format!("{platform_version} is not found for {board}"))
+}
+
+/// Resolve a platform version without knowing the board. The milestone of a
+/// version is the same on all boards, so the indexes of all boards are
+/// searched first, then the builds of all the release builders.
+pub fn find_full_version_of_any_board(
+    platform_version: &str,
+    lister: &dyn GsLister,
+) -> Result<CrosVersion> {
+    let indexes = VERSION_INDEX.entries()?;
+    if let Some(v) = indexes
+        .values()
+        .find_map(|index| index.find(platform_version))
+    {
+        return Ok(v);
+    }
+    info!("Looking for {platform_version} in the builds of all boards...");
+    let pattern = format!("gs://chromeos-image-archive/*-release/R*-{platform_version}");
+    let mut found = None;
+    for url in lister.list(&[pattern])? {
+        let Some(c) = RE_VERSION_DIR.captures(url.trim()) else {
+            continue;
+        };
+        found = found.or(c[2].parse().ok());
+        // Only the boards with an index, as a partial index would stop the
+        // first refresh from listing everything
+        if let Some(mut index) = indexes.get(&c[1]).cloned() {
+            index.add_listing(std::slice::from_ref(&url));
+            VERSION_INDEX.set(&c[1], index)?;
+        }
+    }
+    found.context(format!("{platform_version} is not found"))
+}
+
+/// Returns the latest `n` versions of the board, newest first.
+pub fn latest_versions(
+    board: &str,
+    n: usize,
+    refresh: bool,
+    lister: &dyn GsLister,
+) -> Result<Vec<CrosVersion>> {
+    let mut index = load(board)?;
+    if refresh || index.is_stale() {
+        info!("Updating the version index of {board}...");
+        index.refresh(board, lister)?;
+        VERSION_INDEX.set(board, index.clone())?;
+    }
+    Ok(index.latest(n))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::cell::Cell;
+    use std::cell::RefCell;
+
+    use anyhow::bail;
+
+    use super::*;
+
+    const BUCKET: &str = "gs://chromeos-image-archive/";
+
+    /// Serves a fixed set of version dirs (e.g. brya-release/R120-15662.0.0),
+    /// and records the requests
+    #[derive(Default)]
+    struct FakeBucket {
+        dirs: Vec<&'static str>,
+        requests: RefCell<Vec<Vec<String>>>,
+        broken: Cell<bool>,
+    }
+    impl GsLister for FakeBucket {
+        fn list(&self, patterns: &[String]) -> Result<Vec<String>> {
+            self.requests.borrow_mut().push(patterns.to_vec());
+            if self.broken.get() {
+                bail!("AccessDeniedException: 403");
+            }
+            Ok(self
+                .dirs
+                .iter()
+                .map(|d| format!("{BUCKET}{d}/"))
+                .filter(|url| {
+                    patterns.iter().any(|p| {
+                        // A dir lists its children, others are globs
+                        p.ends_with('/') && url.starts_with(p.as_str())
+                            || glob(p, url.trim_end_matches('/'))
+                    })
+                })
+                .collect())
+        }
+    }
+    fn glob(pattern: &str, s: &str) -> bool {
+        match pattern.split_once('*') {
+            None => pattern == s,
+            Some((head, tail)) => {
+                s.starts_with(head) && (head.len()..=s.len()).any(|i| glob(tail, &s[i..]))
+            }
+        }
+    }
+
+    #[test]
+    fn index() {
+        let mut bucket = FakeBucket {
+            dirs: vec![
+                "brya-release/R119-15633.0.0",
+                "brya-release/R120-15662.0.0",
+                "brya-release/R120-15663.0.0",
+                "eve-release/R120-15662.0.0",
+            ],
+            ..Default::default()
+        };
+        let mut index = BoardIndex::default();
+        index.refresh("brya", &bucket).unwrap();
+        assert_eq!(
+            index.find("15662.0.0").map(|v| v.to_string()),
+            Some("R120-15662.0.0".to_string())
+        );
+        assert_eq!(index.find("1.0.0"), None);
+
+        bucket.dirs.push("brya-release/R121-15700.0.0");
+        bucket.dirs.push("brya-release/R118-15000.12.0");
+        index.refresh("brya", &bucket).unwrap();
+        // Only the latest milestones are listed
+        assert_eq!(
+            bucket.requests.borrow()[1],
+            vec![
+                format!("{BUCKET}brya-release/R120-*"),
+                format!("{BUCKET}brya-release/R121-*")
+            ]
+        );
+        assert_eq!(
+            index
+                .latest(2)
+                .iter()
+                .map(|v| v.to_string())
+                .collect::<Vec<_>>(),
+            vec!["R121-15700.0.0", "R120-15663.0.0"]
+        );
+        assert_eq!(index.find("15000.12.0"), None);
+        // A build of an older branch is found by listing the version
+        assert_eq!(
+            index
+                .fetch_version("brya", "15000.12.0", &bucket)
+                .unwrap()
+                .map(|v| v.to_string()),
+            Some("R118-15000.12.0".to_string())
+        );
+        assert_eq!(
+            bucket.requests.borrow()[2],
+            vec![format!("{BUCKET}brya-release/R*-15000.12.0")]
+        );
+        assert!(
+            "R120-15662.0.0".parse::<CrosVersion>().unwrap()
+                < "R120-15662.1.0".parse::<CrosVersion>().unwrap()
+        );
+    }
+
+    #[test]
+    fn failed_refresh() {
+        let bucket = FakeBucket {
+            dirs: vec!["brya-release/R120-15662.0.0"],
+            ..Default::default()
+        };
+        let mut index = BoardIndex::default();
+        index.refresh("brya", &bucket).unwrap();
+        index.updated = 0;
+        bucket.broken.set(true);
+        assert!(index.refresh("brya", &bucket).is_err());
+        // The index is refreshed again on the next lookup
+        assert_eq!(index.updated, 0);
+        assert!(index.is_stale());
+    }
+}